@@ -5,31 +5,97 @@
  *
  * The code adapted the implicit list given on the CS:APP website.
  *
- * This code has 32 global variables (start_of_dllx) 
- * for the 32 buckets for the allocator, where x is the bucket number.
+ * Every arena has 32 buckets (start_of_dll[x]) for the allocator,
+ * where x is the bucket number, 0 to 31.
  *
- * Each bucket has its own size group (2^(x-1))to((2^x)-1) which is 
- * done as a explicit list.
+ * Each bucket has its own size group (2^x)to((2^(x+1))-1) which is
+ * done as a explicit list. A bit per bucket in the arena's bitmap is
+ * set while the bucket is non-empty.
  *
  * Each free block in the explicit list has 2 pointers to point to the
- * previous and next blocks.
+ * previous and next blocks. They are 32-bit offsets from heap_base,
+ * so the smallest free block is 16 bytes: header, 2 links and footer.
  *
- * The allocations(add/delete) are done using a global int variable (count) 
- * to find the appropriate bucket.
+ * Only free blocks have a footer. Instead, every header has a bit
+ * telling whether the block before it is allocated; the footer of
+ * the block before is read only when it is free, to coalesce.
  *
- * I added the free blocks to the appropriate list such that the list is in
- * ascending order.
+ * The allocations(add/delete) find the appropriate bucket with
+ * list_index, which is the position of the size's highest bit
+ * (count-leading-zeros), and the next non-empty bucket is the
+ * lowest bitmap bit above it (find-first-set).
  *
- * To find an appropriate free block, I used first-fit but stopped after 3
- * and go onto the next bigger sized bucket. 
+ * Free blocks go at the head of the small buckets' lists, in O(1).
+ * The buckets from TREE_LIST up are bitwise trees instead: each level
+ * down takes the next lower bit of the size, and blocks of the same
+ * size are chained behind the one in the tree. Adding, deleting and
+ * finding the best fit there go down one path, at most 32 levels, so
+ * they stay bounded however many free blocks there are.
+ *
+ * To find an appropriate free block in a small bucket, I used first-fit
+ * but stopped after 3 and go onto the next bigger sized bucket.
+ *
+ * Threads: the heap is split between NARENAS arenas, each with its own
+ * buckets and lock, and a thread sticks to the arena it was given the
+ * first time it allocated. An arena grows in chunks from mem_sbrk; a
+ * chunk that does not follow the arena's last one gets its own prologue
+ * and epilogue, so blocks never coalesce across arenas. The arena of an
+ * allocated block is kept in the top bits of its header.
+ *
+ * Small blocks that are freed go to the thread's cache (tcache) first,
+ * still marked allocated, and are handed out again without any lock.
+ * A block freed by a thread of another arena is put on that arena's
+ * remote list (a lock-free stack), which the arena empties the next
+ * time it allocates, unless the arena's lock is free right away.
+ *
+ * Slabs: requests of up to SLAB_MAX bytes do not get a block at all.
+ * They come from slab pages, SLAB_SIZE bytes aligned to their size,
+ * each cut into objects of one size class (8, 16, .. 64 bytes) with
+ * no header or footer. The page's own header at its start has the
+ * list of its free objects, so freeing one is pushing it there. Slab
+ * pages are taken from mem_sbrk SLAB_GROW at a time, outside of any
+ * chunk, and a bit per page in slab_map tells a slab object from a
+ * block. An arena keeps the pages of each class that have room; a
+ * page that empties goes back to free_slabs for any class to use.
+ *
+ * Large: requests of mmap_threshold bytes and up get a mapping of
+ * their own instead, which munmap gives back as soon as they are
+ * freed. Freeing one raises mmap_threshold to its size (up to
+ * MMAP_THRESHOLD_MAX), so sizes that come and go all the time end up
+ * in the heap rather than in a system call each. The heap cannot
+ * shrink (memlib has no negative sbrk), but when the free block at
+ * the top of an arena grows past trim_threshold its pages are dropped
+ * with madvise, so a heap that once peaked does not keep holding the
+ * memory.
+ *
+ * Growth: an arena extends the heap by CHUNKSIZE at first, doubling
+ * every time it runs out again soon after (within GROW_WINDOW of its
+ * allocations), so a ramp takes a few mem_sbrk calls rather than one
+ * per chunk. An extension is at most GROW_MAX, and at most
+ * 1/GROW_SHARE of what the arena already has so that the unused end
+ * stays small next to the heap. An arena that has not grown for
+ * GROW_IDLE allocations starts over from CHUNKSIZE, and drops the top
+ * block's pages past IDLE_TRIM rather than trim_threshold.
+ *
+ * Statistics: each arena counts, under its lock, the bytes it has
+ * given out, its free bytes per bucket, its allocations per bucket
+ * and how many blocks find_fit looked at. Allocations from a tcache
+ * are counted in the tcache, and added to the arena's once there are
+ * TCACHE_UNCOUNTED of them, so they stay lock-free. mm_stats prints
+ * it all, like malloc_stats. mm_profile(rate) turns on a sampling
+ * heap profiler: about one allocation per rate bytes has its call
+ * site recorded, and mm_stats lists the sites with the most bytes.
  */
- 
+
+#define _GNU_SOURCE     /* mremap */
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -59,731 +125,1895 @@
 
 /* $begin mallocmacros */
 /* Basic constants and macros */
-#define WSIZE       4       /* Word and header/footer size (bytes) */ 
+#define WSIZE       4       /* Word and header/footer size (bytes) */
 #define DSIZE       8       /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1<<9)   /* Extend heap by this amount (bytes) */  
-#define min_size    24      /* This is the minimum required size for free block */ 
-
-#define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define CHUNKSIZE  (1<<9)   /* Extend heap by at least this amount (bytes) */
+#define min_size    16      /* This is the minimum required size for free block */
+
+/* Threads */
+#define NARENAS      8      /* Arenas the threads are spread over */
+#define ARENA_SHIFT  28     /* Arena of an allocated block, top 4 header bits */
+#define MAX_BLOCK    (1u << ARENA_SHIFT)  /* So blocks are smaller than this */
+#define TCACHE_MAX   128    /* Largest block kept in a thread's cache */
+#define TCACHE_COUNT 7      /* Blocks kept per bin before they go back */
+#define TCACHE_UNCOUNTED 256  /* Allocations it serves before they are counted */
+
+/* Slabs */
+#define SLAB_MAX     64     /* Largest request served from a slab */
+#define SLAB_CLASSES (SLAB_MAX / DSIZE)
+#define SLAB_SHIFT   12
+#define SLAB_SIZE    (1 << SLAB_SHIFT)  /* A slab page, aligned to its size */
+#define SLAB_GROW    16     /* Slab pages taken from mem_sbrk at a time */
+#define GROW_MAX     (1<<20)  /* Largest extension, unless a block needs more */
+#define GROW_SHARE   32       /* Extensions are at most 1/32 of the arena */
+#define GROW_WINDOW  4096     /* Allocations within which growth doubles */
+#define GROW_IDLE    (64*GROW_WINDOW)  /* Allocations without growth, idle */
+#define IDLE_TRIM    (64*1024)  /* Top block pages dropped once idle */
+#define MMAP_THRESHOLD (128*1024)  /* Requests this big get their own mapping */
+#define MMAP_THRESHOLD_MAX (32*1024*1024)  /* It rises no higher than this */
+#define HEAP_SPAN    (1ul << 32)        /* Links are 32-bit offsets */
+#define SLAB_PAGES   (HEAP_SPAN >> SLAB_SHIFT)  /* Pages slab_map covers */
+
+/* Profiler */
+#define PROFILE_SITES 256    /* Call sites recorded at most */
+#define PROFILE_TOP   10     /* Sites mm_stats lists */
+
+/* The tcache has a bin per slab class, then one per block size */
+#define TCACHE_BINS  (SLAB_CLASSES + (TCACHE_MAX - min_size) / DSIZE + 1)
+#define TCACHE_BIN(size) (SLAB_CLASSES + ((size) - min_size) / DSIZE)
+
+#define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
-#define PACK(size, alloc)  ((size) | (alloc)) 
+#define PACK(size, alloc)  ((size) | (alloc))
+#define PREV_ALLOC   0x2    /* Header bit: the block before is allocated */
+#define MMAPPED      0x4    /* Header bit: the block is a mapping of its own */
 
 /* Read and write a word at address p */
-#define GET(p)       (*(unsigned int *)(p))            
-#define PUT(p, val)  (*(unsigned int *)(p) = (val))    
+#define GET(p)       (*(unsigned int *)(p))
+#define PUT(p, val)  (*(unsigned int *)(p) = (val))
+
+/* Free-list links are offsets from heap_base, 0 for NULL */
+#define TO_OFF(ptr)    ((ptr) == NULL ? 0u : \
+                        (unsigned int)((char *)(ptr) - heap_base))
+#define FROM_OFF(off)  ((off) == 0 ? NULL : \
+                        (unsigned long *)(heap_base + (off)))
 
 /* Put ptr address at the address p */
-#define PUT_ADDRESS(p, ptr)  (*((unsigned long *)(p)) = ((unsigned long)(ptr)))   
+#define PUT_ADDRESS(p, ptr)  (*(p) = TO_OFF(ptr))
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p)  (GET(p) & ~0x7)                   
-#define GET_ALLOC(p) (GET(p) & 0x1)                    
-
-/* Given block ptr bp, compute address of its header and footer */
-#define HDRP(bp)       ((char *)(bp) - WSIZE)                      
+#define GET_SIZE(p)  (GET(p) & ~0x7 & (MAX_BLOCK - 1))
+#define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_ARENA(p) (GET(p) >> ARENA_SHIFT)
+
+/* Given block ptr bp, compute address of its header and footer,
+   which only a free block has */
+#define HDRP(bp)       ((char *)(bp) - WSIZE)
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
 /* Given block ptr bp, compute address of its pred and succ in linked list of free blocks */
-#define PDRP(bp)    ((unsigned long *)(bp)) 
-#define SCRP(bp)    (((unsigned long *)(bp)) + 1)
+#define PDRP(bp)    ((unsigned int *)(bp))
+#define SCRP(bp)    (((unsigned int *)(bp)) + 1)
 
 /* To traverse list of free blocks */
-#define GET_NEXT(bp)  ((unsigned long *)(*(SCRP(bp))))
-#define GET_PREV(bp)  ((unsigned long *)(*(PDRP(bp))))
+#define GET_NEXT(bp)  FROM_OFF(*(SCRP(bp)))
+#define GET_PREV(bp)  FROM_OFF(*(PDRP(bp)))
+
+/* Free blocks in a tree bucket also have 2 children and a parent,
+   the parent of a chained block is NULL and of the root TREE_ROOT,
+   an offset no block is at */
+#define CHILDP(bp, i)    (((unsigned int *)(bp)) + 2 + (i))
+#define PARENTP(bp)      (((unsigned int *)(bp)) + 4)
+#define GET_CHILD(bp, i) FROM_OFF(*(CHILDP(bp, i)))
+#define GET_PARENT(bp)   FROM_OFF(*(PARENTP(bp)))
+#define LEFTMOST(bp)     ((GET_CHILD(bp, 0) != NULL) ? GET_CHILD(bp, 0) : \
+                          GET_CHILD(bp, 1))
+#define TREE_ROOT        ((unsigned long *)(heap_base + 1))
+
+/* First page boundary at or after p */
+#define PAGE_UP(p)     ((char *)(((size_t)(p) + page_size - 1) & \
+                                 ~(page_size - 1)))
+
+/* A mapped block has the mapping's length 2 words before its header */
+#define IS_MMAPPED(bp) (GET(HDRP(bp)) & MMAPPED)
+#define MMAP_LEN(bp)   (*(size_t *)((char *)(bp) - 2*DSIZE))
 
 /* Given block ptr bp, compute address of next and previous blocks */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* $end mallocmacros */
 
+#define NLISTS 32
+#define TREE_LIST 6         /* Buckets of 64 bytes and up are trees */
+
+/* The header at the start of a slab page */
+typedef struct slab
+{
+  struct slab *next, *prev;        /* Its class's pages with free objects */
+  void *free;                      /* Freed objects, linked by 1st word */
+  char *fresh;                     /* Objects never handed out start here */
+  struct arena *arena;
+  unsigned int size;               /* Of its objects */
+  unsigned int used, total;        /* Objects handed out, objects in all */
+} slab;
+
+/* An arena: its own 32 segregated lists and the lock for them */
+typedef struct arena
+{
+  pthread_mutex_t lock;
+  unsigned long *start_of_dll[NLISTS];
+  slab *slabs[SLAB_CLASSES];       /* Pages with room, per size class */
+  unsigned int bitmap;             /* Bit x set if bucket x is non-empty */
+  char *heap_end;                  /* Just past its last chunk */
+  char *trimmed;                   /* Top free block's pages dropped from
+                                      here up, NULL if not known */
+  size_t grow;                     /* Last extension of the heap */
+  size_t footprint;                /* Heap it has taken, in bytes */
+  unsigned long ops;               /* Allocations it has done */
+  unsigned long grown_at;          /* ops at its last extension */
+  void *remote;                    /* Freed by other threads, not taken back */
+  unsigned int tag;                /* Its number, in the header's top bits */
+  /* Statistics */
+  size_t in_use;                   /* Bytes of its blocks and objects given out */
+  size_t free_bytes[NLISTS];       /* Bytes of free blocks per bucket */
+  unsigned long calls[NLISTS];     /* Allocations per bucket of their size */
+  unsigned long fits, probes;      /* find_fit calls, blocks they looked at */
+} arena;
+
+/* A thread's cache of small blocks and slab objects */
+typedef struct tcache
+{
+  void *bins[TCACHE_BINS];
+  int counts[TCACHE_BINS];
+  unsigned int hits[TCACHE_BINS];  /* Taken from each bin, not counted yet */
+  unsigned int uncounted;          /* The sum of hits */
+  unsigned int epoch;              /* heap_epoch it was filled in */
+} tcache;
+
+/* A call site of the profiler, and the allocations sampled there */
+typedef struct profile_site
+{
+  void *pc;
+  unsigned long samples;
+  size_t bytes;                    /* Estimated bytes allocated there */
+} profile_site;
+
 /* Global variables */
-static char *heap_listp = 0;  /* Pointer to first block */  
-
-/* The 32 segregated lists */
-unsigned long *start_of_dll1 = NULL;   
-unsigned long *start_of_dll2 = NULL;  
-unsigned long *start_of_dll3 = NULL;   
-unsigned long *start_of_dll4 = NULL;
-unsigned long *start_of_dll5 = NULL;
-unsigned long *start_of_dll6 = NULL;
-unsigned long *start_of_dll7 = NULL;
-unsigned long *start_of_dll8 = NULL;
-unsigned long *start_of_dll9 = NULL;
-unsigned long *start_of_dll10 = NULL;
-unsigned long *start_of_dll11 = NULL;
-unsigned long *start_of_dll12 = NULL;
-unsigned long *start_of_dll13 = NULL;
-unsigned long *start_of_dll14 = NULL;
-unsigned long *start_of_dll15 = NULL;
-unsigned long *start_of_dll16 = NULL;
-unsigned long *start_of_dll17 = NULL;
-unsigned long *start_of_dll18 = NULL;
-unsigned long *start_of_dll19 = NULL;
-unsigned long *start_of_dll20 = NULL;
-unsigned long *start_of_dll21 = NULL;
-unsigned long *start_of_dll22 = NULL;
-unsigned long *start_of_dll23 = NULL;
-unsigned long *start_of_dll24 = NULL;
-unsigned long *start_of_dll25 = NULL;
-unsigned long *start_of_dll26 = NULL;
-unsigned long *start_of_dll27 = NULL;
-unsigned long *start_of_dll28 = NULL;
-unsigned long *start_of_dll29 = NULL;
-unsigned long *start_of_dll30 = NULL;
-unsigned long *start_of_dll31 = NULL;
-unsigned long *start_of_dll32 = NULL;
-/* Count is the index as to which bucket it is, given by function 'dealing_with_lists */
-int count=0;
+static char *heap_listp = 0;  /* Pointer to first block */
+static size_t page_size;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t trim_threshold = 2*MMAP_THRESHOLD;  /* Top block pages dropped */
+static arena arenas[NARENAS];
+static unsigned int next_arena = 0;   /* Given to the next new thread */
+static unsigned int heap_epoch = 0;   /* Bumped by mm_init, tcaches go stale */
+/* Held around mem_sbrk, and by the first mm_malloc to set up the heap */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Empties a thread's tcache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Slab pages: bit i of slab_map is set if page i from heap_base is one */
+static char *heap_base;                  /* Heap start, rounded down a page */
+static unsigned char slab_map[SLAB_PAGES / 8];
+static unsigned long slab_map_used = 0;  /* Bytes of slab_map ever set */
+static slab *free_slabs = NULL;          /* Empty pages, under heap_lock */
+static char *slab_next = NULL;           /* Pages not used yet, up to */
+static char *slab_end = NULL;            /* slab_end, under heap_lock */
+
+/* Mappings of large blocks, updated atomically */
+static size_t mmap_bytes = 0;
+static size_t mmap_peak = 0;
+static unsigned long mmap_calls = 0;
+
+/* Profiler, off while profile_rate is 0 */
+static size_t profile_rate = 0;
+static profile_site profile[PROFILE_SITES];
+static unsigned long profile_lost = 0;   /* Samples with no room left */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread arena *my_arena = NULL;
+static __thread tcache my_tcache;
+static __thread long profile_left;       /* Bytes to go until a sample */
+static __thread unsigned int profile_seed;
 
 
 /* Function prototypes for internal helper routines */
-static void *extend_heap(size_t words);
+static void *extend_heap(arena *a, size_t words);
 /* The third argument tells whether the block bp exists in the bucket list */
-static void place(void *bp, size_t asize, int d_number);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
-static void printblock(void *bp); 
-static void add_node(char *ptr);
-static void delete_node(char *ptr);
-unsigned long *dealing_with_lists(int counter, size_t size, unsigned long *ptr, int option);
+static void place(arena *a, void *bp, size_t asize, int d_number);
+static void *find_fit(arena *a, size_t asize);
+static void *coalesce(arena *a, void *bp);
+static void printblock(void *bp);
+static void add_node(arena *a, char *ptr);
+static void delete_node(arena *a, char *ptr);
+static void add_tree_node(arena *a, char *ptr, int count);
+static void delete_tree_node(arena *a, char *ptr, int count);
+static void tree_replace(arena *a, int count, unsigned long *x, 
+                         unsigned long *r);
+static void *tree_fit(arena *a, size_t asize, int count);
+static unsigned long *tree_smallest(unsigned long *t);
+static unsigned long *tree_largest(unsigned long *t);
+static void check_tree(unsigned long *t, int count);
+static void free_block(arena *a, void *bp);
+static int resize_block(arena *a, void *bp, size_t asize);
+static void trim_top(arena *a, char *bp);
+static void *mmap_alloc(size_t size);
+static void *mmap_resize(void *bp, size_t size);
+static void mmap_free(void *bp);
+static size_t adjust_size(size_t size);
+static size_t grow_size(arena *a, size_t asize);
+static void *slab_alloc(arena *a, int class);
+static void slab_free(arena *a, slab *s, void *bp);
+static slab *slab_page(arena *a);
+static int slab_grow(arena *a);
+static void release_block(void *bp);
+static void drain_remote(arena *a);
+static arena *thread_arena(void);
+static void *tcache_get(int i);
+static int tcache_put(void *bp, int i);
+static void tcache_flush(void *vargp);
+static void tcache_count(arena *a, tcache *tc);
+static void mmap_count(long len);
+static size_t largest_free(arena *a);
+static void profile_sample(size_t size, void *pc);
+static int compare_sites(const void *x, const void *y);
+static void make_tcache_key(void);
+static void heap_ready(void);
+
+/* Gives the bucket number (0 to 31) for a block size */
+static inline int list_index(size_t size);
 
 /* Given the count (index of appropriate bucket), returns the next non-empty bucket */
-unsigned long *next_list(int count);
+static inline unsigned long *next_list(arena *a, int count);
+
+/* The slab page of p, NULL if p is not a slab object */
+static inline slab *slab_of(void *p);
 
 
-/* 
+/*
  * mm_init - Initialize the memory manager
  * Initialize: return -1 on error, 0 on success.
- * Initialize all global variables 
+ * Initialize all global variables
+ *
+ * Not to be called while other threads use the heap
  */
-int mm_init(void) 
-{  
+int mm_init(void)
+{
+  char *listp;
+  int i;
+
+  /* Initialise the arenas and their 32 buckets */
+  for (i = 0; i < NARENAS; i++)
+  {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    memset(arenas[i].start_of_dll, 0, sizeof(arenas[i].start_of_dll));
+    memset(arenas[i].slabs, 0, sizeof(arenas[i].slabs));
+    arenas[i].bitmap = 0;
+    arenas[i].heap_end = NULL;
+    arenas[i].trimmed = NULL;
+    arenas[i].grow = 0;
+    arenas[i].footprint = 0;
+    arenas[i].ops = 0;
+    arenas[i].grown_at = 0;
+    arenas[i].remote = NULL;
+    arenas[i].tag = (unsigned int)i << ARENA_SHIFT;
+    arenas[i].in_use = 0;
+    memset(arenas[i].free_bytes, 0, sizeof(arenas[i].free_bytes));
+    memset(arenas[i].calls, 0, sizeof(arenas[i].calls));
+    arenas[i].fits = arenas[i].probes = 0;
+  }
+  /* Every thread's tcache points into the old heap */
+  heap_epoch++;
+
+  page_size = mem_pagesize();
+  mmap_threshold = MMAP_THRESHOLD;
+  trim_threshold = 2*MMAP_THRESHOLD;
+  mmap_bytes = mmap_peak = 0;
+  mmap_calls = 0;
+
+  /* No slab pages yet */
+  memset(slab_map, 0, slab_map_used);
+  slab_map_used = 0;
+  free_slabs = NULL;
+  slab_next = slab_end = NULL;
+
+  /* The heap is built in listp, heap_listp is only set once all of
+     it is there: heap_ready does not wait for threads that find it set */
+  heap_listp = 0;
+
   /* Create the initial empty heap */
-  if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
+  if ((listp = mem_sbrk(4*WSIZE)) == (void *)-1)
   {
     return -1;
   }
-  
-  /* Initialise the 32 buckets */
-  start_of_dll1 = NULL;   
-  start_of_dll2 = NULL;  
-  start_of_dll3 = NULL;   
-  start_of_dll4 = NULL;
-  start_of_dll5 = NULL;
-  start_of_dll6 = NULL;
-  start_of_dll7 = NULL;
-  start_of_dll8 = NULL;
-  start_of_dll9 = NULL;
-  start_of_dll10 = NULL;
-  start_of_dll11 = NULL;
-  start_of_dll12 = NULL;
-  start_of_dll13 = NULL;
-  start_of_dll14 = NULL;
-  start_of_dll15 = NULL;
-  start_of_dll16 = NULL;
-  start_of_dll17 = NULL;
-  start_of_dll18 = NULL;
-  start_of_dll19 = NULL;
-  start_of_dll20 = NULL;
-  start_of_dll21 = NULL;
-  start_of_dll22 = NULL;
-  start_of_dll23 = NULL;
-  start_of_dll24 = NULL;
-  start_of_dll25 = NULL;
-  start_of_dll26 = NULL;
-  start_of_dll27 = NULL;
-  start_of_dll28 = NULL;
-  start_of_dll29 = NULL;
-  start_of_dll30 = NULL;
-  start_of_dll31 = NULL;
-  start_of_dll32 = NULL;
-  /* Initialise the index of the buckets */
-  count=0;
-  
+  heap_base = (char *)((size_t)mem_heap_lo() & ~(size_t)(SLAB_SIZE - 1));
+
   /* Pointer used to pass in argument to coalesce if extend_heap returns non-null */
   unsigned long *tem;
-  
+
   /* Gotten from CS:APP */
-  PUT(heap_listp, 0);                          /* Alignment padding */
-  PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
-  PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */  
-  PUT(heap_listp + (3*WSIZE), PACK(0, 1));     /* Epilogue header */
-  heap_listp += (2*WSIZE);                      
+  PUT(listp, 0);                          /* Alignment padding */
+  PUT(listp + (1*WSIZE), PACK(DSIZE, 1)); /* Prologue header */
+  PUT(listp + (2*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+  PUT(listp + (3*WSIZE), PACK(0, 1) | PREV_ALLOC); /* Epilogue header */
+  arenas[0].heap_end = listp + (4*WSIZE);
+  listp += (2*WSIZE);
+
 
-  
   /* Extend the empty heap with a free block of CHUNKSIZE/WSIZE bytes */
-  if ((tem=extend_heap(CHUNKSIZE/WSIZE)) == NULL) 
+  if ((tem=extend_heap(&arenas[0], CHUNKSIZE/WSIZE)) == NULL)
   {
     return -1;
-  } 
+  }
   /* Extending the heap was successful, just coalesce it(which adds it to bucket) */
-  coalesce(tem);
+  coalesce(&arenas[0], tem);
+
+  /* Everything above is seen by whoever sees heap_listp set */
+  __atomic_store_n(&heap_listp, listp, __ATOMIC_RELEASE);
   return 0;
 }
 
 
 
 /*
- * mm_malloc: Almost same implementation as book, 
- * Changed how the place function was called based on whether 
+ * mm_malloc: Almost same implementation as book,
+ * Changed how the place function was called based on whether
  * extend_heap is called
+ *
+ * The thread's cache is tried first, then its arena under the lock.
+ * Small requests get an object from a slab instead of a block.
+ * The caller is recorded if the profiler samples the request.
  */
-void *mm_malloc (size_t size) 
+void *mm_malloc (size_t size)
 {
   size_t asize;      /* Adjusted block size */
   size_t extendsize; /* Amount to extend heap if no fit */
   char *bp;          /* Variable for giving the free blocks */
+  arena *a;
+  int class;
 
   /* Initialize heap if no heap */
-  if (heap_listp == 0)
-  {
-	mm_init();
-  }
-  
+  heap_ready();
+
   /* Ignore spurious requests */
   if (size == 0)
-  { 
+  {
     return NULL;
   }
-  
-  
-  /* Adjust block size to include overhead and alignment reqs. */
-  if (size <= DSIZE) 
-  {                                     
-    asize = 2*DSIZE;                                       
-  }  
-  else
+
+  if (profile_rate != 0)
   {
-	asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE); 
-  }	
-  /* Need space for a free-block, so check if at least equal to min_size */
-  asize = (asize>=min_size) ? asize:min_size;
+    profile_sample(size, __builtin_return_address(0));
+  }
+
+  /* Large, a mapping of its own (headers cannot hold sizes past MAX_BLOCK) */
+  if (size >= mmap_threshold)
+  {
+    return mmap_alloc(size);
+  }
+
+  /* Small, from a slab of its size class */
+  if (size <= SLAB_MAX)
+  {
+    class = (size - 1) / DSIZE;
+    if ((bp = tcache_get(class)) != NULL)
+    {
+      return bp;
+    }
+    a = thread_arena();
+    pthread_mutex_lock(&a->lock);
+    drain_remote(a);
+    if (my_tcache.uncounted >= TCACHE_UNCOUNTED)
+    {
+      tcache_count(a, &my_tcache);
+    }
+    a->ops++;
+    a->calls[list_index((class + 1) * DSIZE)]++;
+    bp = slab_alloc(a, class);
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+  }
+
+  asize = adjust_size(size);
+
+  /* A block of this size freed by this thread, no lock needed */
+  if (asize <= TCACHE_MAX && (bp = tcache_get(TCACHE_BIN(asize))) != NULL)
+  {
+    return bp;
+  }
+
+  a = thread_arena();
+  pthread_mutex_lock(&a->lock);
+  drain_remote(a);
+  if (my_tcache.uncounted >= TCACHE_UNCOUNTED)
+  {
+    tcache_count(a, &my_tcache);
+  }
+  a->ops++;
+  a->calls[list_index(asize)]++;
 
   /* Search the free list for a fit */
-  if ((bp = find_fit(asize)) != NULL)   
+  if ((bp = find_fit(a, asize)) != NULL)
   {
-	place(bp, asize,0);  /* The third argument is 0 to show the block exists in bucket */                 
+	place(a, bp, asize,0);  /* The third argument is 0 to show the block exists in bucket */
+	pthread_mutex_unlock(&a->lock);
 	return bp;
   }
 
   /* No fit found. Get more memory and place the block */
-  extendsize = MAX(asize,CHUNKSIZE);                 
-  if ((bp = extend_heap(extendsize/WSIZE)) == NULL)  
-  { 
-	return NULL;                                 
+  extendsize = grow_size(a, asize);
+  if ((bp = extend_heap(a, extendsize/WSIZE)) != NULL)
+  {
+    /* The third argument is since right after extending, the block does not exist in bucket */
+    place(a, bp, asize,1);
   }
-  /* The third argument is since right after extending, the block does not exist in bucket */
-  place(bp, asize,1);                        
+  pthread_mutex_unlock(&a->lock);
   return bp;
-} 
+}
 
 
 /*
- * mm_free: Same code as from the book, 
+ * mm_free: Same code as from the book,
  * Coalesce is called since there is a newly freed node
+ *
+ * Small blocks and slab objects stay in the thread's cache while
+ * there is room
  */
-void mm_free (void *ptr) 
+void mm_free (void *ptr)
 {
+  slab *s;
+  size_t size;
+  int bin = -1;
+
   /* Pointer to be freed is NULL */
-  if(ptr == NULL) 
+  if(ptr == NULL)
   {
 	return;
-  }	
+  }
+
+  /* The heap has not been initilized */
+  heap_ready();
+
   /* If non-NULL pointer, can get its size */
-  size_t size = GET_SIZE(HDRP(ptr));
-    
-  /* The heap has not been initilized */  
-  if (heap_listp == 0)
+  if ((s = slab_of(ptr)) != NULL)
   {
-	mm_init();
+    bin = s->size / DSIZE - 1;
+  }
+  else if (IS_MMAPPED(ptr))
+  {
+    mmap_free(ptr);
+    return;
+  }
+  else if ((size = GET_SIZE(HDRP(ptr))) <= TCACHE_MAX)
+  {
+    bin = TCACHE_BIN(size);
   }
- 
-  /* Set header & footer for the newly freed block */
-  PUT(HDRP(ptr), PACK(size, 0));
-  PUT(FTRP(ptr), PACK(size, 0)); 
-  /* Call coalesce since we have a new free block */
-  coalesce(ptr);
-}
 
+  if (bin >= 0 && tcache_put(ptr, bin))
+  {
+    return;
+  }
+  release_block(ptr);
+}
 
 
 
 /*
- * Based on the 4 cases, if a free block is adjacent to newly
- * freed block, delete the block if need be.
- *
- * Add the new, possibly bigger free block by getting new pointer
- * based on the updated size
+ * free_block: the book's mm_free, for a block or slab object of
+ * arena a, called with a's lock held
  */
-static void *coalesce(void *bp) 
+static void free_block(arena *a, void *bp)
 {
-  /* Variables to check adjacent blocks if free */
-  size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-  size_t size = GET_SIZE(HDRP(bp));
-
-  if (prev_alloc && next_alloc)            // Case 1 
-  {	
-    add_node(bp); /* Added here */
-    return bp;
-  }
+  slab *s;
+  size_t size;
 
-  else if (prev_alloc && !next_alloc)      // Case 2
+  if ((s = slab_of(bp)) != NULL)
   {
-	delete_node(NEXT_BLKP(bp)); /* Deleted here */
-	size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size,0));
-	add_node(bp); /* Added here */
-	
-  }
-
-  else if (!prev_alloc && next_alloc)      // Case 3 
-  { 
-    delete_node(PREV_BLKP(bp)); /* Deleted here */
-	size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-	PUT(FTRP(bp), PACK(size, 0));
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-	bp = PREV_BLKP(bp);
-	add_node(bp); /* Added here */
-	
+    slab_free(a, s, bp);
+    return;
   }
+  size = GET_SIZE(HDRP(bp));
+  a->in_use -= size;
 
-  else                                     // Case 4 
-  {
-	delete_node(NEXT_BLKP(bp)); /* Deleted here */
-    delete_node(PREV_BLKP(bp)); /* Deleted here */
-	size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-	bp = PREV_BLKP(bp);
-	add_node(bp); /* Added here */
-	
-  }
-  return bp;
+  /* Set header & footer for the newly freed block, and tell the next one */
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+  PUT(FTRP(bp), PACK(size, 0));
+  PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) & ~PREV_ALLOC);
+  /* Call coalesce since we have a new free block */
+  trim_top(a, coalesce(a, bp));
 }
 
 
 
 /*
- * Similar to implicit file,
- * no changes were made
+ * trim_top: drop the pages of the free block bp if it is at the
+ * top of a's heap and more than trim_threshold bytes of it still
+ * have theirs (IDLE_TRIM if a has been idle), called with a's lock
+ * held. The links at its start and the footer are kept.
  */
-void *mm_realloc(void *oldptr, size_t size) 
+static void trim_top(arena *a, char *bp)
 {
-  size_t oldsize;
-  void *newptr;
-  
-  /* If size == 0 then this is just free, and we return NULL. */
-  if(size == 0) 
+  char *lo, *hi;
+  size_t limit;
+
+  if (NEXT_BLKP(bp) != a->heap_end)
   {
-	mm_free(oldptr);
-	return 0;
+    return;
   }
-  
-  /* If oldptr is NULL, then this is just malloc. */
-  if(oldptr == NULL) 
+  lo = PAGE_UP((char *)PARENTP(bp) + WSIZE);
+  hi = (char *)((size_t)FTRP(bp) & ~(page_size - 1));
+  if (a->trimmed != NULL && a->trimmed < hi)
   {
-	return mm_malloc(size);
+    hi = a->trimmed;            /* Dropped already from there up */
   }
-  
-  newptr = mm_malloc(size);
-  
-  /* If realloc() fails the original block is left untouched  */
-  if(!newptr) 
+  limit = (a->ops - a->grown_at > GROW_IDLE) ? IDLE_TRIM : trim_threshold;
+  if (lo + limit <= hi && madvise(lo, hi - lo, MADV_DONTNEED) == 0)
   {
-	return 0;
+    a->trimmed = lo;
   }
-  
-  /* Copy the old data. */
-  oldsize = GET_SIZE(HDRP(oldptr));
-  if(size < oldsize) oldsize = size;
-    memcpy(newptr, oldptr, oldsize);
+}
 
-  /* Free the old block. */
-  mm_free(oldptr);
 
-  return newptr;
-}
 
 /*
- * calloc - Refer to mm-native.c,
- * copied from mm-naive.c
+ * slab_alloc: an object of size class class from one of a's slab
+ * pages, called with a's lock held. NULL if no page can be had.
  */
-void *mm_calloc (size_t nmemb, size_t size) 
+static void *slab_alloc(arena *a, int class)
 {
-  size_t bytes = nmemb * size;
-  void *newptr;
+  slab *s = a->slabs[class];
+  void *bp;
 
-  newptr = malloc(bytes);
-  memset(newptr, 0, bytes);
+  if (s == NULL)
+  {
+    /* A new page for the class */
+    if ((s = slab_page(a)) == NULL)
+    {
+      return NULL;
+    }
+    s->next = s->prev = NULL;
+    s->free = NULL;
+    s->fresh = (char *)s + ALIGN(sizeof(slab));
+    s->arena = a;
+    s->size = (class + 1) * DSIZE;
+    s->used = 0;
+    s->total = (SLAB_SIZE - ALIGN(sizeof(slab))) / s->size;
+    a->slabs[class] = s;
+  }
 
-  return newptr;
-}
+  if ((bp = s->free) != NULL)
+  {
+    s->free = *(void **)bp;
+  }
+  else
+  {
+    bp = s->fresh;
+    s->fresh += s->size;
+  }
 
+  a->in_use += s->size;
 
-/*
- * Returns whether the pointer is in the heap. Used in check_heap.
-*/ 
-static int in_heap(const void *p) 
-{
-  return p <= mem_heap_hi() && p >= mem_heap_lo();
+  /* A full page leaves the list, it is always the first one */
+  if (++s->used == s->total)
+  {
+    a->slabs[class] = s->next;
+    if (s->next != NULL)
+    {
+      s->next->prev = NULL;
+    }
+  }
+  return bp;
 }
 
 
-/*
- * Returns whether the pointer is aligned. Used in check_heap.
-*/
-static int aligned(const void *p) 
-{
-  return (size_t)ALIGN(p) == (size_t)p;
-}
 
- 
 /*
- * mm_checkheap: Checks various things in the heap
+ * slab_free: put bp back in its page s of arena a, called with a's
+ * lock held. A page that was full goes back on its class's list, an
+ * empty one to free_slabs unless it is the only one of its class.
  */
-void mm_checkheap(int lineno) 
+static void slab_free(arena *a, slab *s, void *bp)
 {
-  lineno = lineno;
-  char *bp = heap_listp;  
-  /* Variable to store the pointer to free blocks */
-  unsigned long *hare = NULL;
-  unsigned long *tortoise = NULL;
+  int class = s->size / DSIZE - 1;
 
-  hare = dealing_with_lists(count,0,NULL,1);
-  tortoise = dealing_with_lists(count,0,NULL,1);;
-    
-  /* To check for pointer consistency in bucket*/  
-  while(hare!=NULL && (GET_NEXT(hare)!=NULL))
+  *(void **)bp = s->free;
+  s->free = bp;
+  a->in_use -= s->size;
+
+  if (s->used-- == s->total)
   {
-    if (GET_PREV(GET_NEXT(hare)) != hare)
+    s->prev = NULL;
+    s->next = a->slabs[class];
+    if (s->next != NULL)
     {
-      printf("Pointer inconsistency\n");
-      exit(1);
+      s->next->prev = s;
     }
-    hare = GET_NEXT(hare);
+    a->slabs[class] = s;
   }
-    
-  /* To check for cycles in the double linked list */
-  while(tortoise != NULL)
+  else if (s->used == 0 && (s->prev != NULL || s->next != NULL))
   {
-    if (((GET_NEXT(tortoise))!=NULL) && 
-    (GET_NEXT(hare) !=NULL) && (GET_NEXT(GET_NEXT(hare)))!=NULL)
+    if (s->prev != NULL)
     {
-      tortoise = GET_NEXT(tortoise);
-      hare = GET_NEXT(GET_NEXT(hare));
-      if (hare == tortoise) 
-      {
-        printf("HARE = [%p] TORTOISE = [%p]\n",hare,tortoise);
-        exit(1);
-      }
+      s->prev->next = s->next;
     }
     else
     {
-      break;
+      a->slabs[class] = s->next;
     }
+    if (s->next != NULL)
+    {
+      s->next->prev = s->prev;
+    }
+    pthread_mutex_lock(&heap_lock);
+    s->next = free_slabs;
+    free_slabs = s;
+    pthread_mutex_unlock(&heap_lock);
   }
+}
 
-  /*Checks if the block is in the heap */
-  if ((in_heap(bp))==0)
-    printf("Current pointer is not in heap!!!\n");
-    
-  /*Checks if the block is aligned */
-  if((aligned(bp))==0)
-    printf("Current pointer is not aligned!!!\n");  
-    
-  /*Checks if the block prologue is right */
-  if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
-    printf("Bad prologue header\n");
-    
-  /*Checks if the block epilogue is right*/
-  if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-    printf("Bad epilogue header\n");
- 
-   /*Checks if the block is aligned*/
-  if ((size_t)bp % 8)
-    printf("Error: %p is not doubleword aligned\n", bp);
-  /*Checks if the block header matches footer*/  
-  if (GET(HDRP(bp)) != GET(FTRP(bp)))
-    printf("Error: header does not match footer\n");
 
-  /* Prints out the whole heap and checkes headers,footers,size,alignment */
-  for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) 
+
+/*
+ * slab_page: an unused slab page, an emptied one if there is any,
+ * called with a's lock held. NULL if the heap cannot grow.
+ */
+static slab *slab_page(arena *a)
+{
+  slab *s = NULL;
+
+  pthread_mutex_lock(&heap_lock);
+  if (free_slabs != NULL)
   {
-    printblock(bp);        /* This function prints the heap at the bp block */
-    if ((size_t)bp % 8)
-	  printf("Error: %p is not doubleword aligned\n", bp);
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
-	  printf("Error: header does not match footer\n");
-    if (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
-	  printf("Error: Sizes dont match\n");
+    s = free_slabs;
+    free_slabs = s->next;
   }
-  return;
+  else if (slab_next != slab_end || slab_grow(a))
+  {
+    s = (slab *)slab_next;
+    slab_next += SLAB_SIZE;
+  }
+  pthread_mutex_unlock(&heap_lock);
+  return s;
 }
 
 
+
 /*
- * This function is used by check_heap to print the block specifications,
- * and if block is empty, it prints its next and previous pointers.
- *
- * This helps in checking if the pointers are valid.
+ * slab_grow: take SLAB_GROW more pages from mem_sbrk, called with
+ * heap_lock and a's lock held. Returns 0 if the heap cannot grow.
  *
-*/
-static void printblock(void *bp) 
+ * The pages have to be aligned to SLAB_SIZE. The gap up to the first
+ * one becomes a chunk of a with one free block in it, so it is made
+ * big enough to hold one.
+ */
+static int slab_grow(arena *a)
 {
-  if (GET_SIZE(HDRP(bp)) == 0) 
+  char *bp = (char *)mem_heap_hi() + 1;
+  size_t pad = (SLAB_SIZE - ((size_t)bp & (SLAB_SIZE - 1))) & (SLAB_SIZE - 1);
+  unsigned long page;
+
+  if (pad != 0 && pad < 2*DSIZE + min_size)
   {
-    printf("%p: EOL\n", bp);
- 	return;
+    pad += SLAB_SIZE;
   }
-  
-  printf("%p: header: [%d:%d] footer: [%d:%d]\n", bp, 
-	     GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)), 
-	     GET_SIZE(FTRP(bp)), GET_ALLOC(FTRP(bp)));
-  if (GET_ALLOC(HDRP(bp))== 0)
+  if ((page = (bp + pad - heap_base) >> SLAB_SHIFT) + SLAB_GROW > SLAB_PAGES ||
+      mem_sbrk(pad + SLAB_GROW * SLAB_SIZE) == (void *)-1)
+  {
+    return 0;
+  }
+
+  if (pad != 0)
+  {
+    PUT(bp, 0);                                  /* Alignment padding */
+    PUT(bp + (1*WSIZE), PACK(DSIZE, 1));         /* Prologue header */
+    PUT(bp + (2*WSIZE), PACK(DSIZE, 1));         /* Prologue footer */
+    bp += 2*DSIZE;
+    PUT(HDRP(bp), PACK(pad - 2*DSIZE, 0) | PREV_ALLOC);  /* Free block header */
+    PUT(FTRP(bp), PACK(pad - 2*DSIZE, 0));       /* Free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));        /* Epilogue header */
+    add_node(a, bp);
+  }
+
+  slab_next = (char *)mem_heap_hi() + 1 - SLAB_GROW * SLAB_SIZE;
+  slab_end = slab_next + SLAB_GROW * SLAB_SIZE;
+  for (; page < (unsigned long)(slab_end - heap_base) >> SLAB_SHIFT; page++)
   {
-    printf("GET_PREV(bp)=%p, GET_NEXT(bp)=%p\n",GET_PREV(bp),GET_NEXT(bp));
-  }	     
+    slab_map[page >> 3] |= 1 << (page & 7);
+  }
+  slab_map_used = MAX(slab_map_used, (page + 7) >> 3);
+  return 1;
 }
 
 
 
 /*
- * This uses the mem_sbrk function to extend the heap
- * and return the address of the newly allocated block
- * with head and footer and epilogue set
-*/ 
-static void *extend_heap(size_t words) 
+ * release_block: give bp back to the arena it came from. A block of
+ * another thread's arena is freed there if its lock is free, else
+ * left on its remote list
+ */
+static void release_block(void *bp)
 {
-  /* Variables for calculations */
-  char *bp;
-  size_t size;
-
-  /* Allocate an even number of words to maintain alignment */
-  size = (words % 2) ? (words+1) * WSIZE : words * WSIZE; 
-  if ((long)(bp = mem_sbrk(size)) == -1)  
-	return NULL;                                       
-
-  /* Initialize free block header/footer and the epilogue header */
-  PUT(HDRP(bp), PACK(size, 0));         /* Free block header */   
-  PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */   
-  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */ 
+  slab *s = slab_of(bp);
+  arena *a = (s != NULL) ? s->arena : &arenas[GET_ARENA(HDRP(bp))];
+  void *old;
 
-  /* Just return the pointer and let the function which called it coalesce it */
-  return bp;
+  if (a == my_arena)
+  {
+    pthread_mutex_lock(&a->lock);
+  }
+  else if (pthread_mutex_trylock(&a->lock) != 0)
+  {
+    do
+    {
+      old = a->remote;
+      *(void **)bp = old;
+    } while (!__sync_bool_compare_and_swap(&a->remote, old, bp));
+    return;
+  }
+  free_block(a, bp);
+  pthread_mutex_unlock(&a->lock);
 }
 
 
-/* 
- * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size
- * 
- * The third variable (d_number) is set to 1 if the block bp is already 
- * added to a bucket, and thus needs to be deleted
- * Else, there is no need to delete it
- *
- * The left over free space in the block is added to list
- * if it meets the min_size criteria
+
+/*
+ * drain_remote: free the blocks other threads left on a's
+ * remote list, called with a's lock held
  */
-static void place(void *bp, size_t asize, int d_number)
+static void drain_remote(arena *a)
 {
-  /* Set the variables */
-  void *temp = bp;
-  size_t csize = GET_SIZE(HDRP(bp));  
-  
-  /* Check if the block has leftover space */
-  if ((csize - asize) >= (2*DSIZE)) 
-  { 
-    if (d_number==0) delete_node(bp);
-    
-    PUT(HDRP(bp), PACK(asize, 1));
-    PUT(FTRP(bp), PACK(asize, 1));
-    bp = NEXT_BLKP(bp); 
-    
-    /* If leftover space is enough to form a free block */
-    if ((csize-asize)>=min_size)
-    {
-	  PUT(HDRP(bp), PACK(csize-asize, 0));
-	  PUT(FTRP(bp), PACK(csize-asize, 0));
-	  add_node(bp);
-    } 
-    /* Else we use the free space as padding(bad util?) */
-    else
-    {
-	  PUT(HDRP(temp), PACK(csize, 1));
-	  PUT(FTRP(temp), PACK(csize, 1));
-    }
+  void *bp, *next;
+
+  if (a->remote == NULL)
+  {
+    return;
   }
-  /* If no free space */
-  else 
-  { 
-    if (d_number==0) delete_node(bp);
-    
-    PUT(HDRP(bp), PACK(csize, 1));
-    PUT(FTRP(bp), PACK(csize, 1));
+  bp = __sync_lock_test_and_set(&a->remote, NULL);
+  while (bp != NULL)
+  {
+    next = *(void **)bp;
+    free_block(a, bp);
+    bp = next;
   }
 }
 
 
-/* 
- * find_fit - Find a fit for a block with asize bytes 
- *
- * Since the buckets are ordered, we just go through the bucket 
- * at most counter_max amount of times before moving on to the
- * next bucket.
- *
- * If nothing found after checking all buckets, return NULL
- *
- * Since buckets and each explicit list in bucket increase in size,
- * just traversing through the list is good to find block
- */
-static void *find_fit(size_t asize)
+
+/*
+ * thread_arena: the calling thread's arena, the threads are given
+ * them in turn the first time they need one
+ */
+static arena *thread_arena(void)
+{
+  if (my_arena == NULL)
+  {
+    my_arena = &arenas[__sync_fetch_and_add(&next_arena, 1) % NARENAS];
+    /* So the tcache is emptied when the thread exits */
+    pthread_once(&tcache_once, make_tcache_key);
+    pthread_setspecific(tcache_key, &my_tcache);
+  }
+  return my_arena;
+}
+
+
+
+/*
+ * tcache_get: a cached block or object from bin i, NULL if none
+ */
+static void *tcache_get(int i)
+{
+  tcache *tc = &my_tcache;
+  void *bp;
+
+  if (tc->epoch != heap_epoch)
+  {
+    /* The heap was started over since these were cached */
+    memset(tc, 0, sizeof(tcache));
+    tc->epoch = heap_epoch;
+    return NULL;
+  }
+  if ((bp = tc->bins[i]) == NULL)
+  {
+    return NULL;
+  }
+  tc->bins[i] = *(void **)bp;
+  tc->counts[i]--;
+  tc->hits[i]++;
+  tc->uncounted++;
+  return bp;
+}
+
+
+
+/*
+ * tcache_put: keep the allocated block or object bp in bin i of the
+ * thread's cache, returns 0 if the bin is full
+ */
+static int tcache_put(void *bp, int i)
+{
+  tcache *tc = &my_tcache;
+
+  thread_arena();
+  if (tc->epoch != heap_epoch)
+  {
+    memset(tc, 0, sizeof(tcache));
+    tc->epoch = heap_epoch;
+  }
+  if (tc->counts[i] >= TCACHE_COUNT)
+  {
+    return 0;
+  }
+  *(void **)bp = tc->bins[i];
+  tc->bins[i] = bp;
+  tc->counts[i]++;
+  return 1;
+}
+
+
+
+/*
+ * tcache_flush: give every block in the exiting thread's cache
+ * back to its arena
+ */
+static void tcache_flush(void *vargp)
+{
+  tcache *tc = (tcache *)vargp;
+  void *bp;
+  int i;
+
+  if (tc->epoch != heap_epoch)
+  {
+    return;
+  }
+  for (i = 0; i < TCACHE_BINS; i++)
+  {
+    while ((bp = tc->bins[i]) != NULL)
+    {
+      tc->bins[i] = *(void **)bp;
+      release_block(bp);
+    }
+    tc->counts[i] = 0;
+  }
+  if (tc->uncounted != 0 && my_arena != NULL)
+  {
+    pthread_mutex_lock(&my_arena->lock);
+    tcache_count(my_arena, tc);
+    pthread_mutex_unlock(&my_arena->lock);
+  }
+}
+
+
+
+/*
+ * tcache_count: add the allocations tc served since the last time
+ * to the counts of arena a, called with a's lock held
+ */
+static void tcache_count(arena *a, tcache *tc)
+{
+  int i;
+
+  for (i = 0; i < TCACHE_BINS; i++)
+  {
+    if (tc->hits[i] != 0)
+    {
+      a->calls[list_index(i < SLAB_CLASSES ? (i + 1) * DSIZE :
+                          min_size + (i - SLAB_CLASSES) * DSIZE)] += tc->hits[i];
+      tc->hits[i] = 0;
+    }
+  }
+  tc->uncounted = 0;
+}
+
+
+
+static void make_tcache_key(void)
+{
+  pthread_key_create(&tcache_key, tcache_flush);
+}
+
+
+
+/*
+ * heap_ready: set up the heap if no one has yet, only once
+ * even if threads race to do it. The acquire load pairs with the
+ * release store at the end of mm_init, so a thread that skips the
+ * lock sees the whole heap mm_init built.
+ */
+static void heap_ready(void)
+{
+  if (__atomic_load_n(&heap_listp, __ATOMIC_ACQUIRE) != 0)
+  {
+    return;
+  }
+  pthread_mutex_lock(&init_lock);
+  if (heap_listp == 0)
+  {
+    mm_init();
+  }
+  pthread_mutex_unlock(&init_lock);
+}
+
+
+
+
+/*
+ * Based on the 4 cases, if a free block is adjacent to newly
+ * freed block, delete the block if need be.
+ *
+ * Add the new, possibly bigger free block by getting new pointer
+ * based on the updated size
+ */
+static void *coalesce(arena *a, void *bp)
+{
+  /* Variables to check adjacent blocks if free */
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (prev_alloc && next_alloc)            // Case 1
+  {
+    add_node(a, bp); /* Added here */
+    return bp;
+  }
+
+  else if (prev_alloc && !next_alloc)      // Case 2
+  {
+	delete_node(a, NEXT_BLKP(bp)); /* Deleted here */
+	size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+	PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
+	PUT(FTRP(bp), PACK(size,0));
+	add_node(a, bp); /* Added here */
+
+  }
+
+  else if (!prev_alloc && next_alloc)      // Case 3
+  {
+    delete_node(a, PREV_BLKP(bp)); /* Deleted here */
+	size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+	PUT(FTRP(bp), PACK(size, 0));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
+	bp = PREV_BLKP(bp);
+	add_node(a, bp); /* Added here */
+
+  }
+
+  else                                     // Case 4
+  {
+	delete_node(a, NEXT_BLKP(bp)); /* Deleted here */
+    delete_node(a, PREV_BLKP(bp)); /* Deleted here */
+	size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
+		    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
+	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+	bp = PREV_BLKP(bp);
+	add_node(a, bp); /* Added here */
+
+  }
+  return bp;
+}
+
+
+
+/*
+ * adjust_size: the block size for a request of size bytes
+ */
+static size_t adjust_size(size_t size)
+{
+  size_t asize;
+
+  /* Adjust block size to include overhead and alignment reqs.
+     An allocated block only has a header */
+  if (size <= DSIZE + WSIZE)
+  {
+    asize = 2*DSIZE;
+  }
+  else
+  {
+	asize = DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+  }
+  /* Need space for a free-block, so check if at least equal to min_size */
+  return (asize>=min_size) ? asize:min_size;
+}
+
+
+
+/*
+ * grow_size: how much to extend a's heap by for a block of asize
+ * bytes, called with a's lock held. Doubles the last extension if
+ * it was recent, within GROW_MAX and a's footprint / GROW_SHARE,
+ * else starts over from CHUNKSIZE.
+ */
+static size_t grow_size(arena *a, size_t asize)
+{
+  size_t cap = MIN(GROW_MAX, a->footprint / GROW_SHARE) & ~(size_t)(DSIZE-1);
+
+  if (a->grow != 0 && a->ops - a->grown_at < GROW_WINDOW)
+  {
+    a->grow = MIN(2 * a->grow, MAX(cap, CHUNKSIZE));
+  }
+  else
+  {
+    a->grow = CHUNKSIZE;
+  }
+  a->grown_at = a->ops;
+  return MAX(asize, a->grow);
+}
+
+
+
+/*
+ * Similar to implicit file, but a block is resized where it is
+ * when it can be: a slab object that still fits, or a block that
+ * shrinks, has a free block after it or is at the top of the heap.
+ * A mapped block that stays large is remapped.
+ * Only otherwise is the data copied to a new block.
+ */
+void *mm_realloc(void *oldptr, size_t size)
+{
+  size_t oldsize;
+  void *newptr;
+  arena *a;
+  int done;
+
+  /* If size == 0 then this is just free, and we return NULL. */
+  if(size == 0)
+  {
+	mm_free(oldptr);
+	return 0;
+  }
+
+  /* If oldptr is NULL, then this is just malloc. */
+  if(oldptr == NULL)
+  {
+	return mm_malloc(size);
+  }
+
+  if (slab_of(oldptr) != NULL)
+  {
+    if (size <= slab_of(oldptr)->size)
+    {
+      return oldptr;
+    }
+  }
+  else if (IS_MMAPPED(oldptr))
+  {
+    if (size >= mmap_threshold && (newptr = mmap_resize(oldptr, size)) != NULL)
+    {
+      return newptr;
+    }
+  }
+  else if (size < mmap_threshold)
+  {
+    a = &arenas[GET_ARENA(HDRP(oldptr))];
+    pthread_mutex_lock(&a->lock);
+    done = resize_block(a, oldptr, adjust_size(size));
+    pthread_mutex_unlock(&a->lock);
+    if (done)
+    {
+      return oldptr;
+    }
+  }
+
+  newptr = mm_malloc(size);
+
+  /* If realloc() fails the original block is left untouched  */
+  if(!newptr)
+  {
+	return 0;
+  }
+
+  /* Copy the old data. */
+  if (slab_of(oldptr) != NULL)
+  {
+    oldsize = slab_of(oldptr)->size;
+  }
+  else if (IS_MMAPPED(oldptr))
+  {
+    oldsize = MMAP_LEN(oldptr) - 2*DSIZE;
+  }
+  else
+  {
+    oldsize = GET_SIZE(HDRP(oldptr)) - WSIZE;
+  }
+  if(size < oldsize) oldsize = size;
+    memcpy(newptr, oldptr, oldsize);
+
+  /* Free the old block. */
+  mm_free(oldptr);
+
+  return newptr;
+}
+
+/*
+ * resize_block: make the allocated block bp of arena a asize bytes
+ * without moving it, called with a's lock held. Returns 0 if it
+ * has to move.
+ *
+ * It grows into the free block after it, if there is one, and at
+ * the top of a's last chunk the heap is extended under it first
+ * when there is no free block it could move to. A block that
+ * shrinks to less than half is moved too.
+ * What it does not need is split off and freed.
+ */
+static int resize_block(arena *a, void *bp, size_t asize)
+{
+  size_t csize = GET_SIZE(HDRP(bp));
+  char *next = NEXT_BLKP(bp);
+  char *end = GET_ALLOC(HDRP(next)) ? next : NEXT_BLKP(next);
+  size_t avail = csize + (GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next)));
+  unsigned int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  void *tem;
+
+  /* Shrunk to less than half, a copy is cheap and frees all of it */
+  if (asize < csize / 2)
+  {
+    return 0;
+  }
+
+  /* Last in a's last chunk, get more heap right after it. Not when a
+     free block elsewhere fits though, moving there keeps the heap small */
+  if (avail < asize && GET_SIZE(HDRP(end)) == 0 && end == a->heap_end &&
+      find_fit(a, asize) == NULL)
+  {
+    if ((tem = extend_heap(a, grow_size(a, asize - avail)/WSIZE)) == NULL)
+    {
+      return 0;
+    }
+    /* Joins the free block after bp, unless another arena got in between */
+    coalesce(a, tem);
+    next = NEXT_BLKP(bp);
+    avail = csize + (GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next)));
+  }
+  if (avail < asize)
+  {
+    return 0;
+  }
+
+  /* Take in the free block after it */
+  if (avail > csize)
+  {
+    if (NEXT_BLKP(next) == a->heap_end)
+    {
+      a->trimmed = NULL;
+    }
+    delete_node(a, next);
+    a->in_use += avail - csize;
+    csize = avail;
+    PUT(HDRP(bp), PACK(csize, 1) | prev_alloc | a->tag);
+    PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) | PREV_ALLOC);
+  }
+
+  /* Free what is left over, if it can be a block */
+  if ((csize - asize) >= min_size)
+  {
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc | a->tag);
+    next = NEXT_BLKP(bp);
+    PUT(HDRP(next), PACK(csize - asize, 1) | PREV_ALLOC | a->tag);
+    free_block(a, next);
+  }
+  return 1;
+}
+
+
+
+/*
+ * mmap_alloc: a block of size bytes in a mapping of its own, NULL if
+ * there is no memory. The mapping's length goes in the 8 bytes at its
+ * start, then the block's header, marked MMAPPED, at 4 bytes before
+ * the aligned payload.
+ */
+static void *mmap_alloc(size_t size)
+{
+  size_t len;
+  char *p;
+
+  if (size > (size_t)-1 - 2*DSIZE - page_size)
+  {
+    return NULL;
+  }
+  len = (size + 2*DSIZE + page_size - 1) & ~(page_size - 1);
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+  {
+    return NULL;
+  }
+  p += 2*DSIZE;
+  MMAP_LEN(p) = len;
+  PUT(HDRP(p), PACK(0, 1) | MMAPPED);
+  __sync_fetch_and_add(&mmap_calls, 1);
+  mmap_count(len);
+  return p;
+}
+
+
+
+/*
+ * mmap_resize: the mapped block bp resized to size bytes by the
+ * kernel, moving its pages rather than copying them if it has to.
+ * NULL if it cannot (bp is still valid).
+ */
+static void *mmap_resize(void *bp, size_t size)
+{
+  size_t len, old = MMAP_LEN(bp);
+  char *p;
+
+  if (size > (size_t)-1 - 2*DSIZE - page_size)
+  {
+    return NULL;
+  }
+  len = (size + 2*DSIZE + page_size - 1) & ~(page_size - 1);
+  p = mremap((char *)bp - 2*DSIZE, old, len, MREMAP_MAYMOVE);
+  if (p == MAP_FAILED)
+  {
+    return NULL;
+  }
+  mmap_count((long)len - (long)old);
+  p += 2*DSIZE;
+  MMAP_LEN(p) = len;
+  return p;
+}
+
+
+
+/*
+ * mmap_free: unmap the mapped block bp. Blocks of its size go to the
+ * heap from now on, unless it is bigger than MMAP_THRESHOLD_MAX.
+ * The thresholds are only a guess, so threads racing on them is fine.
+ */
+static void mmap_free(void *bp)
+{
+  size_t len = MMAP_LEN(bp);
+
+  if (len > mmap_threshold && len <= MMAP_THRESHOLD_MAX)
+  {
+    mmap_threshold = len;
+    trim_threshold = 2*len;
+  }
+  munmap((char *)bp - 2*DSIZE, len);
+  mmap_count(-(long)len);
+}
+
+
+
+/*
+ * mmap_count: add len (less than 0 when unmapped) to the mapped
+ * bytes, and raise their peak if it is passed
+ */
+static void mmap_count(long len)
+{
+  size_t now = __sync_add_and_fetch(&mmap_bytes, len);
+  size_t peak;
+
+  while ((peak = mmap_peak) < now &&
+         !__sync_bool_compare_and_swap(&mmap_peak, peak, now))
+    ;
+}
+
+
+
+/*
+ * calloc - Refer to mm-native.c,
+ * copied from mm-naive.c
+ *
+ * NULL if nmemb * size overflows. A new mapping is zero already, so
+ * it is not cleared, and requests of MMAP_THRESHOLD bytes and up are
+ * always mapped since the kernel zeroes the pages as they are used.
+ * The heap is not known to be zero: memlib's area is reused by each
+ * mem_reset_brk.
+ */
+void *mm_calloc (size_t nmemb, size_t size)
+{
+  size_t bytes;
+  void *newptr;
+
+  if (size != 0 && nmemb > (size_t)-1 / size)
+  {
+    return NULL;
+  }
+  bytes = nmemb * size;
+
+  if (bytes >= MMAP_THRESHOLD)
+  {
+    heap_ready();
+    return mmap_alloc(bytes);
+  }
+  newptr = malloc(bytes);
+  if (newptr != NULL)
+  {
+    memset(newptr, 0, bytes);
+  }
+
+  return newptr;
+}
+
+
+
+/*
+ * mm_stats: print what the allocator holds to fp, like malloc_stats
+ *
+ * Per arena: the bytes it has given out, its free bytes, the heap it
+ * took for blocks, its allocations and how many blocks find_fit looks
+ * at per call. Then the buckets, the mapped blocks, the external
+ * fragmentation (the share of the free bytes that is not in the
+ * largest free block) and the profiler's top call sites.
+ *
+ * Each arena is read under its lock, so the totals are only as
+ * consistent as that. Other threads may have up to TCACHE_UNCOUNTED
+ * tcache allocations each that are not counted yet.
+ */
+void mm_stats(FILE *fp)
+{
+  size_t free_bytes[NLISTS];
+  unsigned long calls[NLISTS];
+  size_t in_use = 0, free_total = 0, grown = 0, largest = 0;
+  size_t a_free, a_largest;
+  unsigned long fits = 0, probes = 0, a_calls, lost;
+  profile_site sites[PROFILE_SITES];
+  arena *a;
+  int i, count;
+
+  heap_ready();
+  memset(free_bytes, 0, sizeof(free_bytes));
+  memset(calls, 0, sizeof(calls));
+
+  fprintf(fp, "%-6s %12s %12s %12s %12s %8s\n", "arena", "in use", "free",
+          "heap", "allocs", "probes");
+  for (i = 0; i < NARENAS; i++)
+  {
+    a = &arenas[i];
+    pthread_mutex_lock(&a->lock);
+    if (a == my_arena && my_tcache.epoch == heap_epoch)
+    {
+      tcache_count(a, &my_tcache);
+    }
+    a_free = a_calls = 0;
+    for (count = 0; count < NLISTS; count++)
+    {
+      a_free += a->free_bytes[count];
+      a_calls += a->calls[count];
+      free_bytes[count] += a->free_bytes[count];
+      calls[count] += a->calls[count];
+    }
+    a_largest = largest_free(a);
+    fprintf(fp, "%-6d %12zu %12zu %12zu %12lu %8.2f\n", i, a->in_use, a_free,
+            a->footprint, a_calls,
+            a->fits ? (double)a->probes / a->fits : 0.0);
+    in_use += a->in_use;
+    free_total += a_free;
+    grown += a->footprint;
+    fits += a->fits;
+    probes += a->probes;
+    largest = MAX(largest, a_largest);
+    pthread_mutex_unlock(&a->lock);
+  }
+  fprintf(fp, "%-6s %12zu %12zu %12zu %12s %8.2f\n", "total", in_use,
+          free_total, grown, "", fits ? (double)probes / fits : 0.0);
+
+  /* The heap cannot shrink, so its size is its peak too */
+  fprintf(fp, "heap:   %zu bytes, its peak\n", mem_heapsize());
+  fprintf(fp, "mapped: %zu bytes, %zu at peak, %lu mappings made\n",
+          mmap_bytes, mmap_peak, mmap_calls);
+  fprintf(fp, "external fragmentation: %.3f (largest free block %zu bytes)\n",
+          free_total ? 1.0 - (double)largest / free_total : 0.0, largest);
+
+  fprintf(fp, "%-12s %12s %12s\n", "bucket", "free", "allocs");
+  for (count = 0; count < NLISTS; count++)
+  {
+    if (free_bytes[count] != 0 || calls[count] != 0)
+    {
+      fprintf(fp, "%5lu-%-6lu %12zu %12lu\n", 1ul << count,
+              (2ul << count) - 1, free_bytes[count], calls[count]);
+    }
+  }
+
+  if (profile_rate != 0)
+  {
+    pthread_mutex_lock(&profile_lock);
+    memcpy(sites, profile, sizeof(sites));
+    lost = profile_lost;
+    pthread_mutex_unlock(&profile_lock);
+    qsort(sites, PROFILE_SITES, sizeof(profile_site), compare_sites);
+    fprintf(fp, "profile, a sample per %zu bytes:\n", profile_rate);
+    for (i = 0; i < PROFILE_TOP && sites[i].samples != 0; i++)
+    {
+      fprintf(fp, "  %18p %10lu samples %14zu bytes\n", sites[i].pc,
+              sites[i].samples, sites[i].bytes);
+    }
+    if (lost != 0)
+    {
+      fprintf(fp, "  %lu samples with no room for their site\n", lost);
+    }
+  }
+  fflush(fp);
+}
+
+
+
+/*
+ * mm_profile: from now on, sample about one allocation per rate
+ * bytes and record its call site, 0 turns the profiler off. What
+ * was recorded so far is dropped.
+ */
+void mm_profile(size_t rate)
+{
+  pthread_mutex_lock(&profile_lock);
+  memset(profile, 0, sizeof(profile));
+  profile_lost = 0;
+  profile_rate = rate;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+
+
+/*
+ * profile_sample: count size bytes towards the thread's next sample
+ * and record pc if it is due. The gaps between samples are random,
+ * up to twice the rate, so allocations that come in a fixed pattern
+ * are neither always missed nor always hit.
+ *
+ * A sample stands for rate bytes, what an allocation sampled at
+ * that rate is worth on average, or for its own size if that is more
+ */
+static void profile_sample(size_t size, void *pc)
+{
+  size_t rate = profile_rate;
+  unsigned int h;
+  int i;
+
+  if ((profile_left -= (long)size) > 0 || rate == 0)
+  {
+    return;
+  }
+  if (profile_seed == 0)
+  {
+    profile_seed = (unsigned int)(size_t)&profile_seed | 1;
+  }
+  profile_seed ^= profile_seed << 13;   /* xorshift */
+  profile_seed ^= profile_seed >> 17;
+  profile_seed ^= profile_seed << 5;
+  profile_left = 1 + (long)(profile_seed % (2 * rate));
+
+  h = (unsigned int)(((size_t)pc >> 2) * 2654435761u) % PROFILE_SITES;
+  pthread_mutex_lock(&profile_lock);
+  for (i = 0; i < PROFILE_SITES; i++, h = (h + 1) % PROFILE_SITES)
+  {
+    if (profile[h].pc == pc || profile[h].pc == NULL)
+    {
+      profile[h].pc = pc;
+      profile[h].samples++;
+      profile[h].bytes += MAX(size, rate);
+      break;
+    }
+  }
+  if (i == PROFILE_SITES)
+  {
+    profile_lost++;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+
+
+/* Most bytes first */
+static int compare_sites(const void *x, const void *y)
+{
+  size_t a = ((const profile_site *)x)->bytes;
+  size_t b = ((const profile_site *)y)->bytes;
+  return (a < b) - (a > b);
+}
+
+
+
+/*
+ * largest_free: the size of a's largest free block, 0 if it has
+ * none, called with a's lock held. It is in the highest non-empty
+ * bucket.
+ */
+static size_t largest_free(arena *a)
+{
+  unsigned long *bp;
+  size_t size = 0;
+  int count;
+
+  if (a->bitmap == 0)
+  {
+    return 0;
+  }
+  count = 31 - __builtin_clz(a->bitmap);
+  if (count >= TREE_LIST)
+  {
+    return GET_SIZE(HDRP(tree_largest(a->start_of_dll[count])));
+  }
+  for (bp = a->start_of_dll[count]; bp != NULL; bp = GET_NEXT(bp))
+  {
+    size = MAX(size, GET_SIZE(HDRP(bp)));
+  }
+  return size;
+}
+
+
+/*
+ * Returns whether the pointer is in the heap. Used in check_heap.
+*/
+static int in_heap(const void *p)
+{
+  return p <= mem_heap_hi() && p >= mem_heap_lo();
+}
+
+
+/*
+ * Returns whether the pointer is aligned. Used in check_heap.
+*/
+static int aligned(const void *p)
+{
+  return (size_t)ALIGN(p) == (size_t)p;
+}
+
+
+/*
+ * mm_checkheap: Checks various things in the heap
+ *
+ * The buckets and slab pages of every arena, then every chunk of the
+ * heap in turn
+ */
+void mm_checkheap(int lineno)
+{
+  lineno = lineno;
+  char *bp = heap_listp;
+  /* Variable to store the pointer to free blocks */
+  unsigned long *hare = NULL;
+  unsigned long *tortoise = NULL;
+  slab *s;
+  int i, count;
+
+  for (i = 0; i < NARENAS; i++)
+  {
+    pthread_mutex_lock(&arenas[i].lock);
+    for (count = 0; count < NLISTS; count++)
+    {
+      /* The bitmap has to agree with the buckets */
+      if (((arenas[i].bitmap >> count) & 1) != 
+          (arenas[i].start_of_dll[count] != NULL))
+      {
+        printf("Bitmap wrong for bucket %d\n", count);
+        exit(1);
+      }
+      hare = arenas[i].start_of_dll[count];
+      tortoise = arenas[i].start_of_dll[count];
+      if (count >= TREE_LIST && hare != NULL)
+      {
+        check_tree(hare, count);
+      }
+
+      /* To check for pointer consistency in bucket*/
+      while(hare!=NULL && (GET_NEXT(hare)!=NULL))
+      {
+        if (GET_PREV(GET_NEXT(hare)) != hare)
+        {
+          printf("Pointer inconsistency\n");
+          exit(1);
+        }
+        hare = GET_NEXT(hare);
+      }
+      hare = tortoise;
+
+      /* To check for cycles in the double linked list */
+      while(tortoise != NULL)
+      {
+        if (((GET_NEXT(tortoise))!=NULL) &&
+        (GET_NEXT(hare) !=NULL) && (GET_NEXT(GET_NEXT(hare)))!=NULL)
+        {
+          tortoise = GET_NEXT(tortoise);
+          hare = GET_NEXT(GET_NEXT(hare));
+          if (hare == tortoise)
+          {
+            printf("HARE = [%p] TORTOISE = [%p]\n",hare,tortoise);
+            exit(1);
+          }
+        }
+        else
+        {
+          break;
+        }
+      }
+    }
+
+    /* Slab pages on a class's list have room and objects of its size */
+    for (count = 0; count < SLAB_CLASSES; count++)
+    {
+      for (s = arenas[i].slabs[count]; s != NULL; s = s->next)
+      {
+        if (slab_of(s) != s || s->arena != &arenas[i] ||
+            s->size != (unsigned int)(count + 1) * DSIZE ||
+            s->used >= s->total ||
+            (s->next != NULL && s->next->prev != s))
+        {
+          printf("Bad slab page %p\n", s);
+          exit(1);
+        }
+      }
+    }
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+
+  /*Checks if the block is in the heap */
+  if ((in_heap(bp))==0)
+    printf("Current pointer is not in heap!!!\n");
+
+  /*Checks if the block is aligned */
+  if((aligned(bp))==0)
+    printf("Current pointer is not aligned!!!\n");
+
+  /*Checks if the block prologue is right */
+  if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
+    printf("Bad prologue header\n");
+
+   /*Checks if the block is aligned*/
+  if ((size_t)bp % 8)
+    printf("Error: %p is not doubleword aligned\n", bp);
+  /*Checks if the block header matches footer*/
+  if (GET(HDRP(bp)) != GET(FTRP(bp)))
+    printf("Error: header does not match footer\n");
+
+  /* Prints out the whole heap and checkes headers,footers,size,alignment,
+     a chunk's epilogue is followed by the next chunk's prologue */
+  while ((void *)bp < mem_heap_hi())
+  {
+    for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+    {
+      printblock(bp);        /* This function prints the heap at the bp block */
+      if ((size_t)bp % 8)
+        printf("Error: %p is not doubleword aligned\n", bp);
+      /* Only a free block has a footer */
+      if (!GET_ALLOC(HDRP(bp)) && GET_ALLOC(FTRP(bp)))
+        printf("Error: header does not match footer\n");
+      if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
+        printf("Error: Sizes dont match\n");
+      /* The next header has to know if this block is allocated */
+      if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp)))
+        printf("Error: prev-allocated bit wrong after %p\n", bp);
+    }
+    /*Checks if the block epilogue is right*/
+    if (!(GET_ALLOC(HDRP(bp))))
+      printf("Bad epilogue header\n");
+    while (slab_of(bp) != NULL)
+      bp += SLAB_SIZE;       /* Slab pages between chunks */
+    bp += 2*WSIZE;           /* Next chunk's prologue, if there is one */
+    if ((void *)bp < mem_heap_hi() &&
+        ((GET_SIZE(HDRP(bp)) != DSIZE) || !GET_ALLOC(HDRP(bp))))
+      printf("Bad prologue header\n");
+  }
+  return;
+}
+
+
+/*
+ * This function is used by check_heap to print the block specifications,
+ * and if block is empty, it prints its next and previous pointers.
+ *
+ * This helps in checking if the pointers are valid.
+ *
+*/
+static void printblock(void *bp)
+{
+  if (GET_SIZE(HDRP(bp)) == 0)
+  {
+    printf("%p: EOL\n", bp);
+ 	return;
+  }
+
+  if (GET_ALLOC(HDRP(bp)))
+  {
+    printf("%p: header: [%d:%d]\n", bp, GET_SIZE(HDRP(bp)), 
+           GET_ALLOC(HDRP(bp)));
+    return;
+  }
+
+  printf("%p: header: [%d:%d] footer: [%d:%d]\n", bp,
+	     GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)),
+	     GET_SIZE(FTRP(bp)), GET_ALLOC(FTRP(bp)));
+  printf("GET_PREV(bp)=%p, GET_NEXT(bp)=%p\n",GET_PREV(bp),GET_NEXT(bp));
+}
+
+
+
+/*
+ * This uses the mem_sbrk function to extend the heap
+ * and return the address of the newly allocated block
+ * with head and footer and epilogue set
+ *
+ * If another arena grew the heap since arena a did, the block
+ * starts a new chunk of a, behind a prologue of its own
+*/
+static void *extend_heap(arena *a, size_t words)
+{
+  /* Variables for calculations */
+  char *bp;
+  size_t size;
+  unsigned int prev_alloc = PREV_ALLOC;
+
+  /* Allocate an even number of words to maintain alignment */
+  size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+
+  pthread_mutex_lock(&heap_lock);
+  if ((size_t)((char *)mem_heap_hi() + 1 - heap_base) + size + 2*DSIZE >
+      HEAP_SPAN)
+  {
+    bp = (void *)-1;            /* Past what the links can reach */
+  }
+  else if (a->heap_end == (char *)mem_heap_hi() + 1)
+  {
+    bp = mem_sbrk(size);        /* Right after a's epilogue */
+    if (bp != (void *)-1)
+      prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  }
+  else if ((bp = mem_sbrk(size + 2*DSIZE)) != (void *)-1)
+  {
+    PUT(bp, 0);                              /* Alignment padding */
+    PUT(bp + (1*WSIZE), PACK(DSIZE, 1));     /* Prologue header */
+    PUT(bp + (2*WSIZE), PACK(DSIZE, 1));     /* Prologue footer */
+    bp += 2*DSIZE;
+  }
+  if (bp != (void *)-1)
+  {
+    a->footprint += (char *)mem_heap_hi() + 1 - (char *)bp;
+    a->heap_end = (char *)mem_heap_hi() + 1;
+    a->trimmed = NULL;
+  }
+  pthread_mutex_unlock(&heap_lock);
+  if (bp == (void *)-1)
+	return NULL;
+
+  /* Initialize free block header/footer and the epilogue header */
+  PUT(HDRP(bp), PACK(size, 0) | prev_alloc); /* Free block header */
+  PUT(FTRP(bp), PACK(size, 0));              /* Free block footer */
+  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));      /* New epilogue header */
+
+  /* Just return the pointer and let the function which called it coalesce it */
+  return bp;
+}
+
+
+/*
+ * place - Place block of asize bytes at start of free block bp
+ *         and split if remainder would be at least minimum block size
+ *
+ * The third variable (d_number) is set to 1 if the block bp is already
+ * added to a bucket, and thus needs to be deleted
+ * Else, there is no need to delete it
+ *
+ * The left over free space in the block is added to list
+ * if it meets the min_size criteria
+ *
+ * The allocated block is tagged with its arena a, and gets no footer
+ */
+static void place(arena *a, void *bp, size_t asize, int d_number)
+{
+  /* Set the variables */
+  size_t csize = GET_SIZE(HDRP(bp));
+  unsigned int prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+
+  /* Taking from the top block, the pages it uses come back */
+  int top = (NEXT_BLKP(bp) == a->heap_end);
+
+  if (d_number==0) delete_node(a, bp);
+
+  /* If leftover space is enough to form a free block */
+  if ((csize - asize) >= min_size)
+  {
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc | a->tag);
+    a->in_use += asize;
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(csize-asize, 0) | PREV_ALLOC);
+    PUT(FTRP(bp), PACK(csize-asize, 0));
+    add_node(a, bp);
+    if (top && a->trimmed != NULL)
+    {
+      a->trimmed = MAX(a->trimmed, PAGE_UP((char *)PARENTP(bp) + WSIZE));
+    }
+  }
+  /* If no free space, the next block is told this one is allocated */
+  else
+  {
+    PUT(HDRP(bp), PACK(csize, 1) | prev_alloc | a->tag);
+    a->in_use += csize;
+    PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) | PREV_ALLOC);
+    if (top)
+    {
+      a->trimmed = NULL;
+    }
+  }
+}
+
+
+/*
+ * find_fit - Find a fit for a block with asize bytes
+ *
+ * The small buckets are lists, so we just go through the bucket
+ * at most counter_max amount of times before moving on to the
+ * next bucket. A tree bucket gives its best fit.
+ *
+ * If nothing found in the bucket, any block in the next non-empty
+ * bucket is big enough, the smallest of them is taken
+ *
+ * If nothing found after checking all buckets, return NULL
+ */
+static void *find_fit(arena *a, size_t asize)
 {
   /* Set up variables to be used */
   size_t size=0;
   unsigned long *tem_ptr;
   int counter=0;
   /* This is the number of times to travers bucket before moving to next bucket */
-  int counter_max = 3; 
-  
-  /* Call dealing_with_lists to give appropriate list based on size,
-     the first call sets the global count (index),
-     the second call gives the appropriate bucket
-  */  
-  dealing_with_lists(0,asize,NULL,0);
-  tem_ptr = dealing_with_lists(count,asize,NULL,1);
-
-  
-  if (tem_ptr != NULL)                   /*The bucket is non-empty */
-  { 
-    while ((tem_ptr != NULL))
-    { 
+  int counter_max = 3;
+
+  /* The appropriate bucket based on size */
+  int count = list_index(asize);
+  tem_ptr = a->start_of_dll[count];
+  a->fits++;
+
+  if (count >= TREE_LIST)
+  {
+    if ((tem_ptr = tree_fit(a, asize, count)) != NULL)
+    {
+      return tem_ptr;
+    }
+  }
+  else
+  {
+    while ((tem_ptr != NULL) && (counter < counter_max))
+    {
       counter++;
+      a->probes++;
       size = GET_SIZE(HDRP(tem_ptr));
       if (size >= asize)                 /* Appropriate block found */
       {
-	    return tem_ptr;  
-      }
-      tem_ptr = GET_NEXT(tem_ptr);       /* Keeping checking next block */
-      if ((tem_ptr == NULL)||(counter==counter_max)) 
-      /* Need to go to next bucket since current bucket empty*/ 
-      {
-        tem_ptr = next_list(count);     /* Gives next non empty bucket, if any */
         return tem_ptr;
       }
-    }  
-  }
-  /* The bucket for the size of the block is empty */
-  else
-  {
-    tem_ptr = next_list(count);          /* Gives next non empty bucket, if any */
-    return tem_ptr;   
+      tem_ptr = GET_NEXT(tem_ptr);       /* Keeping checking next block */
+    }
   }
-  return NULL;                           /* Else returns NULL */
+  /* Need to go to next bucket since nothing fit in this one */
+  return next_list(a, count);            /* Gives next non empty bucket, if any */
 }
 
 
 
 /*
  * This function adds a node into appropriate bucket which is found
- * through the function dealing_with_lists.
- *
- * Adds block according to size, the buckets are ordered.
- *
- * If bucket empty, just add to the bucket.
+ * through the function list_index.
  *
- * If non empty, traverse through bucket till finds the appropriate place.
-*/ 
-static void add_node(char *ptr)
+ * A small bucket is a list, the block goes at its head. A tree
+ * bucket takes it along the path of its size bits.
+*/
+static void add_node(arena *a, char *ptr)
 {
   /* Initialise the count(index) and appropriate bucket */
-  dealing_with_lists(0, GET_SIZE(HDRP(ptr)), NULL,0);  /* Sec count */
-  unsigned long *start_of_dll = dealing_with_lists(count, 0, NULL,1);
-  /* Initialize variable to be used */
-  unsigned long *tem_ptr = start_of_dll;
-   
-   /* Empty bucket */
-  if (start_of_dll==NULL) 
-  {
-    /* Set the PRED & SUCC pointers accordingly */
-    PUT_ADDRESS(PDRP(ptr),NULL);
-    PUT_ADDRESS(SCRP(ptr),NULL); 
-    /* Set the bucket to point accordingly as well */
-    dealing_with_lists(count, 0, (unsigned long*)ptr,2);
+  int count = list_index(GET_SIZE(HDRP(ptr)));
+  unsigned long *start_of_dll = a->start_of_dll[count];
+
+  a->free_bytes[count] += GET_SIZE(HDRP(ptr));
+  if (count >= TREE_LIST)
+  {
+    add_tree_node(a, ptr, count);
     return;
   }
-  
-  /* Bucket is not empty */
-  
-  /* Size of block being added to be used to compare where to add block*/
-  size_t size_of_ptr = GET_SIZE(HDRP(ptr));
-  while(tem_ptr != NULL)
-  {
-    /* To be added before first block in bucket            Case 1*/ 
-  	if ((size_of_ptr < GET_SIZE(HDRP(tem_ptr))) && (tem_ptr==start_of_dll))
-  	{ 
-  	  /* Set the PRED & SUCC pointers accordingly */
-  	  PUT_ADDRESS(PDRP(ptr),NULL);
-  	  PUT_ADDRESS(SCRP(ptr),start_of_dll);
-  	  PUT_ADDRESS(PDRP(start_of_dll),(unsigned long *)ptr);
-  	  dealing_with_lists(count, 0, (unsigned long*)ptr,2);
-  	  return;
-  	}
-  	
-  	/* To be added after first block in bucket             Case 2*/
-  	else if ((size_of_ptr >= GET_SIZE(HDRP(tem_ptr))) && (tem_ptr==start_of_dll))
-  	{
-  	  /* Only one other block in bucket */
-  	  if (GET_NEXT(start_of_dll) == NULL)
-  	  {
-  	    /* Set the PRED & SUCC pointers accordingly */
-  	    PUT_ADDRESS(SCRP(ptr),NULL);
-  	    PUT_ADDRESS(PDRP(ptr),start_of_dll);
-  	    PUT_ADDRESS(SCRP(start_of_dll),ptr);
-  	  }
-  	  /* Other blocks in bucket */
-  	  else
-  	  {
-  	    /* Set the PRED & SUCC pointers accordingly */
-  	    PUT_ADDRESS(SCRP(ptr),GET_NEXT(tem_ptr));
-  	    PUT_ADDRESS(PDRP(ptr),tem_ptr);
-  	    PUT_ADDRESS(PDRP(GET_NEXT(tem_ptr)),ptr);
-  	    PUT_ADDRESS(SCRP(tem_ptr),ptr);
-  	  }
-  	  return;
-  	}
-  	
-  	/* To be added at end of bucket                        Case 3*/
-  	else if ((size_of_ptr >= GET_SIZE(HDRP(tem_ptr))) && ((GET_NEXT(tem_ptr)) ==NULL))
-    {
-       /* Set the PRED & SUCC pointers accordingly */
-       PUT_ADDRESS(SCRP(ptr),NULL);
-       PUT_ADDRESS(PDRP(ptr),tem_ptr);
-       PUT_ADDRESS(SCRP(tem_ptr),ptr);
-       return;
-    }
-    
-    /* To be added at middle of bucket                     Case 4*/
-    else if ((size_of_ptr >= GET_SIZE(HDRP(tem_ptr))) && ((GET_NEXT(tem_ptr)) !=NULL))
-    {
-       /* Set the PRED & SUCC pointers accordingly */
-       PUT_ADDRESS(SCRP(ptr),GET_NEXT(tem_ptr));
-       PUT_ADDRESS(PDRP(ptr), tem_ptr);
-       PUT_ADDRESS(SCRP(tem_ptr),ptr);
-       PUT_ADDRESS(PDRP(GET_NEXT(tem_ptr)),ptr);
-       return;
-    }
-    
-    /* Keep going through list, havent found appropriate place yet */
-    else
-    {
-     tem_ptr = GET_NEXT(tem_ptr);
-    }
+
+  /* Set the PRED & SUCC pointers accordingly */
+  PUT_ADDRESS(PDRP(ptr),NULL);
+  PUT_ADDRESS(SCRP(ptr),start_of_dll);
+  if (start_of_dll != NULL)
+  {
+    PUT_ADDRESS(PDRP(start_of_dll),(unsigned long *)ptr);
   }
-  return;
+  /* Set the bucket to point accordingly as well */
+  a->start_of_dll[count] = (unsigned long *)ptr;
+  a->bitmap |= 1u << count;
 }
 
 
@@ -791,13 +2021,21 @@ static void add_node(char *ptr)
 /*
  * Just has four cases to delete node from appropriate bucket,
  * just delete based off that and set the pointers
-*/ 
-static void delete_node(char *ptr)
+ *
+ * Tree buckets have their own delete_tree_node
+*/
+static void delete_node(arena *a, char *ptr)
 {
   /* TO set the count (index) for the bucket in case it is needed */
-  dealing_with_lists(0, GET_SIZE(HDRP(ptr)), NULL,0);
+  int count = list_index(GET_SIZE(HDRP(ptr)));
+
+  a->free_bytes[count] -= GET_SIZE(HDRP(ptr));
+  if (count >= TREE_LIST)
+  {
+    delete_tree_node(a, ptr, count);
+    return;
+  }
 
-  
   if (GET_PREV(ptr)!=NULL)
   {
     /*There is a block behind it and block in front of it         Case 1*/
@@ -814,900 +2052,347 @@ static void delete_node(char *ptr)
       PUT_ADDRESS(SCRP(GET_PREV(ptr)),NULL);
     }
   }
-  else 
+  else
   {
     /*There is no block behind it and block in front of it         Case 3*/
     if (GET_NEXT(ptr) != NULL)
     {
-      dealing_with_lists(count,0,(unsigned long *)(GET_NEXT(ptr)),2);
+      a->start_of_dll[count] = GET_NEXT(ptr);
       PUT_ADDRESS(PDRP(GET_NEXT(ptr)),NULL);
       PUT_ADDRESS(SCRP(ptr),NULL);
     }
     /*There is no block behind it and no block in front of it      Case 4*/
     else
     {
-      dealing_with_lists(count, 0, NULL,2); 
-    }  
+      a->start_of_dll[count] = NULL;
+      a->bitmap &= ~(1u << count);
+    }
   }
   return;
 }
 
 
-/* This function has 3 functions depending on input option:
-   Option==0: Takes in size and sets the global variable count 
-              to the appropriate bucket index
-   Option==1: Takes in the count and gives the appropriate bucket address
-   Option==2: Takes the bucket and sets its value to that of ptr
-*/ 
-unsigned long *dealing_with_lists(int counter, size_t size, unsigned long *ptr,int option)
+
+/*
+ * add_tree_node: put ptr in the tree of bucket count. Going down,
+ * each level takes the next lower bit of the size, 0 to the left
+ * and 1 to the right, until a free child or a block of the same
+ * size, which it is chained after.
+ */
+static void add_tree_node(arena *a, char *ptr, int count)
 {
-  if (option==0)
-  {
-    /* The count (index) is set on the size range,
-     * each bucket size range is (2^(x-1)) to ((2^x)-1)
-    */ 
-    if ((size >= (1<<(1-1))) && (size <= ((1<<1)-1))) count=1;
-    else if ((size >= (1<<(2-1))) && (size <= ((1<<2)-1))) count=2;
-    else if ((size >= (1<<(3-1))) && (size <= ((1<<3)-1))) count=3;
-    else if ((size >= (1<<(4-1))) && (size <= ((1<<4)-1))) count=4;
-    else if ((size >= (1<<(5-1))) && (size <= ((1<<5)-1))) count=5;
-    else if ((size >= (1<<(6-1))) && (size <= ((1<<6)-1))) count=6;
-    else if ((size >= (1<<(7-1))) && (size <= ((1<<7)-1))) count=7;
-    else if ((size >= (1<<(8-1))) && (size <= ((1<<8)-1))) count=8;
-    else if ((size >= (1<<(9-1))) && (size <= ((1<<9)-1))) count=9;
-    else if ((size >= (1<<(10-1))) && (size <= ((1<<10)-1))) count=10;
-    else if ((size >= (1<<(11-1))) && (size <= ((1<<11)-1))) count=11;
-    else if ((size >= (1<<(12-1))) && (size <= ((1<<12)-1))) count=12;
-    else if ((size >= (1<<(13-1))) && (size <= ((1<<13)-1))) count=13;
-    else if ((size >= (1<<(14-1))) && (size <= ((1<<14)-1))) count=14;
-    else if ((size >= (1<<(15-1))) && (size <= ((1<<15)-1))) count=15;
-    else if ((size >= (1<<(16-1))) && (size <= ((1<<16)-1))) count=16;
-    else if ((size >= (1<<(17-1))) && (size <= ((1<<17)-1))) count=17;
-    else if ((size >= (1<<(18-1))) && (size <= ((1<<18)-1))) count=18;
-    else if ((size >= (1<<(19-1))) && (size <= ((1<<19)-1))) count=19;
-    else if ((size >= (1<<(20-1))) && (size <= ((1<<20)-1))) count=20;
-    else if ((size >= (1<<(21-1))) && (size <= ((1<<21)-1))) count=21;
-    else if ((size >= (1<<(22-1))) && (size <= ((1<<22)-1))) count=22;
-    else if ((size >= (1<<(23-1))) && (size <= ((1<<23)-1))) count=23;
-    else if ((size >= (1<<(24-1))) && (size <= ((1<<24)-1))) count=24;
-    else if ((size >= (1<<(25-1))) && (size <= ((1<<25)-1))) count=25;
-    else if ((size >= (1<<(26-1))) && (size <= ((1<<26)-1))) count=26;
-    else if ((size >= (1<<(27-1))) && (size <= ((1<<27)-1))) count=27;
-    else if ((size >= (1<<(28-1))) && (size <= ((1<<28)-1))) count=28;
-    else if ((size >= (1<<(29-1))) && (size <= ((1<<29)-1))) count=29;
-    else if ((size >= (1<<(30-1))) && (size <= ((1<<30)-1))) count=30;
-    else if ((size >= (1<<(31-1))) && (size <= ((unsigned int)(1<<31)-1))) count=31;
-    else count = 32;
-    return NULL;
-  } 
-  /* Size is 0 and ptr is NULL, based on count, gives back appropriate seg list*/
-  else if (option==1)
-  {
-  switch (counter)
-  {
-      case (1): return start_of_dll1;
-      case (2): return start_of_dll2;
-      case (3): return start_of_dll3;
-      case (4): return start_of_dll4;
-      case (5): return start_of_dll5;
-      case (6): return start_of_dll6;
-      case (7): return start_of_dll7;
-      case (8): return start_of_dll8;
-      case (9): return start_of_dll9;
-      case (10): return start_of_dll10;
-      case (11): return start_of_dll11;
-      case (12): return start_of_dll12;
-      case (13): return start_of_dll13;
-      case (14): return start_of_dll14;
-      case (15): return start_of_dll15;
-      case (16): return start_of_dll16;
-      case (17): return start_of_dll17;
-      case (18): return start_of_dll18;
-      case (19): return start_of_dll19;
-      case (20): return start_of_dll20;
-      case (21): return start_of_dll21;
-      case (22): return start_of_dll22;
-      case (23): return start_of_dll23;
-      case (24): return start_of_dll24;
-      case (25): return start_of_dll25;
-      case (26): return start_of_dll26;
-      case (27): return start_of_dll27;
-      case (28): return start_of_dll28;
-      case (29): return start_of_dll29;
-      case (30): return start_of_dll30;
-      case (31): return start_of_dll31;
-      case (32): return start_of_dll32; 
-      default: return start_of_dll15;
+  size_t size = GET_SIZE(HDRP(ptr));
+  unsigned long *t = a->start_of_dll[count];
+  unsigned int *c;
+  int bit = count - 1;
+
+  PUT_ADDRESS(PDRP(ptr), NULL);
+  PUT_ADDRESS(SCRP(ptr), NULL);
+  PUT_ADDRESS(CHILDP(ptr, 0), NULL);
+  PUT_ADDRESS(CHILDP(ptr, 1), NULL);
+
+  /* Empty tree */
+  if (t == NULL)
+  {
+    PUT_ADDRESS(PARENTP(ptr), TREE_ROOT);
+    a->start_of_dll[count] = (unsigned long *)ptr;
+    a->bitmap |= 1u << count;
+    return;
+  }
+
+  while (1)
+  {
+    /* Same size, it goes in the chain behind the tree node */
+    if (GET_SIZE(HDRP(t)) == size)
+    {
+      PUT_ADDRESS(PDRP(ptr), t);
+      PUT_ADDRESS(SCRP(ptr), GET_NEXT(t));
+      if (GET_NEXT(t) != NULL)
+      {
+        PUT_ADDRESS(PDRP(GET_NEXT(t)), ptr);
+      }
+      PUT_ADDRESS(SCRP(t), ptr);
+      PUT_ADDRESS(PARENTP(ptr), NULL);
+      return;
+    }
+    c = CHILDP(t, (size >> bit) & 1);
+    bit--;
+    if (*c == 0)
+    {
+      PUT_ADDRESS(c, ptr);
+      PUT_ADDRESS(PARENTP(ptr), t);
+      return;
+    }
+    t = FROM_OFF(*c);
+  }
+}
+
+
+
+/*
+ * delete_tree_node: take ptr out of the tree of bucket count. A
+ * chained block just leaves the chain. A tree node is replaced by
+ * the next block of its size, or else by any leaf under it (they
+ * all share its bits so far), or else it was a leaf itself.
+ */
+static void delete_tree_node(arena *a, char *ptr, int count)
+{
+  unsigned long *x = (unsigned long *)ptr;
+  unsigned long *r, *c;
+  int i;
+
+  /* In a chain, not in the tree */
+  if (GET_PARENT(x) == NULL)
+  {
+    PUT_ADDRESS(SCRP(GET_PREV(x)), GET_NEXT(x));
+    if (GET_NEXT(x) != NULL)
+    {
+      PUT_ADDRESS(PDRP(GET_NEXT(x)), GET_PREV(x));
     }
+    return;
+  }
+
+  if ((r = GET_NEXT(x)) != NULL)
+  {
+    PUT_ADDRESS(PDRP(r), NULL);
   }
-  /* Assign value of ptr tolist*/
   else
   {
-    switch(counter)
+    for (r = x; GET_CHILD(r, 0) != NULL || GET_CHILD(r, 1) != NULL; )
     {
-      case (1): 
-      {
-        start_of_dll1=ptr;
-        break;
-      }  
-      case (2): 
-      {
-        start_of_dll2=ptr;
-        break;
-      } 
-      case (3): 
-      {
-        start_of_dll3=ptr;
-        break;
-      } 
-      case (4): 
-      {
-        start_of_dll4=ptr;
-        break;
-      } 
-      case (5): 
-      {
-        start_of_dll5=ptr;
-        break;
-      } 
-      case (6): 
-      {
-        start_of_dll6=ptr;
-        break;
-      } 
-      case (7): 
-      {
-        start_of_dll7=ptr;
-        break;
-      } 
-      case (8):
-      {
-        start_of_dll8=ptr;
-        break;
-      } 
-      case (9): 
-      {
-        start_of_dll9=ptr;
-        break;
-      } 
-      case (10): 
+      r = (GET_CHILD(r, 1) != NULL) ? GET_CHILD(r, 1) : GET_CHILD(r, 0);
+    }
+    if (r == x)
+    {
+      tree_replace(a, count, x, NULL);
+      if (a->start_of_dll[count] == NULL)
       {
-        start_of_dll10=ptr;
-        break;
+        a->bitmap &= ~(1u << count);
       }
-      case (11): 
-      {
-        start_of_dll11=ptr;
-        break;
-      } 
-      case (12): 
-      {
-        start_of_dll12=ptr;
-        break;
-      } 
-      case (13): 
-      {
-        start_of_dll13=ptr;
-        break;
-      } 
-      case (14): 
-      {
-        start_of_dll14=ptr;
-        break;
-      } 
-      case (15): 
-      {
-        start_of_dll15=ptr;
-        break;
-      } 
-      case (16): 
-      {
-        start_of_dll16=ptr;
-        break;
-      } 
-      case (17): 
-      {
-        start_of_dll17=ptr;
-        break;
-      } 
-      case (18): 
-      {
-        start_of_dll18=ptr;
-        break;
-      } 
-      case (19): 
-      {
-        start_of_dll19=ptr;
-        break;
-      } 
-      case (20): 
-      {
-        start_of_dll20=ptr;
-        break;
-      } 
-      case (21): 
-      {
-        start_of_dll21=ptr;
-        break;
-      } 
-      case (22): 
-      {
-        start_of_dll22=ptr;
-        break;
-      } 
-      case (23): 
-      {
-        start_of_dll23=ptr;
-        break;
-      } 
-      case (24): 
-      {
-        start_of_dll24=ptr;
-        break;
-      } 
-      case (25): 
-      {
-        start_of_dll25=ptr;
-        break;
-      } 
-      case (26): 
-      {
-        start_of_dll26=ptr;
-        break;
-      } 
-      case (27):
-      {
-        start_of_dll27=ptr;
-        break;
-      } 
-      case (28): 
-      {
-        start_of_dll28=ptr;
-        break;
-      } 
-      case (29): 
-      {
-        start_of_dll29=ptr;
-        break;
-      } 
-      case (30): 
-      {
-        start_of_dll30=ptr;
-        break;
-      } 
-      case (31): 
-      {
-        start_of_dll31=ptr;
-        break;
-      } 
-      case (32): 
+      return;
+    }
+    tree_replace(a, count, r, NULL);
+  }
+
+  /* r takes x's place, with x's children */
+  PUT_ADDRESS(PARENTP(r), GET_PARENT(x));
+  for (i = 0; i < 2; i++)
+  {
+    c = GET_CHILD(x, i);
+    PUT_ADDRESS(CHILDP(r, i), c);
+    if (c != NULL)
+    {
+      PUT_ADDRESS(PARENTP(c), r);
+    }
+  }
+  tree_replace(a, count, x, r);
+}
+
+
+
+/*
+ * tree_replace: make whatever points down to tree node x (its
+ * parent or the bucket) point to r instead
+ */
+static void tree_replace(arena *a, int count, unsigned long *x, 
+                         unsigned long *r)
+{
+  unsigned long *p = GET_PARENT(x);
+
+  if (p == TREE_ROOT)
+  {
+    a->start_of_dll[count] = r;
+  }
+  else if (GET_CHILD(p, 0) == x)
+  {
+    PUT_ADDRESS(CHILDP(p, 0), r);
+  }
+  else
+  {
+    PUT_ADDRESS(CHILDP(p, 1), r);
+  }
+}
+
+
+
+/*
+ * tree_fit: the smallest block of at least asize bytes in the tree
+ * of bucket count, NULL if there is none
+ *
+ * Going down the path of asize's bits, a right subtree passed over
+ * holds only blocks bigger than asize; the deepest of them has the
+ * smallest, which are found down its left side.
+ */
+static void *tree_fit(arena *a, size_t asize, int count)
+{
+  unsigned long *t = a->start_of_dll[count];
+  unsigned long *best = NULL, *rst = NULL, *rt;
+  size_t best_size = (size_t)-1, size;
+  int bit = count - 1;
+
+  while (t != NULL)
+  {
+    a->probes++;
+    size = GET_SIZE(HDRP(t));
+    if (size >= asize && size < best_size)
+    {
+      best = t;
+      best_size = size;
+      if (size == asize)
       {
-        start_of_dll32=ptr;
-        break;
-      } 
-      default: 
+        return best;
+      }
+    }
+    rt = GET_CHILD(t, 1);
+    t = GET_CHILD(t, (asize >> bit) & 1);
+    bit--;
+    if (rt != NULL && rt != t)
+    {
+      rst = rt;
+    }
+  }
+  for (t = rst; t != NULL; t = LEFTMOST(t))
+  {
+    a->probes++;
+    size = GET_SIZE(HDRP(t));
+    if (size < best_size)
+    {
+      best = t;
+      best_size = size;
+    }
+  }
+  return best;
+}
+
+
+
+/*
+ * tree_smallest: the smallest block in the tree under t, it is on
+ * the leftmost path since lower bits go to the left
+ */
+static unsigned long *tree_smallest(unsigned long *t)
+{
+  unsigned long *best = t;
+
+  for (t = LEFTMOST(t); t != NULL; t = LEFTMOST(t))
+  {
+    if (GET_SIZE(HDRP(t)) < GET_SIZE(HDRP(best)))
+    {
+      best = t;
+    }
+  }
+  return best;
+}
+
+
+
+/*
+ * tree_largest: the largest block in the tree under t, on the
+ * rightmost path the same way
+ */
+static unsigned long *tree_largest(unsigned long *t)
+{
+  unsigned long *best = t;
+
+  while ((t = (GET_CHILD(t, 1) != NULL) ? GET_CHILD(t, 1) :
+              GET_CHILD(t, 0)) != NULL)
+  {
+    if (GET_SIZE(HDRP(t)) > GET_SIZE(HDRP(best)))
+    {
+      best = t;
+    }
+  }
+  return best;
+}
+
+
+
+/*
+ * check_tree: the tree under t has every block in bucket count,
+ * children pointing back to their parent and chains of one size
+ */
+static void check_tree(unsigned long *t, int count)
+{
+  unsigned long *c;
+  int i;
+
+  if (list_index(GET_SIZE(HDRP(t))) != count)
+  {
+    printf("Block %p in the wrong bucket\n", t);
+    exit(1);
+  }
+  for (c = GET_NEXT(t); c != NULL; c = GET_NEXT(c))
+  {
+    if (GET_SIZE(HDRP(c)) != GET_SIZE(HDRP(t)) || GET_PARENT(c) != NULL)
+    {
+      printf("Bad chain at %p\n", c);
+      exit(1);
+    }
+  }
+  for (i = 0; i < 2; i++)
+  {
+    if ((c = GET_CHILD(t, i)) != NULL)
+    {
+      if (GET_PARENT(c) != t)
       {
-        start_of_dll32=ptr;
-        break;
-      } 
+        printf("Tree inconsistency at %p\n", c);
+        exit(1);
+      }
+      check_tree(c, count);
     }
-    return NULL;  
   }
-  return NULL;
 }
 
 
 /*
- * This function returns the next non empty bucket given the 
- * count (index), and returns NULL if all the buckets are empty
- * 
- * Since buckets are arranged in ascending order, we cascade 
- * through the cases
+ * list_index: the bucket number for a block of size bytes, the
+ * position of its highest set bit. Sizes are under MAX_BLOCK so
+ * they fit in an unsigned int.
+ */
+static inline int list_index(size_t size)
+{
+  return 31 - __builtin_clz((unsigned int)size);
+}
+
+
+/*
+ * This function returns the next non empty bucket of arena a after
+ * bucket number, and returns NULL if all the buckets above are empty
  *
- * There might be a more efficient method, but this gave the best
- * throughput.
+ * The buckets are arranged in ascending order, so it is the lowest
+ * set bit of the bitmap above number. From a tree bucket the
+ * smallest block is given
 */
-unsigned long *next_list(int number)
+static inline unsigned long *next_list(arena *a, int number)
 {
-  if ((number==1))
-  {
-    if (start_of_dll2 != NULL) return start_of_dll2;
-    else if (start_of_dll3 !=NULL) return start_of_dll3;
-    else if (start_of_dll4 !=NULL) return start_of_dll4;
-    else if (start_of_dll5 !=NULL) return start_of_dll5;
-    else if (start_of_dll6 !=NULL) return start_of_dll6;
-    else if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }  
-  else if ((number==2))
-  {
-    if (start_of_dll3 !=NULL) return start_of_dll3;
-    else if (start_of_dll4 !=NULL) return start_of_dll4;
-    else if (start_of_dll5 !=NULL) return start_of_dll5;
-    else if (start_of_dll6 !=NULL) return start_of_dll6;
-    else if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==3))
-  {
-    if (start_of_dll4 !=NULL) return start_of_dll4;
-    else if (start_of_dll5 !=NULL) return start_of_dll5;
-    else if (start_of_dll6 !=NULL) return start_of_dll6;
-    else if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==4))
-  {
-    if (start_of_dll5 !=NULL) return start_of_dll5;
-    else if (start_of_dll6 !=NULL) return start_of_dll6;
-    else if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==5))
-  {
-    if (start_of_dll6 !=NULL) return start_of_dll6;
-    else if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==6))
-  {
-    if (start_of_dll7 !=NULL) return start_of_dll7;
-    else if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==7))
-  {
-    if (start_of_dll8 !=NULL) return start_of_dll8;
-    else if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==8))
-  {
-    if (start_of_dll9 !=NULL) return start_of_dll9;
-    else if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==9))
-  {
-    if (start_of_dll10 !=NULL) return start_of_dll10;
-    else if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==10))
-  {
-    if (start_of_dll11 !=NULL) return start_of_dll11;
-    else if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==11))
-  {
-    if (start_of_dll12 !=NULL) return start_of_dll12;
-    else if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==12))
-  {
-    if (start_of_dll13 !=NULL) return start_of_dll13;
-    else if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==13))
-  {
-    if (start_of_dll14 !=NULL) return start_of_dll14;
-    else if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==14))
-  {
-    if (start_of_dll15 !=NULL) return start_of_dll15;
-    else if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==15))
-  {
-    if (start_of_dll16 !=NULL) return start_of_dll16;
-    else if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==16))
-  {
-    if (start_of_dll17 !=NULL) return start_of_dll17;
-    else if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==17))
-  {
-    if (start_of_dll18 !=NULL) return start_of_dll18;
-    else if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==18))
-  {
-    if (start_of_dll19 !=NULL) return start_of_dll19;
-    else if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==19))
-  {
-    if (start_of_dll20 !=NULL) return start_of_dll20;
-    else if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==20))
-  {
-    if (start_of_dll21 !=NULL) return start_of_dll21;
-    else if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==21))
-  {
-    if (start_of_dll22 !=NULL) return start_of_dll22;
-    else if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==22))
-  {
-    if (start_of_dll23 !=NULL) return start_of_dll23;
-    else if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==23))
-  {
-    if (start_of_dll24 !=NULL) return start_of_dll24;
-    else if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==24))
-  {
-    if (start_of_dll25 !=NULL) return start_of_dll25;
-    else if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==25))
-  {
-    if (start_of_dll26 !=NULL) return start_of_dll26;
-    else if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==26))
-  {
-    if (start_of_dll27 !=NULL) return start_of_dll27;
-    else if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==27))
-  {
-    if (start_of_dll28 !=NULL) return start_of_dll28;
-    else if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==28))
-  {
-    if (start_of_dll29 !=NULL) return start_of_dll29;
-    else if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==29))
-  {
-    if (start_of_dll30 !=NULL) return start_of_dll30;
-    else if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==30))
-  {
-    if (start_of_dll31 !=NULL) return start_of_dll31;
-    else if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==31))
-  {
-    if (start_of_dll32 !=NULL) return start_of_dll32;
-  }
-  else if ((number==32))
+  unsigned int above = (number >= NLISTS - 1) ? 0 : 
+                       a->bitmap & ~((2u << number) - 1);
+
+  if (above == 0)
   {
     return NULL;
   }
-  else 
+  number = __builtin_ctz(above);
+  if (number >= TREE_LIST)
   {
-    return NULL;
-  } 
-  return NULL;
+    return tree_smallest(a->start_of_dll[number]);
+  }
+  return a->start_of_dll[number];
 }
 
 
 
+/*
+ * slab_of: the slab page p is in, found by its bit in slab_map,
+ * or NULL if p is not in a slab page (so it is a block)
+ */
+static inline slab *slab_of(void *p)
+{
+  unsigned long page = (unsigned long)((char *)p - heap_base) >> SLAB_SHIFT;
+
+  if (page >= SLAB_PAGES || !(slab_map[page >> 3] & (1 << (page & 7))))
+  {
+    return NULL;
+  }
+  return (slab *)((size_t)p & ~(size_t)(SLAB_SIZE - 1));
+}
@@ -0,0 +1,287 @@
+/*
+ * bench.c: Load generator for the proxy
+ *
+ * Starts a number of client threads that each send GET requests
+ * for the same url through the proxy, one connection per request
+ * like a browser talking HTTP/1.0, and reports throughput and
+ * latency percentiles.
+ *
+ * Run the same workload against the proxy started with -e rio and
+ * with -e uring to compare the two I/O engines.
+ *
+ * With -p and the proxy's pid, also counts the page faults and data
+ * TLB misses of all its threads over the run (perf events, may need
+ * kernel.perf_event_paranoid lowered), to compare the proxy with and
+ * without -M.
+ *
+ * usage: bench [-c clients] [-n requests] [-p proxy_pid]
+ *              <proxy_host> <proxy_port> <url>
+ *
+ */
+
+#include "csapp.h"
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Counters per thread of the proxy */
+#define PERF_MAX_THREADS 1024
+#define PERF_FAULTS 0
+#define PERF_DTLB 1
+#define PERF_EVENTS 2
+
+/* Settings shared by the client threads */
+static char *proxy_host, *proxy_port, *url;
+static int nrequests = 1000;
+static double *latencies;        /* One slot per request, in ms */
+static long total_bytes = 0;
+static int failures = 0;
+static sem_t mutex;              /* Protects total_bytes & failures */
+
+/* Open perf event fds, and how many threads they cover */
+static int perf_fds[PERF_EVENTS][PERF_MAX_THREADS];
+static int perf_threads = 0;
+
+static void *client(void *vargp);
+static double now_ms();
+static int compare(const void *a, const void *b);
+static int perf_open(pid_t pid);
+static long perf_count(int event);
+
+
+
+int main(int argc, char **argv)
+{
+  int nclients = 8;
+  int opt, i, done;
+  pid_t pid = 0;
+  pthread_t *tids;
+  double start, elapsed;
+  long faults, misses;
+
+  while ((opt = getopt(argc, argv, "c:n:p:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': nclients = atoi(optarg); break;
+      case 'n': nrequests = atoi(optarg); break;
+      case 'p': pid = atoi(optarg); break;
+      default: optind = argc; break;
+    }
+  }
+  if (argc - optind != 3 || nclients <= 0 || nrequests <= 0)
+  {
+    fprintf(stderr, "usage: %s [-c clients] [-n requests] [-p proxy_pid] "
+            "<proxy_host> <proxy_port> <url>\n", argv[0]);
+    exit(1);
+  }
+  if (pid > 0 && perf_open(pid) < 0)
+  {
+    fprintf(stderr, "Cannot count events of %d, running without\n", 
+            (int)pid);
+  }
+  proxy_host = argv[optind];
+  proxy_port = argv[optind + 1];
+  url = argv[optind + 2];
+
+  Signal(SIGPIPE, SIG_IGN);
+  Sem_init(&mutex, 0, 1);
+  latencies = (double *)Calloc((size_t)nclients * nrequests, sizeof(double));
+  tids = (pthread_t *)Malloc(nclients * sizeof(pthread_t));
+
+  start = now_ms();
+  for (i = 0; i < nclients; i++)
+  {
+    Pthread_create(&tids[i], NULL, client, latencies + (size_t)i * nrequests);
+  }
+  for (i = 0; i < nclients; i++)
+  {
+    pthread_join(tids[i], NULL);
+  }
+  elapsed = now_ms() - start;
+  faults = perf_count(PERF_FAULTS);
+  misses = perf_count(PERF_DTLB);
+
+  /* Failed requests were left at 0 and sort to the front */
+  done = nclients * nrequests - failures;
+  qsort(latencies, (size_t)nclients * nrequests, sizeof(double), compare);
+  printf("requests:   %d ok, %d failed\n", done, failures);
+  printf("throughput: %.0f req/s, %.1f MB/s\n", done / (elapsed / 1000),
+         total_bytes / (elapsed / 1000) / (1 << 20));
+  if (done > 0)
+  {
+    printf("latency:    p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           latencies[failures + done / 2],
+           latencies[failures + (int)(done * 0.99)],
+           latencies[nclients * nrequests - 1]);
+  }
+  if (perf_threads > 0)
+  {
+    printf("proxy:      %ld page faults", faults);
+    if (misses >= 0)
+    {
+      printf(", %ld dTLB misses (%.2f per request)", misses,
+             done > 0 ? (double)misses / done : 0.0);
+    }
+    else
+    {
+      printf(", dTLB misses not counted here");
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+
+
+/*
+ * client: send nrequests requests one after the other,
+ * recording the latency of each in the slots given in vargp
+ */
+static void *client(void *vargp)
+{
+  double *slot = (double *)vargp;
+  char request[MAXLINE], buf[MAXBUF];
+  double start;
+  long bytes;
+  ssize_t n;
+  int i, fd;
+
+  snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", url);
+  for (i = 0; i < nrequests; i++)
+  {
+    start = now_ms();
+    bytes = 0;
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0 ||
+        rio_writen(fd, request, strlen(request)) < 0)
+    {
+      n = -1;
+    }
+    else
+    {
+      while ((n = rio_readn(fd, buf, sizeof(buf))) > 0)
+      {
+        bytes += n;
+      }
+    }
+    if (fd >= 0)
+    {
+      Close(fd);
+    }
+
+    P(&mutex);
+    if (n < 0 || bytes == 0)
+    {
+      failures++;
+    }
+    else
+    {
+      total_bytes += bytes;
+      slot[i] = now_ms() - start;
+    }
+    V(&mutex);
+  }
+  return NULL;
+}
+
+
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+
+/*
+ * perf_open: start counting page faults and data TLB read misses in
+ * every thread pid has now. The proxy makes its threads at startup,
+ * so these are all there will be. Returns -1 if nothing could be
+ * counted; a machine without TLB counters (most VMs) gets faults only.
+ */
+static int perf_open(pid_t pid)
+{
+  struct perf_event_attr attr;
+  char path[64];
+  struct dirent *d;
+  DIR *dir;
+  pid_t tid;
+  int e;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+  if ((dir = opendir(path)) == NULL)
+  {
+    return -1;
+  }
+  while ((d = readdir(dir)) != NULL && perf_threads < PERF_MAX_THREADS)
+  {
+    if ((tid = atoi(d->d_name)) <= 0)
+    {
+      continue;
+    }
+    for (e = 0; e < PERF_EVENTS; e++)
+    {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.exclude_kernel = (e == PERF_DTLB);
+      if (e == PERF_FAULTS)
+      {
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+      }
+      else
+      {
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      }
+      perf_fds[e][perf_threads] = syscall(SYS_perf_event_open, &attr, tid,
+                                          -1, -1, 0);
+    }
+    if (perf_fds[PERF_FAULTS][perf_threads] < 0)
+    {
+      if (perf_fds[PERF_DTLB][perf_threads] >= 0)
+      {
+        close(perf_fds[PERF_DTLB][perf_threads]);
+      }
+      continue;
+    }
+    perf_threads++;
+  }
+  closedir(dir);
+  return perf_threads > 0 ? 0 : -1;
+}
+
+
+
+/*
+ * perf_count: event summed over the proxy's threads, -1 if it
+ * could not be counted in all of them
+ */
+static long perf_count(int event)
+{
+  long sum = 0, n;
+  int i;
+
+  for (i = 0; i < perf_threads; i++)
+  {
+    if (perf_fds[event][i] < 0 ||
+        read(perf_fds[event][i], &n, sizeof(n)) != sizeof(n))
+    {
+      return -1;
+    }
+    sum += n;
+  }
+  return sum;
+}
@@ -9,9 +9,64 @@
  * The nodes are added in a LRU policy,
  * with the front of the list being least used.
  *
+ * Small and large objects are in separate lists (tiers), so a
+ * few big objects cannot push out all the small ones. Each tier
+ * evicts on its own, against its own share of MAX_CACHE_SIZE.
+ * The memory a node holds is what is charged to the tier:
+ * - small: node, id and data share one block, blocks come in
+ *   power of 2 size classes carved out of 64KB arena chunks
+ * - large: data in 16KB pages, node, page table and id in one
+ *   malloc
+ * Freed blocks and pages go on free lists and are used again,
+ * so a busy cache stops calling malloc for its objects.
+ *
+ * Each list has its own pool of blocks and pages. cache_reserve 
+ * maps one region for a pool's chunks and pages up front, in 2MB
+ * pages: hugetlbfs ones if the system has some set aside, else
+ * transparent ones asked for with madvise. Every object then sits
+ * in a few huge pages and reading it costs few TLB misses. The
+ * region can also be bound to a NUMA node, so a shard's objects
+ * are in the memory next to the workers that serve them. It is
+ * touched at once, so no page faults are left for the request
+ * path. Once it is used up, malloc takes over.
+ *
+ * A radix tree over the ids finds a node by id without walking
+ * the lists, and finds all ids under a prefix for purges.
+ *
+ * Each thread keeps the last few fresh objects it served in an
+ * L1 of its own, holding a reference to the node. A hit there
+ * takes no semaphore and writes nothing shared. Nodes are only
+ * freed once the list and every L1 have let go of them. An L1
+ * entry is checked against the list's generation, which moves on
+ * whenever a node is removed, and only then against the node's
+ * removed flag. Nodes served from an L1 get a second chance when
+ * they come up for eviction, as their hits never reach the LRU.
+ *
  */
 
 #include "cache.h"
+#include "timer.h"
+#include "numa.h"
+
+/* This thread's L1, and the next slot to check for removed nodes */
+static __thread l1_entry l1[L1_SLOTS];
+static __thread unsigned int l1_sweep = 0;
+
+static void *block_alloc(cache_pool *pool, unsigned int need, 
+                         unsigned int *size);
+static void block_free(cache_pool *pool, void *block, unsigned int size);
+static void *page_alloc(cache_pool *pool);
+static void page_free(cache_pool *pool, void *page);
+static void *region_take(cache_pool *pool, size_t size);
+static void discard_cache_node(cache_list *list, cache_node *node);
+static char *find_tags(char *data, unsigned int len);
+static int has_tag(char *tags, char *tag);
+static void collect_id(void *vargp, void *value);
+static int purge_ids(cache_list *list, char **ids, int n);
+static unsigned int l1_hash(char *id);
+static cache_node *l1_lookup(cache_list *list, char *id, unsigned int h);
+static void l1_insert(unsigned int h, cache_node *node, 
+                      unsigned long generation);
 
 
 
@@ -26,9 +81,17 @@ cache_list *init_cache_list()
   cache_list *list = (cache_list *)Malloc(sizeof(cache_list));
 
   //Initialize data for the list
-  list->front = NULL;
-  list->back = NULL;
-  list->available_len = MAX_CACHE_SIZE;
+  memset(list->tiers, 0, sizeof(list->tiers));
+  list->tiers[CACHE_SMALL].capacity = CACHE_SMALL_SHARE;
+  list->tiers[CACHE_LARGE].capacity = MAX_CACHE_SIZE - CACHE_SMALL_SHARE;
+  list->tiers[CACHE_SMALL].available_len = list->tiers[CACHE_SMALL].capacity;
+  list->tiers[CACHE_LARGE].available_len = list->tiers[CACHE_LARGE].capacity;
+  list->fresh_ttl = 0;
+  list->index = init_radix();
+  list->generation = 0;
+  memset(&list->pool, 0, sizeof(cache_pool));
+  list->pool.numa_node = -1;
+  Sem_init(&list->pool.mutex, 0, 1);
   Sem_init(&list->w, 0, 1); /* as given in book, initialize sem to 1 */
   Sem_init(&list->r, 0, 1);
   list->read_counter = 0;
@@ -39,19 +102,55 @@ cache_list *init_cache_list()
 
 
 /*
- * init_cache_node: init a cache node
+ * init_cache_node: init a cache node with room for len bytes
+ * of data, in the tier for its size, from list's pool,
  * and return a pointer to that node
  */
-cache_node *init_cache_node(char *id, int len) 
+cache_node *init_cache_node(cache_list *list, char *id, int len) 
 {
-  //Allocate memonry for the node and id string
-  cache_node *node = (cache_node *)Malloc(sizeof(cache_node));
-  node->id = (char *)Malloc(sizeof(char) * (strlen(id) + 1));
+  cache_node *node;
+  unsigned int id_len = strlen(id) + 1;
+  unsigned int need = sizeof(cache_node) + id_len + len;
+  unsigned int size, npages, i;
+
+  if (need <= CACHE_SMALL_MAX)
+  {
+    //One block for the node, id and data
+    node = (cache_node *)block_alloc(&list->pool, need, &size);
+    node->tier = CACHE_SMALL;
+    node->size = size;
+    node->id = node->block;
+    node->data = node->block + id_len;
+    node->pages = NULL;
+  }
+  else
+  {
+    //Node, page table and id in one malloc, the data in pages
+    npages = (len + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE;
+    node = (cache_node *)Malloc(sizeof(cache_node) + 
+                                npages * sizeof(char *) + id_len);
+    node->tier = CACHE_LARGE;
+    node->size = npages * CACHE_PAGE_SIZE;
+    node->pages = (char **)node->block;
+    node->id = node->block + npages * sizeof(char *);
+    node->data = NULL;
+    for (i = 0; i < npages; i++)
+    {
+      node->pages[i] = (char *)page_alloc(&list->pool);
+    }
+  }
   
   //Initialize the data for the node 
   strcpy(node->id, id);
   node->data_len = 0;
-  node->data = Malloc(len);
+  node->stored = timer_now_ms();
+  node->refreshing = 0;
+  node->mapped = 0;
+  node->tags = NULL;
+  node->refs = 1;          /* The list's */
+  node->removed = 0;
+  node->referenced = 0;
+  node->pool = &list->pool;
   node->next = NULL;
 
   return node;
@@ -60,23 +159,67 @@ cache_node *init_cache_node(char *id, int len)
 
 
 /*
- * search_cache_list: search cache list with id as token.
- *
- * Return node if node->id == id, 
- * else return NULL.  
+ * cache_node_copy: copy the data of node to data
  */
-cache_node *search_cache_list(cache_list *list, char *id) 
+void cache_node_copy(cache_node *node, void *data)
 {
-  cache_node *node = list->front;
-  while (node != NULL) 
+  unsigned int done, n;
+
+  if (node->pages == NULL)
+  {
+    memcpy(data, node->data, node->data_len);
+    return;
+  }
+  for (done = 0; done < node->data_len; done += n)
   {
-    if (strcmp(node->id, id)==0) 
+    n = node->data_len - done;
+    if (n > CACHE_PAGE_SIZE)
     {
-	  return node;
+      n = CACHE_PAGE_SIZE;
     }
-    node = node->next;
+    memcpy((char *)data + done, node->pages[done / CACHE_PAGE_SIZE], n);
   }
-  return NULL;
+}
+
+
+
+/*
+ * cache_node_fill: copy len bytes from data into node, which
+ * was made with room for them
+ */
+void cache_node_fill(cache_node *node, void *data, unsigned int len)
+{
+  unsigned int done, n;
+
+  node->data_len = len;
+  if (node->pages == NULL)
+  {
+    memcpy(node->data, data, len);
+    return;
+  }
+  for (done = 0; done < len; done += n)
+  {
+    n = len - done;
+    if (n > CACHE_PAGE_SIZE)
+    {
+      n = CACHE_PAGE_SIZE;
+    }
+    memcpy(node->pages[done / CACHE_PAGE_SIZE], (char *)data + done, n);
+  }
+}
+
+
+
+/*
+ * search_cache_list: search cache list with id as token,
+ * through the index rather than along the lists.
+ *
+ * Return node if node->id == id, 
+ * else return NULL.  
+ */
+cache_node *search_cache_list(cache_list *list, char *id) 
+{
+  return (cache_node *)radix_lookup(list->index, id);
 }
 
 
@@ -89,9 +232,42 @@ void terminate_cache_node(cache_node *node)
 {
   //Use wrapper free to avoid errors
   //Actually I dont think free can have errors
-  Free(node->id);
-  Free(node->data);
-  Free(node);
+  unsigned int i;
+
+  if (node->tags != NULL)
+  {
+    Free(node->tags);
+  }
+  if (node->mapped)
+  {
+    Free(node);      /* id and data are in the snapshot */
+  }
+  else if (node->tier == CACHE_SMALL)
+  {
+    block_free(node->pool, node, node->size);
+  }
+  else
+  {
+    for (i = 0; i < node->size / CACHE_PAGE_SIZE; i++)
+    {
+      page_free(node->pool, node->pages[i]);
+    }
+    Free(node);
+  }
+}
+
+
+
+/*
+ * cache_node_put: let go of a reference to node, the last
+ * one frees it
+ */
+void cache_node_put(cache_node *node)
+{
+  if (__sync_sub_and_fetch(&node->refs, 1) == 0)
+  {
+    terminate_cache_node(node);
+  }
 }
 
 
@@ -101,46 +277,50 @@ void terminate_cache_node(cache_node *node)
  */
 void add_cache_node(cache_list *list, cache_node *node) 
 {
-  if (list->front == NULL)  /* Case where nothing in list */
+  cache_tier *tier = &list->tiers[node->tier];
+
+  if (tier->front == NULL)  /* Case where nothing in list */
   {
-	list->front = list->back = node;
-	list->available_len -= node->data_len;
+	tier->front = tier->back = node;
   } 
   else   /* Case where list is non-empty */
   {
-	list->back->next = node;
-	list->back = node;
-	list->available_len -= node->data_len;
+	tier->back->next = node;
+	tier->back = node;
   }
+  tier->available_len -= node->size;
+  tier->count++;
 }
 
 
 
 /*
  * delete_cache_node: Delete a cache node from the
- *                    front of the cache list.
+ *                    front of the tier's list.
  *
  *                  : Return NULL if list empty,
  *                    else return the node pointer 
  *   
  */
-cache_node *delete_cache_node(cache_list *list) 
+cache_node *delete_cache_node(cache_tier *tier) 
 {
   /* Node at front of list */
-  cache_node *node = list->front; 
+  cache_node *node = tier->front; 
   if (node == NULL) 
   {
 	return NULL;
   }
   
   /* Node at middle of list */
-  list->front = node->next;
-  list->available_len += node->data_len;
+  tier->front = node->next;
+  tier->available_len += node->size;
+  tier->count--;
+  node->next = NULL;
   
   /* Node at back of list */                    
-  if (node == list->back) 
+  if (node == tier->back) 
   {
-	list->back = NULL;
+	tier->back = NULL;
   }
   
   return node;
@@ -149,19 +329,43 @@ cache_node *delete_cache_node(cache_list *list)
 
 
 /*
- * add_cache_node_wrapper: Remove nodes from start of list
- *                         till there is enough space for new node.
+ * add_cache_node_wrapper: Remove nodes from start of the tier's 
+ *                         list till there is enough space for new node.
  *                       : Add new node at back of list
+ *                       : An older node with the same id (stale, or
+ *                         fetched twice) is replaced
  */
 void add_cache_node_wrapper(cache_list *list, cache_node *node) 
 {
+    cache_node *old;
+    cache_tier *tier = &list->tiers[node->tier];
+
     P(&(list->w));    /* Surround with P&V function to protect cache */
-    while (list->available_len < node->data_len) 
+    if ((old = remove_cache_node(list, node->id)) != NULL)
+    {
+        discard_cache_node(list, old);
+    }
+    while (tier->available_len < node->size && 
+           (old = delete_cache_node(tier)) != NULL) 
+    {
+        /* Hot in some L1, back of the line instead (once) */
+        if (old->referenced)
+        {
+            old->referenced = 0;
+            add_cache_node(list, old);
+            continue;
+        }
+        tier->evictions++;
+        discard_cache_node(list, old);
+    }
+    if (tier->available_len < node->size)
     {
-        cache_node *node = delete_cache_node(list);
-        terminate_cache_node(node);
+        cache_node_put(node);   /* Bigger than the whole tier */
+        V(&(list->w));
+        return;
     }
     add_cache_node(list, node);
+    radix_insert(list->index, node->id, node);
     V(&(list->w));   /* Surround with P&V function to protect cache */
 }
 
@@ -177,25 +381,31 @@ void add_cache_node_wrapper(cache_list *list, cache_node *node)
 cache_node *remove_cache_node(cache_list *list, char *id) 
 {
   /* Variables for the current and previous nodes */
-  cache_node *node_one = NULL;
-  cache_node *node_two = list->front;
+  cache_node *node_one, *node_two;
+  cache_tier *tier;
+  int t;
   
-  while (node_two != NULL) 
+  for (t = 0; t < CACHE_TIERS; t++)
   {
+   tier = &list->tiers[t];
+   node_one = NULL;
+   node_two = tier->front;
+   while (node_two != NULL) 
+   {
     /* If id has been found in list, consider case */
     if (strcmp(node_two->id,id)==0) 
 	{
 	
 	  /* Case 1, at front of list */
-	  if (list->front == node_two) 
+	  if (tier->front == node_two) 
 	  {
-		list->front = node_two->next;
+		tier->front = node_two->next;
 	  }
 	  
       /* Case 2, at back of list */
-	  if (list->back == node_two) 
+	  if (tier->back == node_two) 
 	  {
-		list->back = node_one;
+		tier->back = node_one;
 	  }
 	  
       /* Case 3, in middle of list */ 
@@ -205,13 +415,15 @@ cache_node *remove_cache_node(cache_list *list, char *id)
 	  }
       
 	  node_two->next = NULL;
-	  list->available_len += node_two->data_len;
+	  tier->available_len += node_two->size;
+	  tier->count--;
 	  return node_two;
 	}
 	
 	/* Else case, id not found */
 	node_one = node_two;
 	node_two = node_two->next;
+   }
   }
   
   return NULL;
@@ -223,16 +435,46 @@ cache_node *remove_cache_node(cache_list *list, char *id)
  * proxy_read_from_cache: get content from cache for the
  * proxy, using LRU policy
  *
- * Error signaled on return of -1, 0 on normal return
- * Error in this case means not found in cache
+ * Nodes older than list->fresh_ttl are stale, they are still
+ * returned if they are stale by no more than max_stale ms.
+ * If refresh is not NULL, the first caller to get a stale node
+ * has *refresh set to 1 and is the one to start its refresh.
+ *
+ * The thread's L1 is tried first, a fresh node found in the
+ * list goes into it.
+ *
+ * Error signaled on return of -1, 0 on normal return, 1 if stale
+ * Error in this case means not found in cache (or too stale)
  */
 int proxy_read_from_cache(cache_list *list, char *id, void *data,
-                          unsigned int *len) 
+                          unsigned int *len, unsigned int max_stale,
+                          int *refresh) 
 {
+  int stale = 0;
+  long age;
+  cache_node *node;
+  cache_node *keep = NULL;   /* Goes in the L1 */
+  unsigned long generation = 0;
+  unsigned int h;
+
+  if (refresh != NULL)
+  {
+    *refresh = 0;
+  }
   if (list == NULL) 
   {
 	return -1;   /* Error */
   }
+  
+  /* L1 hit, nothing shared is locked or written */
+  h = l1_hash(id);
+  if ((node = l1_lookup(list, id, h)) != NULL)
+  {
+    *len = node->data_len;
+    cache_node_copy(node, data);
+    return 0;
+  }
+  
   /* Using semaphores for mutual exclusion */
   P(&(list->r));
   list->read_counter++;  /* Raise the counter to check nodes */
@@ -242,7 +484,26 @@ int proxy_read_from_cache(cache_list *list, char *id, void *data,
   }
   V(&(list->r));
 
-  cache_node *node = search_cache_list(list, id);
+  node = search_cache_list(list, id);
+
+  /* Check freshness, too stale counts as not found */
+  if ((node != NULL) && (list->fresh_ttl != 0))
+  {
+    age = timer_now_ms() - node->stored;
+    if (age > (long)list->fresh_ttl)
+    {
+      stale = 1;
+      if (age - list->fresh_ttl > (long)max_stale)
+      {
+        node = NULL;
+      }
+      else if ((refresh != NULL) && 
+               __sync_bool_compare_and_swap(&node->refreshing, 0, 1))
+      {
+        *refresh = 1;
+      }
+    }
+  }
 
   if (node == NULL) 
   {
@@ -257,7 +518,15 @@ int proxy_read_from_cache(cache_list *list, char *id, void *data,
   }
   /* Else, found node with id */
   *len = node->data_len;
-  memcpy(data, node->data, *len);
+  cache_node_copy(node, data);
+  /* Small and fresh, a reference goes to the L1. Taken while the
+     node is surely in the list, with the generation of now */
+  if (!stale && node->data_len <= L1_MAX_OBJECT)
+  {
+    __sync_add_and_fetch(&node->refs, 1);
+    keep = node;
+    generation = list->generation;
+  }
   P(&(list->r));
   list->read_counter--;
   if (list->read_counter == 0) 
@@ -267,11 +536,18 @@ int proxy_read_from_cache(cache_list *list, char *id, void *data,
   V(&(list->r));
   //Using LRU
   P(&(list->w));
-  /* Re enter into list since just used */
+  /* Re enter into list since just used, unless it was evicted meanwhile */
   node = remove_cache_node(list, id);
-  add_cache_node(list, node);
+  if (node != NULL)
+  {
+    add_cache_node(list, node);
+  }
   V(&(list->w));
-  return 0;  /* Normal return */
+  if (keep != NULL)
+  {
+    l1_insert(h, keep, generation);
+  }
+  return stale;  /* Normal return */
 }
 
 
@@ -291,15 +567,914 @@ int proxy_write_to_cache(cache_list *list, char *id,
   }
 
   /* Initialize node */
-  cache_node *node = init_cache_node(id, len);
+  cache_node *node = init_cache_node(list, id, len);
 
   if (node == NULL) 
   {
 	return -1; /* Error */
   }
   
-  memcpy(node->data, data, len);
-  node->data_len = len;
+  cache_node_fill(node, data, len);
+  node->tags = find_tags((char *)data, len);
   add_cache_node_wrapper(list, node);
   return 0;
-}
\ No newline at end of file
+}
+
+
+
+/*
+ * proxy_check_cache: check whether id is in the cache without
+ * copying it out or touching the LRU order
+ *
+ * Returns 1 if found, else 0
+ */
+int proxy_check_cache(cache_list *list, char *id)
+{
+  int found;
+
+  if (list == NULL)
+  {
+    return 0;
+  }
+  /* Same reader side as proxy_read_from_cache */
+  P(&(list->r));
+  list->read_counter++;
+  if (list->read_counter == 1)
+  {
+    P(&(list->w));
+  }
+  V(&(list->r));
+
+  found = (search_cache_list(list, id) != NULL);
+
+  P(&(list->r));
+  list->read_counter--;
+  if (list->read_counter == 0)
+  {
+    V(&(list->w));
+  }
+  V(&(list->r));
+  return found;
+}
+
+
+
+/*
+ * proxy_refresh_done: a refresh of id failed, let the next
+ * stale read try again
+ */
+void proxy_refresh_done(cache_list *list, char *id)
+{
+  cache_node *node;
+
+  if (list == NULL)
+  {
+    return;
+  }
+  P(&(list->w));
+  if ((node = search_cache_list(list, id)) != NULL)
+  {
+    node->refreshing = 0;
+  }
+  V(&(list->w));
+}
+
+
+
+/*
+ * Purges: the ids to take out are found first with only the
+ * reader side held, then taken out PURGE_BATCH at a time with the
+ * write lock, so readers get in between batches. A node that is
+ * gone by the time its batch comes up is just skipped.
+ *
+ * All return the number of nodes taken out
+ */
+
+/* The ids found for a purge */
+typedef struct purge_list
+{
+  char **ids;
+  int n, max;
+} purge_list;
+
+
+
+/*
+ * proxy_purge: take out the node for id
+ */
+int proxy_purge(cache_list *list, char *id)
+{
+  if (list == NULL)
+  {
+    return 0;
+  }
+  return purge_ids(list, &id, 1);
+}
+
+
+
+/*
+ * proxy_purge_prefix: take out every node whose id starts
+ * with prefix, found through the index
+ */
+int proxy_purge_prefix(cache_list *list, char *prefix)
+{
+  purge_list found = { NULL, 0, 0 };
+  int i, n;
+
+  if (list == NULL)
+  {
+    return 0;
+  }
+  P(&(list->r));
+  list->read_counter++;
+  if (list->read_counter == 1)
+  {
+    P(&(list->w));
+  }
+  V(&(list->r));
+
+  radix_collect(list->index, prefix, collect_id, &found);
+
+  P(&(list->r));
+  list->read_counter--;
+  if (list->read_counter == 0)
+  {
+    V(&(list->w));
+  }
+  V(&(list->r));
+
+  n = purge_ids(list, found.ids, found.n);
+  for (i = 0; i < found.n; i++)
+  {
+    Free(found.ids[i]);
+  }
+  if (found.ids != NULL)
+  {
+    Free(found.ids);
+  }
+  return n;
+}
+
+
+
+/*
+ * proxy_purge_tag: take out every node whose response had tag
+ * among its Surrogate-Key tags
+ */
+int proxy_purge_tag(cache_list *list, char *tag)
+{
+  purge_list found = { NULL, 0, 0 };
+  cache_node *node;
+  int i, n, tier;
+
+  if (list == NULL)
+  {
+    return 0;
+  }
+  P(&(list->r));
+  list->read_counter++;
+  if (list->read_counter == 1)
+  {
+    P(&(list->w));
+  }
+  V(&(list->r));
+
+  for (tier = 0; tier < CACHE_TIERS; tier++)
+  {
+    for (node = list->tiers[tier].front; node != NULL; node = node->next)
+    {
+      if (node->tags != NULL && has_tag(node->tags, tag))
+      {
+        collect_id(&found, node);
+      }
+    }
+  }
+
+  P(&(list->r));
+  list->read_counter--;
+  if (list->read_counter == 0)
+  {
+    V(&(list->w));
+  }
+  V(&(list->r));
+
+  n = purge_ids(list, found.ids, found.n);
+  for (i = 0; i < found.n; i++)
+  {
+    Free(found.ids[i]);
+  }
+  if (found.ids != NULL)
+  {
+    Free(found.ids);
+  }
+  return n;
+}
+
+
+
+/*
+ * snapshot_write: add len bytes of data to the dump, going
+ * through buf so the file sees only big writes
+ *
+ * Returns -1 on error, 0 on success
+ */
+static int snapshot_write(int fd, char *buf, unsigned int *used,
+                          const void *data, unsigned int len)
+{
+  unsigned int n;
+
+  while (len > 0)
+  {
+    n = SNAPSHOT_BUF - *used;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(buf + *used, data, n);
+    *used += n;
+    data = (const char *)data + n;
+    len -= n;
+    if (*used == SNAPSHOT_BUF)
+    {
+      if (rio_writen(fd, buf, SNAPSHOT_BUF) != SNAPSHOT_BUF)
+      {
+        return -1;
+      }
+      *used = 0;
+    }
+  }
+  return 0;
+}
+
+
+
+/*
+ * cache_save_snapshot: dump every node to filename, so a restarted
+ * proxy can start with a warm cache
+ *
+ * Written to filename.tmp then renamed, a crash halfway leaves the
+ * last good snapshot. Readers can go on while it is written.
+ *
+ * Returns -1 on error, 0 on success
+ */
+int cache_save_snapshot(cache_list *list, char *filename)
+{
+  char tmpname[MAXLINE];
+  char *buf;
+  unsigned int used = 0;
+  static const char pad[8] = { 0 };
+  snapshot_header header;
+  snapshot_entry entry;
+  cache_node *node;
+  struct timeval tv;
+  long now = timer_now_ms();
+  unsigned int done, n;
+  int fd, rc = 0, tier;
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    return -1;
+  }
+  buf = (char *)Malloc(SNAPSHOT_BUF);
+
+  /* Reader side, same as proxy_check_cache */
+  P(&(list->r));
+  list->read_counter++;
+  if (list->read_counter == 1)
+  {
+    P(&(list->w));
+  }
+  V(&(list->r));
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  gettimeofday(&tv, NULL);
+  header.saved_ms = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+  for (tier = 0; tier < CACHE_TIERS; tier++)
+  {
+    header.count += list->tiers[tier].count;
+  }
+  rc = snapshot_write(fd, buf, &used, &header, sizeof(header));
+
+  for (tier = 0; tier < CACHE_TIERS; tier++)
+  {
+    for (node = list->tiers[tier].front; node != NULL && rc == 0; 
+         node = node->next)
+    {
+      entry.id_len = strlen(node->id) + 1;
+      entry.data_len = node->data_len;
+      entry.age_ms = now - node->stored;
+      if (snapshot_write(fd, buf, &used, &entry, sizeof(entry)) < 0 ||
+          snapshot_write(fd, buf, &used, node->id, entry.id_len) < 0)
+      {
+        rc = -1;
+      }
+      /* The data, page by page for the large tier */
+      for (done = 0; done < entry.data_len && rc == 0; done += n)
+      {
+        n = entry.data_len - done;
+        if (node->pages != NULL && n > CACHE_PAGE_SIZE)
+        {
+          n = CACHE_PAGE_SIZE;
+        }
+        rc = snapshot_write(fd, buf, &used, (node->pages == NULL) ? 
+                            (char *)node->data + done :
+                            node->pages[done / CACHE_PAGE_SIZE], n);
+      }
+      if (rc == 0 && snapshot_write(fd, buf, &used, pad, 
+                           -(entry.id_len + entry.data_len) & 7) < 0)
+      {
+        rc = -1;
+      }
+    }
+  }
+
+  P(&(list->r));
+  list->read_counter--;
+  if (list->read_counter == 0)
+  {
+    V(&(list->w));
+  }
+  V(&(list->r));
+
+  /* What is left in the buffer */
+  if (rc == 0 && used > 0 && rio_writen(fd, buf, used) != (ssize_t)used)
+  {
+    rc = -1;
+  }
+  Free(buf);
+  if (close(fd) < 0 || rc < 0 || rename(tmpname, filename) < 0)
+  {
+    unlink(tmpname);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/*
+ * cache_load_snapshot: fill the empty cache from a snapshot
+ *
+ * The file is mmap'd and the nodes point into it, nothing is
+ * copied. A page is only read from disk when a node on it is
+ * first served, so the proxy is up right away. The mapping is
+ * kept for as long as the proxy runs. Nodes go in the tier for
+ * their size, charged their data_len.
+ *
+ * Returns the nodes loaded, or -1 if the file is missing or bad
+ */
+int cache_load_snapshot(cache_list *list, char *filename)
+{
+  struct stat st;
+  struct timeval tv;
+  snapshot_header *header;
+  snapshot_entry *entry;
+  cache_node *node;
+  char *map, *end, *p;
+  long now = timer_now_ms();
+  long away;
+  uint64_t i;
+  int fd, tier, loaded = 0;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+  {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snapshot_header))
+  {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+  end = map + st.st_size;
+  header = (snapshot_header *)map;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+  {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  /* Start reading it all in the background */
+  madvise(map, st.st_size, MADV_WILLNEED);
+
+  /* Nodes also aged while the proxy was down */
+  gettimeofday(&tv, NULL);
+  away = tv.tv_sec * 1000LL + tv.tv_usec / 1000 - header->saved_ms;
+  if (away < 0)
+  {
+    away = 0;
+  }
+
+  P(&(list->w));
+  p = map + sizeof(snapshot_header);
+  for (i = 0; i < header->count; i++)
+  {
+    entry = (snapshot_entry *)p;
+    if (end - p < (long)sizeof(snapshot_entry) ||
+        entry->id_len == 0 || entry->data_len > MAX_OBJECT_SIZE ||
+        end - p - (long)sizeof(snapshot_entry) < 
+        (long)entry->id_len + entry->data_len ||
+        p[sizeof(snapshot_entry) + entry->id_len - 1] != '\0')
+    {
+      break;       /* Cut short, keep what came before */
+    }
+    tier = (sizeof(cache_node) + entry->id_len + entry->data_len <=
+            CACHE_SMALL_MAX) ? CACHE_SMALL : CACHE_LARGE;
+    if (entry->data_len <= list->tiers[tier].available_len)
+    {
+      node = (cache_node *)Malloc(sizeof(cache_node));
+      node->id = p + sizeof(snapshot_entry);
+      node->data = node->id + entry->id_len;
+      node->pages = NULL;
+      node->pool = &list->pool;
+      node->data_len = entry->data_len;
+      node->size = entry->data_len;
+      node->tier = tier;
+      node->stored = now - entry->age_ms - away;
+      node->refreshing = 0;
+      node->mapped = 1;
+      node->tags = find_tags((char *)node->data, node->data_len);
+      node->refs = 1;
+      node->removed = 0;
+      node->referenced = 0;
+      node->next = NULL;
+      add_cache_node(list, node);
+      radix_insert(list->index, node->id, node);
+      loaded++;
+    }
+    p += sizeof(snapshot_entry) + 
+         ((entry->id_len + entry->data_len + 7) & ~7u);
+  }
+  V(&(list->w));
+  return loaded;
+}
+
+
+
+/*
+ * cache_report: print how full each tier is
+ */
+void cache_report(cache_list *list, FILE *fp)
+{
+  static const char *names[CACHE_TIERS] = { "small", "large" };
+  cache_tier *tier;
+  int t;
+
+  P(&(list->w));
+  fprintf(fp, "%-8s %9s %9s %9s %9s\n", "tier", "objects", "used",
+          "capacity", "evictions");
+  for (t = 0; t < CACHE_TIERS; t++)
+  {
+    tier = &list->tiers[t];
+    fprintf(fp, "%-8s %9u %9u %9u %9lu\n", names[t], tier->count,
+            tier->capacity - tier->available_len, tier->capacity,
+            tier->evictions);
+  }
+  if (list->pool.region != NULL)
+  {
+    P(&list->pool.mutex);
+    fprintf(fp, "reserved %ldKB in %s pages", 
+            (long)(list->pool.region_end - list->pool.region) >> 10, 
+            list->pool.region_kind);
+    if (list->pool.numa_node >= 0)
+    {
+      fprintf(fp, " on node %d", numa_node_id(list->pool.numa_node));
+    }
+    fprintf(fp, ", %ldKB handed out\n",
+            (long)(list->pool.region_next - list->pool.region) >> 10);
+    V(&list->pool.mutex);
+  }
+  fflush(fp);
+  V(&(list->w));
+}
+
+
+
+/*
+ * block_alloc: a small tier block of the smallest class that
+ * holds need bytes, its size is left in *size
+ */
+static void *block_alloc(cache_pool *pool, unsigned int need, 
+                         unsigned int *size)
+{
+  int c = 0;
+  void *block;
+
+  while ((CACHE_CLASS_MIN << c) < need)
+  {
+    c++;
+  }
+  *size = CACHE_CLASS_MIN << c;
+
+  P(&pool->mutex);
+  if ((block = pool->free_blocks[c]) != NULL)
+  {
+    pool->free_blocks[c] = *(void **)block;
+  }
+  else
+  {
+    /* Carve from the arena, a new chunk once it runs out. The
+       tail of the old chunk is too small for this class, it is
+       left unused */
+    if (pool->arena_next == NULL || 
+        pool->arena_end - pool->arena_next < (long)*size)
+    {
+      pool->arena_next = (char *)region_take(pool, CACHE_ARENA_CHUNK);
+      if (pool->arena_next == NULL)
+      {
+        pool->arena_next = (char *)Malloc(CACHE_ARENA_CHUNK);
+      }
+      pool->arena_end = pool->arena_next + CACHE_ARENA_CHUNK;
+    }
+    block = pool->arena_next;
+    pool->arena_next += *size;
+  }
+  V(&pool->mutex);
+  return block;
+}
+
+
+
+/*
+ * block_free: put a small tier block back on its class's free list
+ */
+static void block_free(cache_pool *pool, void *block, unsigned int size)
+{
+  int c = 0;
+
+  while ((CACHE_CLASS_MIN << c) < size)
+  {
+    c++;
+  }
+  P(&pool->mutex);
+  *(void **)block = pool->free_blocks[c];
+  pool->free_blocks[c] = block;
+  V(&pool->mutex);
+}
+
+
+
+/*
+ * page_alloc: a large tier page, off the free list if there is one
+ */
+static void *page_alloc(cache_pool *pool)
+{
+  void *page;
+
+  P(&pool->mutex);
+  if ((page = pool->free_pages) != NULL)
+  {
+    pool->free_pages = *(void **)page;
+  }
+  else
+  {
+    page = region_take(pool, CACHE_PAGE_SIZE);
+  }
+  V(&pool->mutex);
+  if (page == NULL)
+  {
+    page = Malloc(CACHE_PAGE_SIZE);
+  }
+  return page;
+}
+
+
+
+/*
+ * page_free: put a page back on the free list
+ */
+static void page_free(cache_pool *pool, void *page)
+{
+  P(&pool->mutex);
+  *(void **)page = pool->free_pages;
+  pool->free_pages = page;
+  V(&pool->mutex);
+}
+
+
+
+/*
+ * discard_cache_node: a node taken out of its list for good,
+ * out of the index, and the list's reference let go of. Called
+ * with the write lock held.
+ */
+static void discard_cache_node(cache_list *list, cache_node *node)
+{
+  /* Only if the index still has this node for the id */
+  if (radix_lookup(list->index, node->id) == node)
+  {
+    radix_remove(list->index, node->id);
+  }
+  /* L1s see the generation move, then the flag */
+  __atomic_store_n(&node->removed, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&list->generation, 1, __ATOMIC_RELEASE);
+  cache_node_put(node);
+}
+
+
+
+/*
+ * find_tags: the value of the Surrogate-Key header in the
+ * response (len bytes at data), malloc'd, or NULL if there is none
+ */
+static char *find_tags(char *data, unsigned int len)
+{
+  static const char name[] = "Surrogate-Key:";
+  int n = sizeof(name) - 1;
+  char *p = data, *end = data + len, *eol, *q, *tags;
+
+  while (p < end && (eol = memchr(p, '\n', end - p)) != NULL)
+  {
+    if (eol - p <= 1)
+    {
+      break;       /* Empty line, end of the headers */
+    }
+    if (eol - p > n && strncasecmp(p, name, n) == 0)
+    {
+      p += n;
+      while (p < eol && isspace((unsigned char)*p))
+      {
+        p++;
+      }
+      q = eol;
+      while (q > p && isspace((unsigned char)q[-1]))
+      {
+        q--;
+      }
+      tags = (char *)Malloc(q - p + 1);
+      memcpy(tags, p, q - p);
+      tags[q - p] = '\0';
+      return tags;
+    }
+    p = eol + 1;
+  }
+  return NULL;
+}
+
+
+
+/*
+ * has_tag: tag is one of the space separated tags
+ */
+static int has_tag(char *tags, char *tag)
+{
+  int n = strlen(tag);
+  char *p = tags;
+
+  while ((p = strstr(p, tag)) != NULL)
+  {
+    if ((p == tags || isspace((unsigned char)p[-1])) &&
+        (p[n] == '\0' || isspace((unsigned char)p[n])))
+    {
+      return 1;
+    }
+    p += n;
+  }
+  return 0;
+}
+
+
+
+/*
+ * collect_id: add a copy of the node's id to the purge_list
+ */
+static void collect_id(void *vargp, void *value)
+{
+  purge_list *found = (purge_list *)vargp;
+  cache_node *node = (cache_node *)value;
+
+  if (found->n == found->max)
+  {
+    found->max = found->max ? found->max * 2 : 16;
+    found->ids = (char **)Realloc(found->ids, found->max * sizeof(char *));
+  }
+  found->ids[found->n] = (char *)Malloc(strlen(node->id) + 1);
+  strcpy(found->ids[found->n++], node->id);
+}
+
+
+
+/*
+ * purge_ids: take out the nodes for the n ids, PURGE_BATCH
+ * per hold of the write lock
+ */
+static int purge_ids(cache_list *list, char **ids, int n)
+{
+  cache_node *node;
+  int i, done = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    if (i % PURGE_BATCH == 0)
+    {
+      P(&(list->w));
+    }
+    if ((node = remove_cache_node(list, ids[i])) != NULL)
+    {
+      discard_cache_node(list, node);
+      done++;
+    }
+    if (i % PURGE_BATCH == PURGE_BATCH - 1 || i == n - 1)
+    {
+      V(&(list->w));
+    }
+  }
+  return done;
+}
+
+
+
+/*
+ * l1_hash: FNV-1a of the id, picks the L1 slot
+ */
+static unsigned int l1_hash(char *id)
+{
+  unsigned int h = 2166136261u;
+
+  while (*id != '\0')
+  {
+    h = (h ^ (unsigned char)*id++) * 16777619u;
+  }
+  return h;
+}
+
+
+
+/*
+ * l1_lookup: the node for id in this thread's L1, if it is still
+ * in the cache and fresh. Each lookup also lets go of a removed
+ * node in one other slot, so an L1 does not hold on to memory
+ * the cache has given up for long.
+ */
+static cache_node *l1_lookup(cache_list *list, char *id, unsigned int h)
+{
+  unsigned long generation = __atomic_load_n(&list->generation, 
+                                             __ATOMIC_ACQUIRE);
+  l1_entry *e;
+  cache_node *node;
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    e = (i == 0) ? &l1[h & (L1_SLOTS - 1)] : 
+                   &l1[l1_sweep++ & (L1_SLOTS - 1)];
+    if ((node = e->node) == NULL || e->generation == generation)
+    {
+      continue;
+    }
+    if (__atomic_load_n(&node->removed, __ATOMIC_ACQUIRE))
+    {
+      e->node = NULL;
+      cache_node_put(node);
+    }
+    else
+    {
+      e->generation = generation;
+    }
+  }
+
+  e = &l1[h & (L1_SLOTS - 1)];
+  if ((node = e->node) == NULL || e->hash != h || strcmp(node->id, id) != 0)
+  {
+    return NULL;
+  }
+  /* Stale ones go the long way, which deals with refreshing */
+  if (list->fresh_ttl != 0 && 
+      timer_now_ms() - node->stored > (long)list->fresh_ttl)
+  {
+    return NULL;
+  }
+  /* Written once per trip through the LRU, not per hit */
+  if (!node->referenced)
+  {
+    node->referenced = 1;
+  }
+  return node;
+}
+
+
+
+/*
+ * l1_insert: put node (a reference already taken for it) in its
+ * slot, letting go of what was there
+ */
+static void l1_insert(unsigned int h, cache_node *node, 
+                      unsigned long generation)
+{
+  l1_entry *e = &l1[h & (L1_SLOTS - 1)];
+
+  if (e->node != NULL)
+  {
+    cache_node_put(e->node);
+  }
+  e->node = node;
+  e->hash = h;
+  e->generation = generation;
+}
+
+
+
+/*
+ * cache_reserve: map size bytes for list's arena chunks and pages
+ * and fault them all in now. With huge set they are in 2MB pages,
+ * with numa_node >= 0 (a numa.h index) on that node's memory.
+ * Call once per list, after init_cache_list and before any node
+ * is made. Returns -1 if no huge pages could be had, the list then
+ * keeps using malloc.
+ */
+int cache_reserve(cache_list *list, size_t size, int huge, int numa_node)
+{
+  cache_pool *pool = &list->pool;
+  size_t step = huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  const char *kind = "4KB";
+  char *p = MAP_FAILED, *aligned;
+  size_t i;
+
+  size = (size + step - 1) & ~(step - 1);
+
+  /* Pages from the hugetlbfs pool. Not populated by the kernel yet,
+     the node has to be set before they are touched */
+  if (huge)
+  {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    kind = "hugetlb";
+  }
+  if (huge && p == MAP_FAILED)
+  {
+    /* None set aside, ask for transparent huge pages instead. THP
+       only backs 2MB aligned ranges, so map one more and trim */
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+      return -1;
+    }
+    aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & 
+                       ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > p)
+    {
+      munmap(p, aligned - p);
+    }
+    munmap(aligned + size, (p + HUGE_PAGE_SIZE) - aligned);
+    p = aligned;
+    if (madvise(p, size, MADV_HUGEPAGE) < 0)
+    {
+      munmap(p, size);
+      return -1;
+    }
+    kind = "thp";
+  }
+  if (!huge && (p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  /* Best effort, without NUMA in the kernel it is just memory */
+  if (numa_node >= 0 && numa_bind_memory(p, size, numa_node) < 0)
+  {
+    numa_node = -1;
+  }
+  /* One write per page faults the whole of it in */
+  for (i = 0; i < size; i += step)
+  {
+    p[i] = 0;
+  }
+
+  P(&pool->mutex);
+  pool->region = pool->region_next = p;
+  pool->region_end = p + size;
+  pool->region_kind = kind;
+  pool->numa_node = numa_node;
+  V(&pool->mutex);
+  return 0;
+}
+
+
+
+/*
+ * region_take: size bytes off the front of the pool's region,
+ * NULL if there is no region or not enough of it left. Called
+ * with the pool's mutex held.
+ */
+static void *region_take(cache_pool *pool, size_t size)
+{
+  void *p;
+
+  if (pool->region_next == NULL || 
+      (size_t)(pool->region_end - pool->region_next) < size)
+  {
+    return NULL;
+  }
+  p = pool->region_next;
+  pool->region_next += size;
+  return p;
+}
@@ -6,45 +6,165 @@
  * The cache will be a linked list
  * with nodes for each id (page).
  *
+ * Nodes are kept in two tiers, each its own LRU list with
+ * its own share of the cache:
+ * - small objects live in one arena block with their node and id
+ * - large objects are split over fixed size pages
+ *
+ * In front of it all every thread has a small L1 of its own,
+ * holding references to the objects it served last.
+ *
+ * The arena chunks and pages can come from a region of huge pages
+ * reserved at startup, so the objects take few TLB entries. The
+ * region can be bound to a NUMA node, each node then has its own
+ * list (shard) with its memory on that node.
+ *
  */ 
  
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "radix.h"
+#include <stdint.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Tiers */
+#define CACHE_SMALL 0
+#define CACHE_LARGE 1
+#define CACHE_TIERS 2
+#define CACHE_SMALL_SHARE (MAX_CACHE_SIZE / 4)  /* Rest is for large */
+
+/* Small tier: node, id and data in one block of a size class,
+   the smallest class is CACHE_CLASS_MIN, each class doubles */
+#define CACHE_CLASS_MIN 128u
+#define CACHE_CLASSES 6                  /* Up to 4096 byte blocks */
+#define CACHE_SMALL_MAX (CACHE_CLASS_MIN << (CACHE_CLASSES - 1))
+#define CACHE_ARENA_CHUNK 65536          /* Blocks are carved from these */
+
+/* Large tier: data in pages of CACHE_PAGE_SIZE */
+#define CACHE_PAGE_SIZE 16384
+
+/* With -M (or -n), arena chunks and pages come from one region 
+   reserved up front, malloc takes over if it runs out */
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define CACHE_RESERVE_SIZE (MAX_CACHE_SIZE + MAX_CACHE_SIZE / 2)
+
+/* Nodes a purge takes out per hold of the write lock */
+#define PURGE_BATCH 16
+
+/* Thread local L1, direct mapped on a hash of the id */
+#define L1_SLOTS 16                      /* Power of 2 */
+#define L1_MAX_OBJECT CACHE_PAGE_SIZE    /* Larger ones are not kept */
+
+/* Where a list's small blocks and pages come from. Free blocks of
+   each small class and free pages, the first bytes of each hold 
+   the next one */
+typedef struct cache_pool
+{
+  void *free_blocks[CACHE_CLASSES];
+  char *arena_next, *arena_end;
+  void *free_pages;
+  /* Region reserved by cache_reserve, carved from the front */
+  char *region, *region_next, *region_end;
+  const char *region_kind;   /* "hugetlb", "thp" or "4KB" */
+  int numa_node;             /* Region bound to it, -1 if not */
+  sem_t mutex;
+} cache_pool;
+
 /* Make the node and list as structs */
 typedef struct cache_node
 {
-  void *data;
+  void *data;        /* Whole data, NULL for the large tier */
+  char **pages;      /* Large tier, the data in pages */
   unsigned int data_len;
   char *id;
+  unsigned int size; /* Memory charged to the tier */
+  int tier;
+  long stored;       /* When it was cached, in ms */
+  int refreshing;    /* Set while a background refresh is running */
+  int mapped;        /* id and data point into a snapshot, not malloc'd */
+  char *tags;        /* Surrogate-Key of the response, NULL if none */
+  int refs;          /* The list's and every L1's, freed at 0 */
+  int removed;       /* Set once it leaves the cache for good */
+  int referenced;    /* Served from an L1 since it last reached the front */
+  cache_pool *pool;  /* Its block or pages go back here */
   struct cache_node *next;
+  char block[];      /* Small tier: id then data, large: pages then id */
 } cache_node;
 
-typedef struct cache_list
+/* An L1 slot, the node is held with a reference */
+typedef struct l1_entry
+{
+  cache_node *node;
+  unsigned int hash;
+  unsigned long generation;  /* The list's when node was last seen live */
+} l1_entry;
+
+/* One LRU list, front is least used */
+typedef struct cache_tier
 {
-  unsigned int read_counter; /* Helps check for exclusion */
-  unsigned available_len;
   cache_node *front;
   cache_node *back;
+  unsigned available_len;
+  unsigned capacity;
+  unsigned int count;
+  unsigned long evictions;
+} cache_tier;
+
+typedef struct cache_list
+{
+  unsigned int read_counter; /* Helps check for exclusion */
+  unsigned int fresh_ttl;    /* ms before a node goes stale, 0 is never */
+  cache_tier tiers[CACHE_TIERS];
+  radix_node *index;         /* Every node by id */
+  unsigned long generation;  /* Moves on every time a node is removed */
+  cache_pool pool;
   /* Semaphores, to make sure the cache access doesn't disrupt proxy*/
   sem_t w, r;   /* r is a mutex */  
 } cache_list;
 
 
+/*
+ * Snapshot file: a header, then one entry per node from least to
+ * most recently used, small tier first. Each entry is followed by the id (with its
+ * '\0') and the data, padded so the next entry is 8 byte aligned.
+ */
+#define SNAPSHOT_MAGIC "PXCACHE1"
+#define SNAPSHOT_BUF (1 << 18)   /* Bytes gathered per write */
+
+typedef struct snapshot_header
+{
+  char magic[8];
+  int64_t saved_ms;       /* Wall clock at the dump */
+  uint64_t count;
+} snapshot_header;
+
+typedef struct snapshot_entry
+{
+  uint32_t id_len;        /* With the '\0' */
+  uint32_t data_len;
+  int64_t age_ms;         /* How long it had been cached */
+} snapshot_entry;
+
+
 /* Function prototypes */
 
 /* Dealing with cache_list */
 cache_list *init_cache_list();
-cache_node *init_cache_node(char *id, int len);
+cache_node *init_cache_node(cache_list *list, char *id, int len);
 cache_node *search_cache_list(cache_list *list, char *id);
 void terminate_cache_node(cache_node *node);
+void cache_node_put(cache_node *node);
 
 /* Dealing with individual nodes */
 void add_cache_node(cache_list *list, cache_node *node);
-cache_node *delete_cache_node(cache_list *list);
+cache_node *delete_cache_node(cache_tier *tier);
+void cache_node_copy(cache_node *node, void *data);
+void cache_node_fill(cache_node *node, void *data, unsigned int len);
 
 /* Dealing with available size in cache */
 void add_cache_node_wrapper(cache_list *list, cache_node *node);
@@ -52,9 +172,25 @@ void add_cache_node_wrapper(cache_list *list, cache_node *node);
 /* Dealing with adding and removing nodes based on id */
 cache_node *remove_cache_node(cache_list *list, char *id);
 int proxy_read_from_cache(cache_list *list, char *id, void *data,
-                          unsigned int *len);
+                          unsigned int *len, unsigned int max_stale,
+                          int *refresh);
 int proxy_write_to_cache(cache_list *list, char *id,
                               void *data, unsigned int len);
+int proxy_check_cache(cache_list *list, char *id);
+void proxy_refresh_done(cache_list *list, char *id);
+
+/* Taking nodes out before the LRU does */
+int proxy_purge(cache_list *list, char *id);
+int proxy_purge_prefix(cache_list *list, char *prefix);
+int proxy_purge_tag(cache_list *list, char *tag);
+
+/* Surviving restarts */
+int cache_save_snapshot(cache_list *list, char *filename);
+int cache_load_snapshot(cache_list *list, char *filename);
+void cache_report(cache_list *list, FILE *fp);
+int cache_reserve(cache_list *list, size_t size, int huge, int numa_node);
+
+#endif /* __CACHE_H__ */
  
  
 
@@ -0,0 +1,317 @@
+/*
+ * log.c: Access log for the proxy
+ *
+ * Logging a request must not make the worker wait on the disk, so
+ * 1) every worker has a ring of records of its own, filling a slot
+ *    takes no lock, only a release store of the tail
+ * 2) one logger thread walks the rings, copies what is there into
+ *    a LOG_BATCH buffer and write()s it when it is full, or when
+ *    the oldest record in it has waited LOG_FLUSH_MS
+ * 3) if a ring is full the record is dropped and counted, the
+ *    logger writes a LOG_DROPPED record so the loss shows up
+ * 4) SIGTERM and SIGINT write out what is left with log_flush_all
+ *
+ * Records are the fixed part of log_record plus the url, after a
+ * LOG_MAGIC line at the start of the file.
+ *
+ */
+
+#include "log.h"
+
+static int log_fd = -1;                   /* -1 while logging is off */
+static log_ring *rings[LOG_MAX_RINGS];
+static int nrings = 0;
+static sem_t ring_mutex;                  /* Protects adding a ring  */
+static __thread log_ring *my_ring = NULL;
+
+/* Logger's batch, shared with log_flush_all */
+static sem_t drain_mutex;                 /* Protects draining, batch */
+static char batch[LOG_BATCH];
+static unsigned int batch_len = 0;
+static long batch_oldest = 0;             /* When its first record went in */
+
+static void *logger(void *vargp);
+static int log_drain();
+static void log_flush(char *batch, unsigned int *len);
+
+
+
+/*
+ * init_log: open (append to) filename and start the logger,
+ * filename NULL leaves logging off
+ *
+ * Returns -1 on error, 0 on success
+ */
+int init_log(char *filename)
+{
+  pthread_t tid;
+
+  if (filename == NULL)
+  {
+    return 0;
+  }
+  if ((log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+  {
+    return -1;
+  }
+  /* A new file starts with the magic */
+  if (lseek(log_fd, 0, SEEK_END) == 0 &&
+      write(log_fd, LOG_MAGIC, LOG_MAGIC_LEN) != LOG_MAGIC_LEN)
+  {
+    close(log_fd);
+    log_fd = -1;
+    return -1;
+  }
+  Sem_init(&ring_mutex, 0, 1);
+  Sem_init(&drain_mutex, 0, 1);
+  Pthread_create(&tid, NULL, logger, NULL);
+  return 0;
+}
+
+
+
+/*
+ * log_register: give the calling thread a ring, done once by
+ * each worker before it logs anything
+ */
+void log_register()
+{
+  log_ring *ring;
+
+  if (log_fd < 0 || my_ring != NULL)
+  {
+    return;
+  }
+  ring = (log_ring *)Calloc(1, sizeof(log_ring));
+  P(&ring_mutex);
+  if (nrings < LOG_MAX_RINGS)
+  {
+    rings[nrings] = ring;
+    /* The logger sees the ring before the count that covers it */
+    __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    my_ring = ring;
+  }
+  V(&ring_mutex);
+  if (my_ring == NULL)
+  {
+    Free(ring);        /* Too many workers, this one goes unlogged */
+  }
+}
+
+
+
+/*
+ * log_now_us: monotonic clock in microseconds, for the start
+ * of a request
+ */
+long log_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+
+/*
+ * log_status: status code in the response starting at buf,
+ * 0 if it does not start with a status line
+ */
+int log_status(const char *buf, unsigned int len)
+{
+  if (len < 12 || strncmp(buf, "HTTP/", 5) != 0 || buf[8] != ' ' ||
+      !isdigit((unsigned char)buf[9]) || !isdigit((unsigned char)buf[10]) ||
+      !isdigit((unsigned char)buf[11]))
+  {
+    return 0;
+  }
+  return (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+}
+
+
+
+/*
+ * log_request: put a record for the request that started at
+ * start_us (log_now_us) in the worker's ring, never blocks
+ */
+void log_request(const char *url, int status, unsigned long bytes,
+                 int cache, long start_us)
+{
+  log_ring *ring = my_ring;
+  log_record *rec;
+  unsigned int tail;
+  struct timespec ts;
+  long latency;
+  size_t len;
+
+  if (ring == NULL)
+  {
+    return;
+  }
+  tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+  {
+    ring->dropped++;
+    return;
+  }
+
+  rec = &ring->recs[tail & (LOG_RING_SIZE - 1)];
+  latency = log_now_us() - start_us;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - latency;
+  rec->latency_us = (uint32_t)latency;
+  rec->bytes = (uint32_t)bytes;
+  rec->status = (uint16_t)status;
+  rec->cache = (uint8_t)cache;
+  rec->pad = 0;
+  len = strlen(url);
+  if (len > LOG_URL_LEN)
+  {
+    len = LOG_URL_LEN;
+  }
+  memcpy(rec->url, url, len);
+  rec->url_len = (uint16_t)len;
+
+  /* Publish the slot, the logger reads it after seeing the tail */
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ * logger: thread routine that drains the rings into batches
+ */
+static void *logger(void *vargp)
+{
+  struct timespec nap = { 0, LOG_SLEEP_MS * 1000000L };
+  int found;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    P(&drain_mutex);
+    found = log_drain();
+    if (batch_len > 0 && log_now_us() - batch_oldest >= LOG_FLUSH_MS * 1000L)
+    {
+      log_flush(batch, &batch_len);
+    }
+    V(&drain_mutex);
+    if (found == 0)
+    {
+      nanosleep(&nap, NULL);
+    }
+  }
+  return NULL;
+}
+
+
+
+/*
+ * log_flush_all: drain every ring and write out the batch, for
+ * the signal thread before it ends the proxy. Records a worker
+ * has not published yet are lost.
+ */
+void log_flush_all()
+{
+  if (log_fd < 0)
+  {
+    return;
+  }
+  P(&drain_mutex);
+  log_drain();
+  log_flush(batch, &batch_len);
+  V(&drain_mutex);
+}
+
+
+
+/*
+ * log_drain: copy what is in the rings into batch, writing it
+ * out when it fills. Caller holds drain_mutex.
+ *
+ * Returns the number of records taken from the rings
+ */
+static int log_drain()
+{
+  static unsigned long seen_dropped[LOG_MAX_RINGS];
+  log_record drop;
+  log_record *rec;
+  log_ring *ring;
+  unsigned int head, tail;
+  unsigned long dropped;
+  int i, n, found = 0;
+
+  memset(&drop, 0, sizeof(drop));
+  drop.cache = LOG_DROPPED;
+
+  n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++)
+  {
+    ring = rings[i];
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+      rec = &ring->recs[head & (LOG_RING_SIZE - 1)];
+      if (batch_len + LOG_FIXED + rec->url_len > LOG_BATCH)
+      {
+        log_flush(batch, &batch_len);
+      }
+      if (batch_len == 0)
+      {
+        batch_oldest = log_now_us();
+      }
+      memcpy(batch + batch_len, rec, LOG_FIXED + rec->url_len);
+      batch_len += LOG_FIXED + rec->url_len;
+      found++;
+      /* Hand the slot back to the worker */
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    /* Worker only ever adds to it, a stale read shows up next time */
+    dropped = ring->dropped;
+    if (dropped != seen_dropped[i])
+    {
+      if (batch_len + LOG_FIXED > LOG_BATCH)
+      {
+        log_flush(batch, &batch_len);
+      }
+      if (batch_len == 0)
+      {
+        batch_oldest = log_now_us();
+      }
+      drop.bytes = (uint32_t)(dropped - seen_dropped[i]);
+      memcpy(batch + batch_len, &drop, LOG_FIXED);
+      batch_len += LOG_FIXED;
+      seen_dropped[i] = dropped;
+    }
+  }
+  return found;
+}
+
+
+
+/*
+ * log_flush: write out the batch, a failed write loses it
+ * rather than holding up the rings
+ */
+static void log_flush(char *batch, unsigned int *len)
+{
+  unsigned int done = 0;
+  ssize_t n;
+
+  while (done < *len)
+  {
+    if ((n = write(log_fd, batch + done, *len - done)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "log: write failed: %s\n", strerror(errno));
+      break;
+    }
+    done += n;
+  }
+  *len = 0;
+}
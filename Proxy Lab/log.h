@@ -0,0 +1,75 @@
+/*
+ * log.h: header file for log.c
+ *
+ * Access log for the proxy. Workers put a record per request in
+ * their own ring, a logger thread drains the rings and writes the
+ * records to the file in big batches. Records are binary, read
+ * them with logdecode.
+ *
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOG_RING_SIZE 256      /* Records per worker, power of 2      */
+#define LOG_MAX_RINGS 256      /* Most workers that can log           */
+#define LOG_URL_LEN 256        /* Longer urls are cut                 */
+#define LOG_BATCH 65536        /* Bytes the logger gathers per write  */
+#define LOG_FLUSH_MS 200       /* Longest a record waits to be written */
+#define LOG_SLEEP_MS 10        /* Logger's nap when the rings are empty */
+
+/* Start of the file, then records back to back */
+#define LOG_MAGIC "PXLOG1\n"
+#define LOG_MAGIC_LEN 7
+
+/* What the cache did for the request */
+#define LOG_MISS    0
+#define LOG_HIT     1
+#define LOG_STALE   2          /* Stale copy served                   */
+#define LOG_ERROR   3          /* Nothing (or not all) was served     */
+#define LOG_DROPPED 4          /* Not a request: bytes records were lost */
+#define LOG_PURGE   5          /* PURGE, answered by the proxy         */
+#define LOG_PEER    6          /* Fetched from the peer that owns it   */
+
+/*
+ * One request. Only the first LOG_FIXED bytes and url_len bytes
+ * of url go in the file, in the byte order of the machine.
+ */
+typedef struct log_record
+{
+  uint64_t time_us;      /* Wall clock when the request came in */
+  uint32_t latency_us;
+  uint32_t bytes;        /* Sent to the client */
+  uint16_t status;       /* From the response, 0 if there was none */
+  uint16_t url_len;
+  uint8_t cache;         /* LOG_MISS, LOG_HIT.. */
+  uint8_t pad;
+  char url[LOG_URL_LEN];
+} log_record;
+
+#define LOG_FIXED offsetof(log_record, url)
+
+/* Single producer (the worker), single consumer (the logger) */
+typedef struct log_ring
+{
+  log_record recs[LOG_RING_SIZE];
+  unsigned int head;       /* Next to write out, moved by the logger */
+  unsigned int tail;       /* Next free slot, moved by the worker    */
+  unsigned long dropped;   /* Records lost to a full ring            */
+} log_ring;
+
+
+/* Function prototypes */
+int init_log(char *filename);
+void log_register();
+long log_now_us();
+int log_status(const char *buf, unsigned int len);
+void log_request(const char *url, int status, unsigned long bytes,
+                 int cache, long start_us);
+void log_flush_all();
+
+#endif /* __LOG_H__ */
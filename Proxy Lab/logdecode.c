@@ -0,0 +1,106 @@
+/*
+ * logdecode.c: Prints the proxy's binary access log as text
+ *
+ * One line per request: time, cache result, status, bytes sent,
+ * latency and url. Records lost to a full ring show up as a
+ * "dropped" line. -s prints only a summary at the end.
+ *
+ * Has to run on a machine with the byte order of the proxy's.
+ *
+ * usage: logdecode [-s] [log_file]     (stdin if no file)
+ *
+ */
+
+#include "log.h"
+
+static const char *cache_str[] = { "MISS", "HIT", "STALE", "ERROR", 
+                                    "DROP", "PURGE", "PEER" };
+
+
+
+int main(int argc, char **argv)
+{
+  FILE *fp = stdin;
+  char magic[LOG_MAGIC_LEN];
+  char when[64];
+  log_record rec;
+  time_t secs;
+  struct tm tm;
+  int opt, summary = 0;
+  unsigned long count[LOG_PEER + 1] = { 0 };
+  unsigned long bytes = 0, requests = 0;
+  double latency = 0;
+
+  while ((opt = getopt(argc, argv, "s")) != -1)
+  {
+    switch (opt)
+    {
+      case 's': summary = 1; break;
+      default: optind = argc + 1; break;
+    }
+  }
+  if (argc - optind > 1)
+  {
+    fprintf(stderr, "usage: %s [-s] [log_file]\n", argv[0]);
+    exit(1);
+  }
+  if (optind < argc && (fp = fopen(argv[optind], "rb")) == NULL)
+  {
+    fprintf(stderr, "Cannot open %s\n", argv[optind]);
+    exit(1);
+  }
+  if (fread(magic, 1, LOG_MAGIC_LEN, fp) != LOG_MAGIC_LEN ||
+      memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0)
+  {
+    fprintf(stderr, "Not a proxy log\n");
+    exit(1);
+  }
+
+  while (fread(&rec, 1, LOG_FIXED, fp) == LOG_FIXED)
+  {
+    if (rec.cache > LOG_PEER || rec.url_len > LOG_URL_LEN ||
+        fread(rec.url, 1, rec.url_len, fp) != rec.url_len)
+    {
+      fprintf(stderr, "Truncated or corrupt record\n");
+      exit(1);
+    }
+    if (rec.cache == LOG_DROPPED)
+    {
+      count[LOG_DROPPED] += rec.bytes;
+      if (!summary)
+      {
+        printf("# dropped %u records\n", rec.bytes);
+      }
+      continue;
+    }
+    count[rec.cache]++;
+    requests++;
+    bytes += rec.bytes;
+    latency += rec.latency_us;
+    if (summary)
+    {
+      continue;
+    }
+
+    secs = rec.time_us / 1000000;
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06u %-5s %3u %10u %10.3f ms %.*s\n", when,
+           (unsigned int)(rec.time_us % 1000000), cache_str[rec.cache],
+           rec.status, rec.bytes, rec.latency_us / 1000.0,
+           (int)rec.url_len, rec.url);
+  }
+
+  if (summary)
+  {
+    printf("requests: %lu (%lu hit, %lu stale, %lu miss, %lu error, "
+           "%lu purge, %lu peer)\n", requests, count[LOG_HIT], 
+           count[LOG_STALE], count[LOG_MISS], count[LOG_ERROR], 
+           count[LOG_PURGE], count[LOG_PEER]);
+    printf("bytes:    %lu\n", bytes);
+    printf("latency:  %.3f ms average\n",
+           requests ? latency / requests / 1000.0 : 0.0);
+    printf("dropped:  %lu\n", count[LOG_DROPPED]);
+  }
+  return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * numa.c: NUMA topology, thread pinning and memory binding
+ *
+ * The nodes come from /sys/devices/system/node, each one's CPUs
+ * from its cpulist ("0-7,16-23"). A machine without that directory
+ * (or a kernel without NUMA) is one node with every CPU the proxy
+ * may run on.
+ *
+ * Memory is bound with the mbind system call, preferring the node
+ * rather than insisting on it, so a full node falls back to another
+ * instead of failing the allocation.
+ *
+ */
+
+#define _GNU_SOURCE     /* cpu_set_t and pthread_setaffinity_np */
+#include "numa.h"
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+typedef struct numa_node
+{
+  int id;              /* Node number in sysfs, -1 if unknown */
+  cpu_set_t cpus;
+  int ncpus;
+} numa_node;
+
+static numa_node nodes[NUMA_MAX_NODES];
+
+static int parse_cpulist(char *list, cpu_set_t *cpus);
+
+
+
+/*
+ * numa_init: find the machine's nodes that have CPUs (up to
+ * NUMA_MAX_NODES), and return how many there are (at least 1)
+ */
+int numa_init()
+{
+  char path[MAXLINE], list[MAXBUF];
+  FILE *fp;
+  int id, n = 0;
+
+  for (id = 0; n < NUMA_MAX_NODES && id < 1024; id++)
+  {
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", id);
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+      if (id > 0 && access("/sys/devices/system/node", F_OK) == 0)
+      {
+        continue;   /* Node numbers can have holes */
+      }
+      break;
+    }
+    if (fgets(list, sizeof(list), fp) != NULL &&
+        (nodes[n].ncpus = parse_cpulist(list, &nodes[n].cpus)) > 0)
+    {
+      nodes[n].id = id;
+      n++;              /* Memory only nodes have no CPUs, skipped */
+    }
+    fclose(fp);
+  }
+
+  if (n == 0)
+  {
+    nodes[0].id = -1;   /* Nothing to bind to */
+    sched_getaffinity(0, sizeof(cpu_set_t), &nodes[0].cpus);
+    nodes[0].ncpus = CPU_COUNT(&nodes[0].cpus);
+    n = 1;
+  }
+  return n;
+}
+
+
+
+/*
+ * numa_node_id: sysfs number of node i, -1 if there is no NUMA
+ */
+int numa_node_id(int i)
+{
+  return nodes[i].id;
+}
+
+
+
+/*
+ * numa_node_cpus: how many CPUs node i has
+ */
+int numa_node_cpus(int i)
+{
+  return nodes[i].ncpus;
+}
+
+
+
+/*
+ * numa_pin_thread: let the calling thread run only on node i's
+ * CPUs, returns -1 on error
+ */
+int numa_pin_thread(int i)
+{
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                &nodes[i].cpus) == 0 ? 0 : -1;
+}
+
+
+
+/*
+ * numa_bind_memory: have the pages of [addr, addr + len) come from
+ * node i when they are first touched. addr has to be page aligned.
+ * Returns -1 on error (no NUMA in the kernel..)
+ */
+int numa_bind_memory(void *addr, size_t len, int i)
+{
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+  int node = nodes[i].id;
+
+  if (node < 0 || node >= (int)(8 * sizeof(mask)))
+  {
+    return -1;
+  }
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8 * sizeof(unsigned long))] |=
+    1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+                 8 * sizeof(mask), 0) == 0 ? 0 : -1;
+}
+
+
+
+/*
+ * parse_cpulist: "0-3,8,10-11" into cpus, returns the CPUs in it
+ */
+static int parse_cpulist(char *list, cpu_set_t *cpus)
+{
+  char *p = list, *end;
+  long lo, hi;
+
+  CPU_ZERO(cpus);
+  while (*p != '\0' && *p != '\n')
+  {
+    lo = strtol(p, &end, 10);
+    if (end == p)
+    {
+      break;
+    }
+    hi = lo;
+    if (*end == '-')
+    {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+    }
+    for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+    {
+      CPU_SET(lo, cpus);
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return CPU_COUNT(cpus);
+}
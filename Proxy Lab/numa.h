@@ -0,0 +1,26 @@
+/*
+ * numa.h: header file for numa.c
+ *
+ * The NUMA nodes of the machine and their CPUs, read from sysfs,
+ * so threads can be pinned to a node and memory bound to it
+ * without libnuma. Nodes are numbered 0..numa_init()-1 here,
+ * whatever their numbers in sysfs.
+ *
+ */
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include "csapp.h"
+
+#define NUMA_MAX_NODES 16
+
+
+/* Function prototypes */
+int numa_init();
+int numa_node_id(int i);
+int numa_node_cpus(int i);
+int numa_pin_thread(int i);
+int numa_bind_memory(void *addr, size_t len, int i);
+
+#endif /* __NUMA_H__ */
@@ -0,0 +1,423 @@
+/*
+ * origin.c: Per-origin connection limits for the proxy
+ *
+ * Before a cache miss connects to an origin it takes one of the
+ * origin's connections with origin_acquire, and gives it back with
+ * origin_release once the response is relayed. So
+ * 1) an origin never has more than its limit of connections from
+ *    the proxy, the rest of the requests for it wait in its FIFO,
+ *    and once ORIGIN_QUEUE_FACTOR * limit are waiting new ones are
+ *    turned away. A slow origin can only ever tie up that many of
+ *    the worker threads.
+ * 2) all origins together have at most total_limit connections.
+ *    When that is what holds requests up, the next one to go is
+ *    picked by start time fair queuing: each origin has a tag that
+ *    grows by 1/weight per connection, lowest tag goes first, so
+ *    busy origins share in proportion to their weights.
+ *
+ * Weights file, one origin per line, '#' starts a comment:
+ *   host:port weight [limit]
+ *
+ * Origins that are not in the weights file are freed once they have
+ * no connections and no waiters, so clients naming ever new hosts
+ * cannot grow the table. Their metrics go with them.
+ *
+ */
+
+#include "origin.h"
+#include "timer.h"
+
+static unsigned int origin_hash(char *name);
+static origin *origin_lookup(origin_table *table, char *name);
+static void origin_idle(origin_table *table, origin *o);
+static int origin_can_run(origin_table *table, origin *o);
+static void origin_grant(origin_table *table, origin *o);
+static void origin_dispatch(origin_table *table);
+
+
+
+/*
+ * init_origin_table: empty table, and return the pointer to it
+ */
+origin_table *init_origin_table(int default_limit, int total_limit)
+{
+  origin_table *table = (origin_table *)Calloc(1, sizeof(origin_table));
+
+  table->default_limit = default_limit;
+  table->total_limit = total_limit;
+  Sem_init(&table->mutex, 0, 1);
+  return table;
+}
+
+
+
+/*
+ * origin_load_weights: read weights (and limits) for origins
+ *
+ * Returns -1 on error (the line is reported), 0 on success
+ */
+int origin_load_weights(origin_table *table, char *filename)
+{
+  FILE *fp;
+  char line[MAXLINE], name[MAXLINE];
+  char *p;
+  int lineno = 0, weight, limit, n;
+  origin *o;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+  {
+    fprintf(stderr, "origin: cannot open %s\n", filename);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    lineno++;
+    if ((p = index(line, '#')) != NULL)
+    {
+      *p = '\0';
+    }
+    limit = table->default_limit;
+    if ((n = sscanf(line, "%s %d %d", name, &weight, &limit)) <= 0)
+    {
+      continue;      /* Blank line */
+    }
+    if (n < 2 || weight <= 0 || limit <= 0 || index(name, ':') == NULL)
+    {
+      fprintf(stderr, "origin: %s:%d: bad line\n", filename, lineno);
+      fclose(fp);
+      return -1;
+    }
+    P(&table->mutex);
+    o = origin_lookup(table, name);
+    o->weight = weight;
+    o->limit = limit;
+    o->configured = 1;
+    V(&table->mutex);
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+
+/*
+ * origin_acquire: take a connection to host:port, waiting up to
+ * wait_ms for one (0 is don't wait)
+ *
+ * Returns the origin, to hand to origin_release, or NULL if the
+ * queue was full or the wait timed out
+ */
+origin *origin_acquire(origin_table *table, char *host, char *port,
+                       unsigned int wait_ms)
+{
+  char name[MAXLINE];
+  origin_waiter w, *cur, *prev = NULL;
+  struct timespec deadline;
+  long start, waited;
+  origin *o;
+
+  snprintf(name, sizeof(name), "%s:%s", host, port);
+  P(&table->mutex);
+  o = origin_lookup(table, name);
+  o->requests++;
+
+  /* Nobody ahead of us and room to go */
+  if (o->head == NULL && origin_can_run(table, o))
+  {
+    origin_grant(table, o);
+    V(&table->mutex);
+    return o;
+  }
+  if (wait_ms == 0 || o->queued >= o->limit * ORIGIN_QUEUE_FACTOR)
+  {
+    o->rejected++;
+    origin_idle(table, o);
+    V(&table->mutex);
+    return NULL;
+  }
+
+  /* Join the back of the queue */
+  Sem_init(&w.ready, 0, 0);
+  w.granted = 0;
+  w.next = NULL;
+  if (o->tail == NULL)
+  {
+    o->head = &w;
+  }
+  else
+  {
+    o->tail->next = &w;
+  }
+  o->tail = &w;
+  o->waited++;
+  if (++o->queued > o->queued_max)
+  {
+    o->queued_max = o->queued;
+  }
+  if (!o->backlogged)
+  {
+    o->backlogged = 1;
+    o->next_backlog = table->backlog;
+    table->backlog = o;
+  }
+  V(&table->mutex);
+
+  start = timer_now_ms();
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += wait_ms / 1000;
+  deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (sem_timedwait(&w.ready, &deadline) < 0 && errno == EINTR)
+  {
+    ;
+  }
+
+  P(&table->mutex);
+  waited = timer_now_ms() - start;
+  o->wait_ms_total += waited;
+  if (waited > o->wait_ms_max)
+  {
+    o->wait_ms_max = waited;
+  }
+  /* Granted, even if only just as the wait ran out */
+  if (w.granted)
+  {
+    V(&table->mutex);
+    return o;
+  }
+  /* Timed out, leave the queue */
+  for (cur = o->head; cur != &w; cur = cur->next)
+  {
+    prev = cur;
+  }
+  if (prev == NULL)
+  {
+    o->head = w.next;
+  }
+  else
+  {
+    prev->next = w.next;
+  }
+  if (o->tail == &w)
+  {
+    o->tail = prev;
+  }
+  o->queued--;
+  o->timeouts++;
+  origin_idle(table, o);
+  V(&table->mutex);
+  return NULL;
+}
+
+
+
+/*
+ * origin_release: give back the connection taken by origin_acquire,
+ * it goes to the next waiter. o may be freed.
+ */
+void origin_release(origin_table *table, origin *o)
+{
+  P(&table->mutex);
+  o->in_flight--;
+  table->in_flight--;
+  origin_dispatch(table);
+  origin_idle(table, o);
+  V(&table->mutex);
+}
+
+
+
+/*
+ * origin_report: print the metrics of the origins in the weights
+ * file and of those in use
+ */
+void origin_report(origin_table *table, FILE *fp)
+{
+  origin *o;
+  int i;
+
+  P(&table->mutex);
+  fprintf(fp, "%-32s %9s %9s %9s %9s %9s %9s %9s %9s\n", "origin",
+          "in_flight", "queued", "max_queue", "requests", "waited",
+          "avg_wait", "max_wait", "rejected");
+  for (i = 0; i < ORIGIN_BUCKETS; i++)
+  {
+    for (o = table->buckets[i]; o != NULL; o = o->next)
+    {
+      fprintf(fp, "%-32s %5d/%-3d %9d %9d %9lu %9lu %7ldms %7ldms %9lu\n",
+              o->name, o->in_flight, o->limit, o->queued, o->queued_max,
+              o->requests, o->waited,
+              o->waited ? o->wait_ms_total / (long)o->waited : 0L,
+              o->wait_ms_max, o->rejected + o->timeouts);
+    }
+  }
+  fprintf(fp, "total in flight %d/%d\n", table->in_flight,
+          table->total_limit);
+  fflush(fp);
+  V(&table->mutex);
+}
+
+
+
+/*
+ * origin_lookup: find name in the table, add it if it is not
+ * there yet. Called with the mutex held.
+ */
+static origin *origin_lookup(origin_table *table, char *name)
+{
+  unsigned int h = origin_hash(name);
+  origin *o;
+
+  for (o = table->buckets[h]; o != NULL; o = o->next)
+  {
+    if (strcasecmp(o->name, name) == 0)
+    {
+      return o;
+    }
+  }
+
+  o = (origin *)Calloc(1, sizeof(origin));
+  o->name = (char *)Malloc(strlen(name) + 1);
+  strcpy(o->name, name);
+  o->limit = table->default_limit;
+  o->weight = 1;
+  o->vtime = table->vclock;
+  o->next = table->buckets[h];
+  table->buckets[h] = o;
+  return o;
+}
+
+
+
+/*
+ * origin_idle: free o if it is not from the weights file and nothing
+ * uses it any more: no connection, no waiter, not on the backlog
+ * (where it stays until origin_dispatch sees its queue is empty).
+ * Called with the mutex held.
+ */
+static void origin_idle(origin_table *table, origin *o)
+{
+  origin **pp;
+
+  if (o->configured || o->in_flight > 0 || o->head != NULL)
+  {
+    return;
+  }
+  if (o->backlogged)
+  {
+    for (pp = &table->backlog; *pp != o; pp = &(*pp)->next_backlog)
+    {
+      ;
+    }
+    *pp = o->next_backlog;
+  }
+  for (pp = &table->buckets[origin_hash(o->name)]; *pp != o;
+       pp = &(*pp)->next)
+  {
+    ;
+  }
+  *pp = o->next;
+  Free(o->name);
+  Free(o);
+}
+
+
+
+/*
+ * origin_hash: FNV-1a of name, ignoring case, to a bucket
+ */
+static unsigned int origin_hash(char *name)
+{
+  unsigned int h = 2166136261u;
+  char *p;
+
+  for (p = name; *p != '\0'; p++)
+  {
+    h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 16777619u;
+  }
+  return h & (ORIGIN_BUCKETS - 1);
+}
+
+
+
+/*
+ * origin_can_run: room for one more connection to o
+ */
+static int origin_can_run(origin_table *table, origin *o)
+{
+  return o->in_flight < o->limit && table->in_flight < table->total_limit;
+}
+
+
+
+/*
+ * origin_grant: count a connection to o, and move its tag on.
+ * An origin that was idle starts from the current clock, it does
+ * not get to catch up on the time it had nothing to send.
+ */
+static void origin_grant(origin_table *table, origin *o)
+{
+  o->in_flight++;
+  table->in_flight++;
+  if (o->vtime < table->vclock)
+  {
+    o->vtime = table->vclock;
+  }
+  o->vtime += 1.0 / o->weight;
+}
+
+
+
+/*
+ * origin_dispatch: hand free connections to waiters, lowest tag
+ * first. Called with the mutex held.
+ */
+static void origin_dispatch(origin_table *table)
+{
+  origin *o, *best, **pp;
+  origin_waiter *w;
+
+  while (table->in_flight < table->total_limit)
+  {
+    /* Drop origins with no one left waiting, find the lowest tag */
+    best = NULL;
+    pp = &table->backlog;
+    while ((o = *pp) != NULL)
+    {
+      if (o->head == NULL)
+      {
+        o->backlogged = 0;
+        *pp = o->next_backlog;
+        continue;
+      }
+      if (o->in_flight < o->limit && (best == NULL || o->vtime < best->vtime))
+      {
+        best = o;
+      }
+      pp = &o->next_backlog;
+    }
+    if (best == NULL)
+    {
+      return;
+    }
+
+    w = best->head;
+    best->head = w->next;
+    if (best->head == NULL)
+    {
+      best->tail = NULL;
+    }
+    best->queued--;
+    if (best->vtime > table->vclock)
+    {
+      table->vclock = best->vtime;
+    }
+    origin_grant(table, best);
+    w->granted = 1;
+    V(&w->ready);
+  }
+}
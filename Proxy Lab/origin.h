@@ -0,0 +1,70 @@
+/*
+ * origin.h: header file for origin.c
+ *
+ * Limits on the connections the proxy has open to each origin
+ * server ("host:port"), with a queue of waiting requests per
+ * origin and weighted fair sharing of the total between origins.
+ *
+ */
+
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+#define ORIGIN_BUCKETS 256       /* Hash buckets, power of 2           */
+#define ORIGIN_QUEUE_FACTOR 2    /* Waiters allowed per connection     */
+#define ORIGIN_WAIT_MS 10000     /* Longest a request waits its turn   */
+
+/* A request waiting for a connection, on its thread's stack */
+typedef struct origin_waiter
+{
+  sem_t ready;               /* Posted once granted */
+  int granted;
+  struct origin_waiter *next;
+} origin_waiter;
+
+typedef struct origin
+{
+  char *name;                /* "host:port" */
+  int limit;                 /* Connections at once */
+  int weight;                /* Share of the total when it is short */
+  int configured;            /* From the weights file, kept when idle */
+  int in_flight;
+  double vtime;              /* Fair queuing tag, grows by 1/weight */
+  /* FIFO of waiters, the origin is on the backlog while it has any */
+  origin_waiter *head, *tail;
+  int queued;
+  int backlogged;
+  struct origin *next_backlog;
+  struct origin *next;       /* Hash chain */
+  /* Metrics */
+  unsigned long requests;    /* Connections asked for */
+  unsigned long waited;      /* ..that had to queue */
+  unsigned long rejected;    /* ..turned away, queue full */
+  unsigned long timeouts;    /* ..given up after ORIGIN_WAIT_MS */
+  long wait_ms_total, wait_ms_max;
+  int queued_max;
+} origin;
+
+typedef struct origin_table
+{
+  origin *buckets[ORIGIN_BUCKETS];
+  origin *backlog;           /* Origins with waiters */
+  int default_limit;         /* For origins not in the weights file */
+  int total_limit;           /* Connections to all origins at once */
+  int in_flight;
+  double vclock;             /* Tag of the last grant from the queues */
+  sem_t mutex;
+} origin_table;
+
+
+/* Function prototypes */
+origin_table *init_origin_table(int default_limit, int total_limit);
+int origin_load_weights(origin_table *table, char *filename);
+origin *origin_acquire(origin_table *table, char *host, char *port,
+                       unsigned int wait_ms);
+void origin_release(origin_table *table, origin *o);
+void origin_report(origin_table *table, FILE *fp);
+
+#endif /* __ORIGIN_H__ */
@@ -0,0 +1,586 @@
+/*
+ * peer.c: Cache peering between proxies
+ *
+ * Every proxy in the cluster reads the same peers file, so they
+ * all build the same ring: each proxy gets PEER_VNODES points on
+ * it, hashed from its name, and an id belongs to the proxy with
+ * the first point at or after the id's hash. Adding or removing a
+ * proxy only moves the ids next to its points.
+ *
+ * A miss on an id owned by another proxy is asked of it with the
+ * request the origin would get, marked with PEER_MARK. The owner
+ * answers from its cache, or fetches it into its cache first, so
+ * each object is cached once in the whole cluster. Answers are
+ * framed with their length, so the connection can stay open for
+ * the next one; up to PEER_IDLE are kept per peer.
+ *
+ * A worker has to be left for the peers' requests, so
+ * 1) at most fetch_limit workers wait on peers at once, the
+ *    other misses go to the origin
+ * 2) the owner fetches at most serve_limit of the peers' misses at
+ *    once and never queues them for the origin, the rest are
+ *    declined (PEER_DECLINE) long before the asker gives up
+ * 3) a peer's connection is parked in an epoll set between its
+ *    requests, not kept by a worker; the parker thread hands it
+ *    back to the workers when the next request comes in, and
+ *    closes it after park_ms without one
+ *
+ * A peer that cannot be reached is left out for PEER_RETRY_MS, its
+ * ids go straight to the origin in the meantime.
+ *
+ * Peers file, one proxy per line, '#' starts a comment:
+ *   host:port
+ *
+ */
+
+#include "peer.h"
+#include "timer.h"
+#include <sys/epoll.h>
+
+static unsigned int peer_hash(const char *s);
+static int compare_points(const void *a, const void *b);
+static int peer_ask(peer *p, struct iovec *iov, int iovcnt,
+                    char *data, unsigned int max);
+static void *peer_parker(void *vargp);
+static int peer_connect(peer *p);
+static void peer_put(peer *p, int fd);
+static int peer_writev(int fd, struct iovec *iov, int iovcnt);
+static int peer_read(int fd, char *buf, size_t n);
+
+
+
+/*
+ * init_peer_table: read the peers file and build the ring.
+ * self_name is this proxy's "host:port", it has to be in the file.
+ * nthreads sets how many workers peers may take, a peer's
+ * connection is closed after idle_ms without a request.
+ *
+ * Returns NULL on error (reported)
+ */
+peer_table *init_peer_table(char *filename, char *self_name,
+                            int nthreads, unsigned int idle_ms)
+{
+  pthread_t tid;
+  peer_table *table;
+  FILE *fp;
+  char line[MAXLINE], name[MAXLINE], point[MAXLINE + 16];
+  char *p;
+  int lineno = 0, i, v;
+  peer *pe;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+  {
+    fprintf(stderr, "peer: cannot open %s\n", filename);
+    return NULL;
+  }
+  table = (peer_table *)Calloc(1, sizeof(peer_table));
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    lineno++;
+    if ((p = index(line, '#')) != NULL)
+    {
+      *p = '\0';
+    }
+    if (sscanf(line, "%s", name) != 1)
+    {
+      continue;      /* Blank line */
+    }
+    if ((p = index(name, ':')) == NULL || table->npeers == PEER_MAX)
+    {
+      fprintf(stderr, "peer: %s:%d: bad line\n", filename, lineno);
+      fclose(fp);
+      return NULL;
+    }
+    pe = &table->peers[table->npeers++];
+    pe->name = (char *)Malloc(strlen(name) + 1);
+    strcpy(pe->name, name);
+    *p = '\0';
+    pe->host = (char *)Malloc(strlen(name) + 1);
+    strcpy(pe->host, name);
+    pe->port = (char *)Malloc(strlen(p + 1) + 1);
+    strcpy(pe->port, p + 1);
+    Sem_init(&pe->mutex, 0, 1);
+    if (strcmp(pe->name, self_name) == 0)
+    {
+      table->self = pe;
+    }
+  }
+  fclose(fp);
+  if (table->self == NULL)
+  {
+    fprintf(stderr, "peer: %s is not in %s\n", self_name, filename);
+    return NULL;
+  }
+
+  /* PEER_VNODES points per proxy evens out their shares */
+  table->points = (peer_point *)Malloc(table->npeers * PEER_VNODES *
+                                       sizeof(peer_point));
+  for (i = 0; i < table->npeers; i++)
+  {
+    for (v = 0; v < PEER_VNODES; v++)
+    {
+      snprintf(point, sizeof(point), "%s#%d", table->peers[i].name, v);
+      table->points[table->npoints].hash = peer_hash(point);
+      table->points[table->npoints].peer = &table->peers[i];
+      table->npoints++;
+    }
+  }
+  qsort(table->points, table->npoints, sizeof(peer_point), compare_points);
+
+  /* Half the workers may wait on peers, a quarter fetch for them */
+  table->fetch_limit = nthreads > 2 ? nthreads / 2 : 1;
+  table->serve_limit = nthreads > 4 ? nthreads / 4 : 1;
+  table->park_ms = idle_ms;
+  for (i = 0; i < PEER_PARK_MAX; i++)
+  {
+    table->parked[i].fd = -1;
+  }
+  Sem_init(&table->mutex, 0, 1);
+  if ((table->epfd = epoll_create1(0)) < 0)
+  {
+    fprintf(stderr, "peer: epoll_create1: %s\n", strerror(errno));
+    return NULL;
+  }
+  Pthread_create(&tid, NULL, peer_parker, table);
+  return table;
+}
+
+
+
+/*
+ * peer_owner: the peer to ask for id, NULL if this proxy owns it
+ * or its owner is down
+ */
+peer *peer_owner(peer_table *table, char *id)
+{
+  unsigned int h = peer_hash(id);
+  int lo = 0, hi = table->npoints, mid;
+  peer *p;
+
+  /* First point at or after h, past the last one is the first */
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (table->points[mid].hash < h)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  p = table->points[lo == table->npoints ? 0 : lo].peer;
+  if (p == table->self || p->down_until > timer_now_ms())
+  {
+    return NULL;
+  }
+  return p;
+}
+
+
+
+/*
+ * peer_fetch: send the request in iov (at most PEER_IOV of them)
+ * to p and read its answer into data, which holds max bytes
+ *
+ * Returns the length of the response, -1 if the peer did not
+ * serve it or fetch_limit workers are waiting on peers already
+ * (the caller goes to the origin)
+ */
+int peer_fetch(peer_table *table, peer *p, struct iovec *iov, int iovcnt,
+               char *data, unsigned int max)
+{
+  int n;
+
+  P(&table->mutex);
+  if (table->fetching >= table->fetch_limit)
+  {
+    table->fetch_busy++;
+    V(&table->mutex);
+    return -1;
+  }
+  table->fetching++;
+  V(&table->mutex);
+
+  n = peer_ask(p, iov, iovcnt, data, max);
+
+  P(&table->mutex);
+  table->fetching--;
+  V(&table->mutex);
+  return n;
+}
+
+
+
+/*
+ * peer_serve_begin: take one of the serve_limit slots for a peer's
+ * miss, before asking the origin for it
+ *
+ * Returns 0 if taken (give it back with peer_serve_end), -1 if
+ * they are all in use and the miss is to be declined
+ */
+int peer_serve_begin(peer_table *table)
+{
+  int taken = 0;
+
+  P(&table->mutex);
+  if (table->serving < table->serve_limit)
+  {
+    table->serving++;
+    taken = 1;
+  }
+  else
+  {
+    table->declined++;
+  }
+  V(&table->mutex);
+  return taken ? 0 : -1;
+}
+
+
+
+/*
+ * peer_serve_end: give back the slot from peer_serve_begin
+ */
+void peer_serve_end(peer_table *table)
+{
+  P(&table->mutex);
+  table->serving--;
+  V(&table->mutex);
+}
+
+
+
+/*
+ * peer_park: leave a peer's connection fd, done with its request,
+ * to the parker until the next one comes in. It then goes back in
+ * sbuf for a worker. fd is closed if there is no room.
+ */
+void peer_park(peer_table *table, int fd, sbuf_t *sbuf)
+{
+  struct epoll_event ev;
+  peer_parked *pk = NULL;
+  int i;
+
+  P(&table->mutex);
+  for (i = 0; i < PEER_PARK_MAX && pk == NULL; i++)
+  {
+    if (table->parked[i].fd < 0)
+    {
+      pk = &table->parked[i];
+    }
+  }
+  if (pk != NULL)
+  {
+    pk->fd = fd;
+    pk->sbuf = sbuf;
+    pk->since = timer_now_ms();
+    /* One wake up, it is added again after the next request */
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = pk;
+    if (epoll_ctl(table->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      pk->fd = -1;
+      pk = NULL;
+    }
+  }
+  V(&table->mutex);
+  if (pk == NULL)
+  {
+    close(fd);
+  }
+}
+
+
+
+/*
+ * peer_ask: peer_fetch's exchange with p
+ *
+ * A connection that was kept open may have been closed by the
+ * peer in the meantime, that one is tried again on a new one.
+ */
+static int peer_ask(peer *p, struct iovec *iov, int iovcnt,
+                    char *data, unsigned int max)
+{
+  struct iovec copy[PEER_IOV];
+  char frame[PEER_FRAME_LEN + 1];
+  unsigned int len;
+  int fd, fresh, tries;
+
+  P(&p->mutex);
+  p->requests++;
+  V(&p->mutex);
+  for (tries = 0; tries < 2; tries++)
+  {
+    fd = -1;
+    P(&p->mutex);
+    if (p->nidle > 0)
+    {
+      fd = p->idle[--p->nidle];
+    }
+    V(&p->mutex);
+    if ((fresh = (fd < 0)) && (fd = peer_connect(p)) < 0)
+    {
+      break;
+    }
+
+    /* The iovecs are used up by the send, keep them for a retry */
+    memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+    if (peer_writev(fd, copy, iovcnt) < 0 ||
+        peer_read(fd, frame, PEER_FRAME_LEN) < 0)
+    {
+      close(fd);
+      if (fresh)
+      {
+        break;
+      }
+      continue;      /* Closed while it was idle */
+    }
+    frame[PEER_FRAME_LEN] = '\0';
+    if (strcmp(frame, PEER_DECLINE) == 0)
+    {
+      peer_put(p, fd);
+      return -1;
+    }
+    if (sscanf(frame, "PEER %u", &len) != 1 || len > max ||
+        peer_read(fd, data, len) < 0)
+    {
+      close(fd);
+      break;
+    }
+    peer_put(p, fd);
+    P(&p->mutex);
+    p->served++;
+    V(&p->mutex);
+    return len;
+  }
+
+  /* Unreachable or broken, give it some time */
+  P(&p->mutex);
+  p->failures++;
+  p->down_until = timer_now_ms() + PEER_RETRY_MS;
+  V(&p->mutex);
+  return -1;
+}
+
+
+
+/*
+ * peer_report: print what was asked of each peer
+ */
+void peer_report(peer_table *table, FILE *fp)
+{
+  peer *p;
+  int i;
+
+  fprintf(fp, "%-24s %9s %9s %9s %6s\n", "peer", "requests", "served",
+          "failures", "idle");
+  for (i = 0; i < table->npeers; i++)
+  {
+    p = &table->peers[i];
+    if (p == table->self)
+    {
+      continue;
+    }
+    P(&p->mutex);
+    fprintf(fp, "%-24s %9lu %9lu %9lu %6d\n", p->name, p->requests,
+            p->served, p->failures, p->nidle);
+    V(&p->mutex);
+  }
+  P(&table->mutex);
+  fprintf(fp, "peers: %lu misses not asked (fetch limit %d), "
+          "%lu declined (serve limit %d)\n", table->fetch_busy,
+          table->fetch_limit, table->declined, table->serve_limit);
+  V(&table->mutex);
+  fflush(fp);
+}
+
+
+
+/*
+ * peer_hash: FNV-1a, with the bits mixed at the end so that names
+ * that differ in the last byte still land far apart on the ring
+ */
+static unsigned int peer_hash(const char *s)
+{
+  unsigned int h = 2166136261u;
+
+  while (*s != '\0')
+  {
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+
+static int compare_points(const void *a, const void *b)
+{
+  unsigned int x = ((const peer_point *)a)->hash;
+  unsigned int y = ((const peer_point *)b)->hash;
+  return (x > y) - (x < y);
+}
+
+
+
+/*
+ * peer_parker: thread that hands parked connections back to the
+ * workers when a request comes in on them, and closes the ones
+ * the peer closed or that sat there for park_ms
+ */
+static void *peer_parker(void *vargp)
+{
+  peer_table *table = (peer_table *)vargp;
+  struct epoll_event events[64];
+  peer_parked *pk;
+  sbuf_t *sbuf;
+  long now;
+  int i, n, fd;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    n = epoll_wait(table->epfd, events, 64, PEER_SWEEP_MS);
+    for (i = 0; i < n; i++)
+    {
+      pk = (peer_parked *)events[i].data.ptr;
+      P(&table->mutex);
+      fd = pk->fd;
+      sbuf = pk->sbuf;
+      epoll_ctl(table->epfd, EPOLL_CTL_DEL, fd, NULL);
+      pk->fd = -1;
+      V(&table->mutex);
+      /* A whole request comes before any close, nothing to read */
+      if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        close(fd);
+      }
+      else
+      {
+        sbuf_insert(sbuf, fd);
+      }
+    }
+
+    now = timer_now_ms();
+    P(&table->mutex);
+    for (i = 0; i < PEER_PARK_MAX; i++)
+    {
+      pk = &table->parked[i];
+      if (pk->fd >= 0 && now - pk->since >= (long)table->park_ms)
+      {
+        epoll_ctl(table->epfd, EPOLL_CTL_DEL, pk->fd, NULL);
+        close(pk->fd);
+        pk->fd = -1;
+      }
+    }
+    V(&table->mutex);
+  }
+  return NULL;
+}
+
+
+
+/*
+ * peer_connect: new connection to p, its reads and writes give
+ * up after PEER_TIMEOUT_MS so a stuck peer cannot hold a worker
+ */
+static int peer_connect(peer *p)
+{
+  struct timeval tv = { PEER_TIMEOUT_MS / 1000,
+                        (PEER_TIMEOUT_MS % 1000) * 1000 };
+  int fd;
+
+  if ((fd = open_clientfd(p->host, p->port)) < 0)
+  {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+
+
+/*
+ * peer_put: keep fd open for the next request to p, if there is room
+ */
+static void peer_put(peer *p, int fd)
+{
+  P(&p->mutex);
+  if (p->nidle < PEER_IDLE)
+  {
+    p->idle[p->nidle++] = fd;
+    fd = -1;
+  }
+  V(&p->mutex);
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+
+
+/*
+ * peer_writev: write all of the iovecs to fd, -1 on error
+ */
+static int peer_writev(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t n;
+
+  while (iovcnt > 0)
+  {
+    if ((n = writev(fd, iov, iovcnt)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+
+
+/*
+ * peer_read: read exactly n bytes from fd, -1 on error, timeout
+ * or EOF before all of them
+ */
+static int peer_read(int fd, char *buf, size_t n)
+{
+  ssize_t r;
+
+  while (n > 0)
+  {
+    if ((r = recv(fd, buf, n, 0)) <= 0)
+    {
+      if (r < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    buf += r;
+    n -= r;
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * peer.h: header file for peer.c
+ *
+ * Peer mode: proxies in a cluster split the cache ids between
+ * them on a consistent hash ring. A miss on an id another proxy
+ * owns is asked of that proxy, over connections kept open to it,
+ * before going to the origin.
+ *
+ */
+
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+#include <sys/uio.h>
+
+#define PEER_MAX 64              /* Proxies in the cluster             */
+#define PEER_VNODES 128          /* Points on the ring per proxy       */
+#define PEER_IDLE 8              /* Open connections kept per peer     */
+#define PEER_TIMEOUT_MS 5000     /* Longest a peer may take to answer  */
+#define PEER_RETRY_MS 5000       /* A peer that failed is left alone   */
+#define PEER_IOV 4               /* Pieces of a request to a peer      */
+#define PEER_PARK_MAX (PEER_MAX * PEER_IDLE) /* Peers' idle connections */
+#define PEER_SWEEP_MS 1000       /* How often those are checked for age */
+
+/* Request header that marks a peer's request, the owner answers it
+   from its cache or the origin, never from another peer */
+#define PEER_MARK "X-Proxy-Peer"
+
+/* Every answer to a peer starts with a frame of fixed length:
+   "PEER 0000012345\r\n" and that many bytes of response, or
+   "PEER ----------\r\n" if the owner will not serve it (too big
+   to cache, origin down..) and the asker has to go to the origin */
+#define PEER_FRAME_LEN 17
+#define PEER_FRAME "PEER %010u\r\n"
+#define PEER_DECLINE "PEER ----------\r\n"
+
+typedef struct peer
+{
+  char *name;                /* "host:port" */
+  char *host, *port;
+  int idle[PEER_IDLE];       /* Connections not in use */
+  int nidle;
+  long down_until;           /* ms, skipped until then after a failure */
+  sem_t mutex;               /* Protects idle and down_until */
+  /* Metrics */
+  unsigned long requests;    /* Asked of this peer */
+  unsigned long served;      /* ..answered with the object */
+  unsigned long failures;    /* ..connection lost or timed out */
+} peer;
+
+/* A peer's connection between two requests, no worker holds it.
+   It goes back to sbuf when the next request comes in */
+typedef struct peer_parked
+{
+  int fd;                    /* -1 if the slot is free */
+  sbuf_t *sbuf;
+  long since;                /* ms, closed after park_ms of this */
+} peer_parked;
+
+/* A point on the ring, the ids hashing up to it belong to its peer */
+typedef struct peer_point
+{
+  unsigned int hash;
+  peer *peer;
+} peer_point;
+
+typedef struct peer_table
+{
+  peer peers[PEER_MAX];
+  int npeers;
+  peer *self;                /* This proxy */
+  peer_point *points;        /* Sorted by hash */
+  int npoints;
+  /* Workers waiting on peers, past fetch_limit a miss goes to the
+     origin so some are always left to answer the peers */
+  int fetching, fetch_limit;
+  /* Peers' misses being fetched, past serve_limit they are declined */
+  int serving, serve_limit;
+  peer_parked parked[PEER_PARK_MAX];
+  int epfd;                  /* Has the parked fds */
+  unsigned int park_ms;
+  sem_t mutex;               /* Protects the counts and parked */
+  /* Metrics */
+  unsigned long fetch_busy;  /* Misses not asked, fetch_limit reached */
+  unsigned long declined;    /* Peers' misses declined, serve_limit */
+} peer_table;
+
+
+/* Function prototypes */
+peer_table *init_peer_table(char *filename, char *self_name,
+                            int nthreads, unsigned int idle_ms);
+peer *peer_owner(peer_table *table, char *id);
+int peer_fetch(peer_table *table, peer *p, struct iovec *iov, int iovcnt,
+               char *data, unsigned int max);
+int peer_serve_begin(peer_table *table);
+void peer_serve_end(peer_table *table);
+void peer_park(peer_table *table, int fd, sbuf_t *sbuf);
+void peer_report(peer_table *table, FILE *fp);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,445 @@
+/*
+ * prefetch.c: Prefetching of page subresources for the proxy
+ *
+ * When a text/html response is about to go into the cache,
+ * prefetch_scan looks through the body for src= and href=
+ * attributes that point at the same host and port, and queues
+ * their cache ids.
+ *
+ * A couple of background threads take ids off the queue and, if
+ * they are still not cached, fetch them from the server straight
+ * into the cache. By the time the browser asks for the images and
+ * scripts of the page they are already hits.
+ *
+ * Prefetching is rate limited by a global budget (prefetches per
+ * second), links found over the budget or with a full queue are
+ * just dropped.
+ *
+ * prefetch_refresh uses the same threads to refetch a stale node
+ * while the clients are being served the stale copy, it does not
+ * count against the budget.
+ *
+ */
+
+#include "prefetch.h"
+#include "timer.h"
+
+/* Seconds a background fetch may stall before it is given up */
+#define PREFETCH_TIMEOUT 10
+
+static const char *prefetch_hdrs = "Connection: close\r\n"
+                                   "Proxy-Connection: close\r\n\r\n";
+
+/* Global Variables */
+static origin_table *prefetch_origins = NULL;
+static prefetch_queue queue;
+
+static void *prefetch_thread(void *vargp);
+static void prefetch_fetch(cache_list *list, char *id, int refresh);
+static int prefetch_take_token();
+static int prefetch_insert(cache_list *list, char *id, int refresh);
+static int is_html(char *data, char *end);
+static char *scan_for(char *p, char *end, const char *word);
+static int resolve_link(char *id, size_t size, char *link, char *host,
+                        char *port, char *path);
+
+
+
+/*
+ * init_prefetch: set up the queue and start the background
+ * fetchers, a budget of 0 leaves prefetching off but the
+ * fetchers are still there for refreshes
+ */
+void init_prefetch(origin_table *origins, int budget)
+{
+  pthread_t tid;
+  int i;
+
+  prefetch_origins = origins;
+  queue.front = queue.rear = 0;
+  Sem_init(&queue.mutex, 0, 1);
+  Sem_init(&queue.slots, 0, PREFETCH_QUEUE);
+  Sem_init(&queue.items, 0, 0);
+  queue.budget = budget;
+  queue.tokens = budget;
+  queue.refill_ms = timer_now_ms();
+  Sem_init(&queue.token_mutex, 0, 1);
+
+  for (i = 0; i < PREFETCH_THREADS; i++)
+  {
+    Pthread_create(&tid, NULL, prefetch_thread, NULL);
+  }
+}
+
+
+
+/*
+ * prefetch_scan: look for same-host links in a page about to be
+ * cached in list under page_id ("http://host:port/path") and 
+ * queue them, for the same list.
+ *
+ * data holds the whole response (headers and body), len bytes,
+ * and does not have to be null terminated
+ */
+void prefetch_scan(cache_list *list, char *page_id, char *data, 
+                   unsigned int len)
+{
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+  char link[MAXLINE], id[MAXLINE];
+  char taken[PREFETCH_PER_PAGE][MAXLINE / 8];
+  char *end = data + len;
+  char *body, *p, *q;
+  char quote;
+  int ntaken = 0, i;
+
+  if (queue.budget <= 0)
+  {
+    return;
+  }
+  if (sscanf(page_id, "http://%[^:]:%[^/]%s", host, port, path) != 3)
+  {
+    return;
+  }
+  if ((body = scan_for(data, end, "\r\n\r\n")) == NULL || !is_html(data, body))
+  {
+    return;
+  }
+
+  for (p = body; p < end && ntaken < PREFETCH_PER_PAGE; p++)
+  {
+    /* Attribute has to start a word: src= or href= */
+    if (p > body && !isspace((unsigned char)p[-1]))
+    {
+      continue;
+    }
+    if ((end - p) > 4 && strncasecmp(p, "src=", 4) == 0)
+    {
+      q = p + 4;
+    }
+    else if ((end - p) > 5 && strncasecmp(p, "href=", 5) == 0)
+    {
+      q = p + 5;
+    }
+    else
+    {
+      continue;
+    }
+
+    /* Copy out the value, quoted or not */
+    quote = (*q == '"' || *q == '\'') ? *q++ : 0;
+    for (i = 0; q < end && i < (int)sizeof(taken[0]) - 1; q++, i++)
+    {
+      if ((quote && *q == quote) ||
+          (!quote && (isspace((unsigned char)*q) || *q == '>')))
+      {
+        break;
+      }
+      link[i] = *q;
+    }
+    link[i] = '\0';
+    p = q;
+
+    if (!resolve_link(id, sizeof(id), link, host, port, path) ||
+        strlen(id) >= sizeof(taken[0]))
+    {
+      continue;
+    }
+    /* Same link twice in one page only costs one token */
+    for (i = 0; i < ntaken; i++)
+    {
+      if (strcmp(taken[i], id) == 0)
+      {
+        break;
+      }
+    }
+    if (i < ntaken)
+    {
+      continue;
+    }
+    if (!prefetch_take_token())
+    {
+      return;       /* Over budget, rest of the page is dropped */
+    }
+    strcpy(taken[ntaken++], id);
+    prefetch_insert(list, id, 0);
+  }
+}
+
+
+
+/*
+ * resolve_link: turn a link found in the page at host:port/path
+ * into a cache id, in id (size bytes).
+ *
+ * Returns 0 for links to other hosts, other schemes and fragments,
+ * and for ids too long for id
+ */
+static int resolve_link(char *id, size_t size, char *link, char *host,
+                        char *port, char *path)
+{
+  char link_host[MAXLINE], link_path[MAXLINE];
+  char *tmp;
+  int n;
+
+  /* Drop the fragment, it never reaches the server */
+  if ((tmp = index(link, '#')) != NULL)
+  {
+    *tmp = '\0';
+  }
+  if (link[0] == '\0')
+  {
+    return 0;
+  }
+
+  if (strncasecmp(link, "http://", 7) == 0)      /* Absolute url       */
+  {
+    strcpy(link_path, "/");
+    sscanf(link + 7, "%[^/]%s", link_host, link_path);
+    tmp = index(link_host, ':');
+    if (tmp != NULL)
+    {
+      *tmp = '\0';
+    }
+    if (strcasecmp(link_host, host) != 0 ||
+        strcmp((tmp != NULL) ? tmp + 1 : "80", port) != 0)
+    {
+      return 0;
+    }
+    n = snprintf(id, size, "http://%s:%s%s", host, port, link_path);
+  }
+  else if (link[0] == '/')                       /* Same host, path    */
+  {
+    if (link[1] == '/')
+    {
+      return 0;    /* Scheme relative, may be another host */
+    }
+    n = snprintf(id, size, "http://%s:%s%s", host, port, link);
+  }
+  else if (strpbrk(link, ":") == NULL)           /* Relative to page   */
+  {
+    strcpy(link_path, path);
+    tmp = rindex(link_path, '/');
+    tmp[1] = '\0';
+    n = snprintf(id, size, "http://%s:%s%s%s", host, port, link_path, link);
+  }
+  else                                           /* mailto:, https: .. */
+  {
+    return 0;
+  }
+  return n >= 0 && (size_t)n < size;
+}
+
+
+
+/*
+ * prefetch_refresh: fetch id again in the background, the caller
+ * has claimed the refresh of its stale node in list
+ */
+void prefetch_refresh(cache_list *list, char *id)
+{
+  if (!prefetch_insert(list, id, 1))
+  {
+    proxy_refresh_done(list, id);   /* Queue full, try later */
+  }
+}
+
+
+
+/*
+ * prefetch_take_token: take one prefetch out of the budget
+ * for the current second, returns 0 if there is none left
+ */
+static int prefetch_take_token()
+{
+  int ok = 0;
+  long now = timer_now_ms();
+
+  P(&queue.token_mutex);
+  if (now - queue.refill_ms >= 1000)
+  {
+    queue.tokens = queue.budget;
+    queue.refill_ms = now;
+  }
+  if (queue.tokens > 0)
+  {
+    queue.tokens--;
+    ok = 1;
+  }
+  V(&queue.token_mutex);
+  return ok;
+}
+
+
+
+/*
+ * prefetch_insert: add a copy of id to the back of the queue,
+ * never blocks the proxy thread, drops the id if queue is full
+ *
+ * Returns 1 if queued, else 0
+ */
+static int prefetch_insert(cache_list *list, char *id, int refresh)
+{
+  if (sem_trywait(&queue.slots) < 0)
+  {
+    return 0;
+  }
+  P(&queue.mutex);
+  queue.rear = (queue.rear + 1) % PREFETCH_QUEUE;
+  queue.ids[queue.rear] = (char *)Malloc(strlen(id) + 1);
+  strcpy(queue.ids[queue.rear], id);
+  queue.lists[queue.rear] = list;
+  queue.refresh[queue.rear] = refresh;
+  V(&queue.mutex);
+  V(&queue.items);
+  return 1;
+}
+
+
+
+/*
+ * prefetch_thread: take ids off the front of the queue and fetch them
+ */
+static void *prefetch_thread(void *vargp)
+{
+  char *id;
+  cache_list *list;
+  int refresh;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    P(&queue.items);
+    P(&queue.mutex);
+    queue.front = (queue.front + 1) % PREFETCH_QUEUE;
+    id = queue.ids[queue.front];
+    list = queue.lists[queue.front];
+    refresh = queue.refresh[queue.front];
+    V(&queue.mutex);
+    V(&queue.slots);
+
+    prefetch_fetch(list, id, refresh);
+    Free(id);
+  }
+  return NULL;
+}
+
+
+
+/*
+ * prefetch_fetch: get id from the server into list, unless a
+ * client got there first. Only whole 200 responses are cached
+ *
+ * A refresh always refetches, and on failure leaves the stale
+ * node in place to be served and refreshed again later
+ *
+ * It never waits for a connection to the origin, if the origin
+ * is at its limit the clients come first and the fetch is dropped
+ */
+static void prefetch_fetch(cache_list *list, char *id, int refresh)
+{
+  int done = 0;
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+  char request[MAXBUF];
+  struct timeval timeout = { PREFETCH_TIMEOUT, 0 };
+  rio_t rio;
+  char *data;
+  ssize_t len;
+  int fd = -1;
+  origin *o = NULL;
+
+  if (!refresh && proxy_check_cache(list, id))
+  {
+    return;
+  }
+  if (sscanf(id, "http://%[^:]:%[^/]%s", host, port, path) != 3 ||
+      (o = origin_acquire(prefetch_origins, host, port, 0)) == NULL ||
+      (fd = open_clientfd(host, port)) < 0)
+  {
+    if (o != NULL)
+    {
+      origin_release(prefetch_origins, o);
+    }
+    if (refresh)
+    {
+      proxy_refresh_done(list, id);
+    }
+    return;
+  }
+  /* No client is waiting on this one, never let it block for long */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* An id too long for the request is not fetched at all */
+  if (snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s:%s\r\n%s",
+               path, host, port, prefetch_hdrs) >= (int)sizeof(request) ||
+      rio_writen(fd, request, strlen(request)) < 0)
+  {
+    Close(fd);
+    origin_release(prefetch_origins, o);
+    if (refresh)
+    {
+      proxy_refresh_done(list, id);
+    }
+    return;
+  }
+
+  /* One byte more than fits, to tell a full object from a cut off one */
+  data = (char *)Malloc(MAX_OBJECT_SIZE + 1);
+  rio_readinitb(&rio, fd);
+  len = rio_readnb(&rio, data, MAX_OBJECT_SIZE + 1);
+  Close(fd);
+  origin_release(prefetch_origins, o);
+
+  if (len > 12 && len <= MAX_OBJECT_SIZE &&
+      strncmp(data, "HTTP/1.", 7) == 0 && strncmp(data + 8, " 200", 4) == 0 &&
+      (refresh || !proxy_check_cache(list, id)))
+  {
+    done = (proxy_write_to_cache(list, id, data, 
+                                 (unsigned int)len) == 0);
+  }
+  if (refresh && !done)
+  {
+    proxy_refresh_done(list, id);
+  }
+  Free(data);
+}
+
+
+
+/*
+ * is_html: check the Content-Type among the headers in [data, end)
+ */
+static int is_html(char *data, char *end)
+{
+  char *p = scan_for(data, end, "\r\nContent-Type:");
+
+  if (p == NULL)
+  {
+    return 0;
+  }
+  while (p < end && *p == ' ')
+  {
+    p++;
+  }
+  return (end - p) >= 9 && strncasecmp(p, "text/html", 9) == 0;
+}
+
+
+
+/*
+ * scan_for: case insensitive search for word in [p, end),
+ * returns a pointer just past the match or NULL
+ */
+static char *scan_for(char *p, char *end, const char *word)
+{
+  size_t n = strlen(word);
+
+  for (; (size_t)(end - p) >= n; p++)
+  {
+    if (strncasecmp(p, word, n) == 0)
+    {
+      return p + n;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * prefetch.h: header file for prefetch.c
+ *
+ * Optional prefetcher: HTML pages that go into the cache are
+ * scanned for same-host links, which are then fetched into
+ * the cache in the background.
+ *
+ * The same background fetchers refresh stale cache nodes.
+ *
+ * Every id is queued with the cache (shard) it goes into.
+ *
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "cache.h"
+#include "origin.h"
+
+#define PREFETCH_THREADS 2     /* Background fetchers               */
+#define PREFETCH_QUEUE 64      /* Pending links, more are dropped   */
+#define PREFETCH_PER_PAGE 32   /* Links taken from a single page    */
+
+/* Bounded queue of cache ids, same layout as sbuf from the book */
+typedef struct prefetch_queue
+{
+  char *ids[PREFETCH_QUEUE];
+  cache_list *lists[PREFETCH_QUEUE];  /* Where each one goes */
+  int refresh[PREFETCH_QUEUE];  /* Refetch even if cached  */
+  int front;       /* ids[(front+1)%PREFETCH_QUEUE] is first item */
+  int rear;        /* ids[rear%PREFETCH_QUEUE] is last item       */
+  sem_t mutex;     /* Protects accesses to ids                    */
+  sem_t slots;     /* Counts available slots                      */
+  sem_t items;     /* Counts available items                      */
+
+  /* Global budget, a token bucket refilled every second */
+  int budget;      /* Prefetches allowed per second, 0 is off     */
+  int tokens;
+  long refill_ms;
+  sem_t token_mutex;
+} prefetch_queue;
+
+
+/* Function prototypes */
+void init_prefetch(origin_table *origins, int budget);
+void prefetch_scan(cache_list *list, char *page_id, char *data, 
+                   unsigned int len);
+void prefetch_refresh(cache_list *list, char *id);
+
+#endif /* __PREFETCH_H__ */
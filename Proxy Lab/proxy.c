@@ -23,13 +23,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "csapp.h"
 #include "cache.h"
+#include "timer.h"
+#include "prefetch.h"
+#include "sbuf.h"
+#include "uring.h"
+#include "rewrite.h"
+#include "log.h"
+#include "origin.h"
+#include "peer.h"
+#include "numa.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Worker threads and pending connections (prethreaded, page 1041) */
+#define NTHREADS 64
+#define SBUFSIZE 256
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
@@ -44,49 +61,253 @@ static const char *default_port_str = "80";
 static const char *space_str = " ";
 static const char *end_str = "\r\n";
 
+/* A NUMA node's part of the proxy: its workers take the connections
+   accepted on the node and serve them from the node's own cache.
+   Without -n there is one shard for the whole machine. */
+typedef struct shard
+{
+  int node;               /* numa.h index, pinned to it with -n */
+  cache_list *cache;      /* This is the cache list */
+  sbuf_t sbuf;            /* Connected descriptors for the workers */
+} shard;
+
 /* Global Variables */
-cache_list *cache = NULL; /* This is the cache list */
+shard shards[NUMA_MAX_NODES];
+int nshards = 1;
+int use_numa = 0;         /* Threads pinned to their shard's node (-n) */
+int listenfd;
+timer_wheel *wheel = NULL; /* Deadlines for every connection */
+rewrite_table *rules = NULL; /* What happens to the client's headers */
+origin_table *origins = NULL; /* Connections to each origin server */
+peer_table *peers = NULL;     /* Other proxies sharing the ids, or none */
+
+/* I/O engine picked on the cmd line, blocking rio unless -e uring */
+int use_uring = 0;
+static __thread uring *ring = NULL;  /* Worker's own ring, if any */
+static __thread cache_list *cache = NULL; /* Worker's shard's cache */
+static __thread sbuf_t *conns = NULL;     /* ..and its connections */
+
+/* Connection timeouts in ms, can be changed on the cmd line */
+unsigned int header_timeout = 10000;  /* Whole request header   */
+unsigned int idle_timeout = 30000;    /* No progress either way */
+unsigned int body_timeout = 300000;   /* Whole response         */
+/* Kernel send buffer per client, bounds what a slow reader can pin */
+int client_sndbuf = 65536;
+/* Subresources prefetched per second, 0 turns prefetching off */
+int prefetch_budget = 0;
+/* Stale content, in ms past freshness (nodes go stale after -f secs) */
+unsigned int stale_while_revalidate = 30000; /* Served, refreshed behind */
+unsigned int stale_if_error = 300000;        /* Served if server is down */
+/* Connections at once to any one origin, 0 is no limit */
+int origin_limit = 16;
+/* Where the cache is dumped on SIGUSR1 and on the way out, NULL is off */
+char *snapshot_file = NULL;
+/* Left to the signal thread, SIGUSR2 prints the metrics */
+sigset_t proxy_signals;
 
 
 /* Function prototypes */
-void thread(void *vargp);
+void *thread(void *vargp);
+void *acceptor(void *vargp);
+void accept_loop(shard *sh);
+char *snapshot_name(int i, char *buf, size_t size);
+unsigned int timeout_ms(char *secs);
+void serve(int client_fd);
+int proxy_send(int fd, void *buf, size_t len);
+int proxy_sendv(int fd, struct iovec *iov, int iovcnt);
+int append_str(char *buf, size_t *len, const char *str, size_t n);
+int proxy_open_server(char *host, char *port);
 int echo(int client_fd, int *server_fd, char *cache_id, 
-          unsigned int *cache_len, char *cache_data);
+          unsigned int *cache_len, char *cache_data, origin **up,
+          int *from_peer);
+int purge(int client_fd, char *headers, char *host, char *port,
+          char *path, char *cache_id, unsigned int *cache_len,
+          char *cache_data);
+ssize_t proxy_recv(int fd, void *buf, size_t len);
+int read_request(int fd, char *buf, size_t size);
+char *find_header_end(char *buf, size_t from, size_t len);
 int parse_uri(char *uri, char *method, char *url, char *http_version,
                        char *protocol,char *host_name, char *suffix,
                        char *request_host, char *request_port);
-int write_to_cache(int client_fd, int server_fd, 
-                    void *cache_data, char *cache_id); 
+int write_to_cache(int client_fd, int server_fd, void *cache_data, 
+                   char *cache_id, conn_timer *timer, unsigned long *sent); 
 int add_data(char *cache_data, unsigned int *cache_len, 
          unsigned int len, char *server_fd_line, int valid);
+int send_answer(int fd, char *data, unsigned int len, int framed);
+int answer_peer(int peer_fd, int server_fd, char *cache_data, 
+                char *cache_id, conn_timer *timer, unsigned long *sent);
+
+/* What write_to_cache keeps track of while relaying the response */
+typedef struct relay_state
+{
+  char *cache_data;
+  unsigned int cache_len;
+  int size_valid_bit;
+  conn_timer *timer;
+  unsigned long sent;     /* Everything relayed, for the access log */
+} relay_state;
+int relay_chunk(void *vargp, char *buf, unsigned int len);
+void *signal_thread(void *vargp);
 
 
 
 
-/* Taken from code from page 953 of textbook */
+/* Taken from code from page 953 of textbook,
+ * prethreaded as on page 1041 */
 int main(int argc, char **argv) 
 {
-  int listenfd, *connfdp;
   char *port;
-  int clientlen = 0;
-  struct sockaddr_in clientaddr;
   pthread_t tid;
+  int opt, i, j, n;
+  int nthreads = NTHREADS;
+  uring accept_ring;
+  char name[MAXLINE];
+  char *rules_file = NULL;
+  char *log_file = NULL;
+  char *weights_file = NULL;
+  unsigned int fresh_ttl = 0;   /* Cached pages never go stale by default */
+  int hugepages = 0;            /* Cache storage in huge pages (-M) */
+  char *peers_file = NULL;
+  char *self_name = NULL;       /* This proxy's name in the peers file */
   
   /* ignore SIGPIPE (from hints) */
   Signal(SIGPIPE, SIG_IGN);
+  
+  /* Optional settings, timeouts are given in seconds */
+  while ((opt = getopt(argc, argv, "H:I:B:S:p:f:w:g:t:e:R:l:d:c:W:MP:N:n")) != -1)
+  {
+    switch (opt)
+    {
+      case 'H': header_timeout = timeout_ms(optarg); break;
+      case 'I': idle_timeout = timeout_ms(optarg); break;
+      case 'B': body_timeout = timeout_ms(optarg); break;
+      case 'S': client_sndbuf = atoi(optarg); break;
+      case 'p': prefetch_budget = atoi(optarg); break;
+      case 'f': fresh_ttl = atoi(optarg) * 1000; break;
+      case 'w': stale_while_revalidate = atoi(optarg) * 1000; break;
+      case 'g': stale_if_error = atoi(optarg) * 1000; break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'e': use_uring = (strcmp(optarg, "uring") == 0); break;
+      case 'R': rules_file = optarg; break;
+      case 'l': log_file = optarg; break;
+      case 'd': snapshot_file = optarg; break;
+      case 'c': origin_limit = atoi(optarg); break;
+      case 'W': weights_file = optarg; break;
+      case 'M': hugepages = 1; break;
+      case 'P': peers_file = optarg; break;
+      case 'N': self_name = optarg; break;
+      case 'n': use_numa = 1; break;
+      default: optind = argc; break;   /* Falls into usage below */
+    }
+  }
     
-  /* Wrong number of inputs */
-  if (argc != 2) 
+  /* Wrong number of inputs, or a timeout that is not a time */
+  if (argc - optind != 1 || (peers_file != NULL && self_name == NULL) ||
+      header_timeout == 0 || idle_timeout == 0 || body_timeout == 0) 
   {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    fprintf(stderr, "usage: %s [-H header_secs] [-I idle_secs] "
+            "[-B body_secs] [-S sndbuf_bytes] [-p prefetch_per_sec] "
+            "[-f fresh_secs] [-w revalidate_secs] [-g error_grace_secs] "
+            "[-t threads] [-e rio|uring] [-R rules_file] [-l log_file] "
+            "[-d snapshot_file] [-c origin_conns] [-W weights_file] "
+            "[-M] [-n] [-P peers_file -N host:port] <port>\n", argv[0]);
     exit(1);
   }
   
   /* This is the port specified on cmd line */
-  port = argv[1];
+  port = argv[optind];
   
-  /* Initialize cache */
-  cache = init_cache_list();
+  /* Header rules: the handout's fixed headers, then the rules file */
+  rules = init_rewrite_table();
+  rewrite_add_rule(rules, REWRITE_HOST, "Host");
+  rewrite_add_rule(rules, REWRITE_PEER, PEER_MARK);
+  rewrite_add_rule(rules, REWRITE_SET, user_agent_hdr);
+  rewrite_add_rule(rules, REWRITE_SET, accept_hdr);
+  rewrite_add_rule(rules, REWRITE_SET, accept_encoding_hdr);
+  rewrite_add_rule(rules, REWRITE_SET, connection_hdr);
+  rewrite_add_rule(rules, REWRITE_SET, proxy_connection_hdr);
+  if ((rules_file != NULL && rewrite_load_rules(rules, rules_file) < 0) ||
+      rewrite_compile(rules) < 0)
+  {
+    fprintf(stderr, "Bad header rules\n");
+    exit(1);
+  }
+  
+  /* Only the signal thread takes these, every thread made
+     from here on inherits the mask */
+  sigemptyset(&proxy_signals);
+  sigaddset(&proxy_signals, SIGUSR2);
+  if (snapshot_file != NULL)
+  {
+    sigaddset(&proxy_signals, SIGUSR1);
+  }
+  if (snapshot_file != NULL || log_file != NULL)
+  {
+    sigaddset(&proxy_signals, SIGTERM);
+    sigaddset(&proxy_signals, SIGINT);
+  }
+  pthread_sigmask(SIG_BLOCK, &proxy_signals, NULL);
+  
+  /* Cache misses share at most 3/4 of the workers between origins,
+     the rest are left for hits */
+  if (origin_limit <= 0)
+  {
+    origin_limit = nthreads;
+  }
+  origins = init_origin_table(origin_limit, 
+                              nthreads > 4 ? nthreads * 3 / 4 : nthreads);
+  if (weights_file != NULL && origin_load_weights(origins, weights_file) < 0)
+  {
+    exit(1);
+  }
+  
+  /* Peer mode, the ids are split between the proxies in the file */
+  if (peers_file != NULL && 
+      (peers = init_peer_table(peers_file, self_name, nthreads,
+                               idle_timeout)) == NULL)
+  {
+    exit(1);
+  }
+  
+  /* One shard per NUMA node with -n, its cache storage reserved
+     on the node's memory up front */
+  if (use_numa)
+  {
+    nshards = numa_init();
+  }
+  
+  /* Initialize caches and the connection timers */
+  for (i = 0; i < nshards; i++)
+  {
+    shards[i].node = i;
+    shards[i].cache = init_cache_list();
+    shards[i].cache->fresh_ttl = fresh_ttl;
+    if ((hugepages || use_numa) && 
+        cache_reserve(shards[i].cache, CACHE_RESERVE_SIZE, hugepages, 
+                      use_numa ? i : -1) < 0)
+    {
+      fprintf(stderr, "No %s for the cache, using malloc\n",
+              hugepages ? "huge pages" : "reserved memory");
+    }
+    if (snapshot_file != NULL)
+    {
+      /* Warm start from the last run, a missing file is fine */
+      n = cache_load_snapshot(shards[i].cache, 
+                              snapshot_name(i, name, sizeof(name)));
+      if (n >= 0)
+      {
+        fprintf(stderr, "Restored %d cached objects\n", n);
+      }
+    }
+  }
+  Pthread_create(&tid, NULL, signal_thread, NULL);
+  wheel = init_timer_wheel();
+  init_prefetch(origins, prefetch_budget);
+  if (init_log(log_file) < 0)
+  {
+    fprintf(stderr, "Cannot open log %s\n", log_file);
+    exit(1);
+  }
   
   /* Carry out processes of socket,bind,listen with error handling */
   listenfd = Open_listenfd(port);
@@ -95,88 +316,493 @@ int main(int argc, char **argv)
     fprintf(stderr ,"Listenfd = %d less than zero\n",listenfd);
     exit(1);
   } 
+  
+  /* Check the kernel has io_uring before the workers rely on it */
+  if (use_uring && uring_init(&accept_ring, URING_ENTRIES, 0) < 0)
+  {
+    fprintf(stderr, "io_uring not available, using rio\n");
+    use_uring = 0;
+  }
+  if (use_uring)
+  {
+    uring_free(&accept_ring);
+  }
+  
+  /* Create worker threads, split evenly between the shards */
+  for (i = 0; i < nshards; i++)
+  {
+    sbuf_init(&shards[i].sbuf, SBUFSIZE);
+    for (j = 0; j < (nthreads + nshards - 1) / nshards; j++)
+    {
+      Pthread_create(&tid, NULL, thread, &shards[i]);
+    }
+  }
+  
+  /* Every node accepts on the one listening socket, main is node 0's */
+  for (i = 1; i < nshards; i++)
+  {
+    Pthread_create(&tid, NULL, acceptor, &shards[i]);
+  }
+  if (use_numa)
+  {
+    numa_pin_thread(0);
+  }
+  accept_loop(&shards[0]);
+  return 0;
+}
+
+
+
+/* acceptor: thread that takes the connections for its node's
+ * workers, pinned to the node with them. All acceptors share one
+ * listening socket, so any of them may get any connection, the
+ * kernel does not pick by node
+ */
+void *acceptor(void *vargp)
+{
+  shard *sh = (shard *)vargp;
+
+  Pthread_detach(pthread_self());
+  if (use_numa)
+  {
+    numa_pin_thread(sh->node);
+  }
+  accept_loop(sh);
+  return NULL;
+}
+
+
+
+/* accept_loop: accept connections on listenfd for good, and put
+ * them in sh's buffer for its workers
+ */
+void accept_loop(shard *sh)
+{
+  int connfd, clientlen, fds[URING_ACCEPTS];
+  struct sockaddr_in clientaddr;
+  uring accept_ring;
+  int i, n;
+  
+  /* io_uring: every connection that came in is picked up at once */
+  if (use_uring && uring_init(&accept_ring, URING_ENTRIES, 0) == 0)
+  {
+    uring_post_accepts(&accept_ring, listenfd, URING_ACCEPTS);
+    while ((n = uring_accept_batch(&accept_ring, listenfd, 
+                                   fds, URING_ACCEPTS)) >= 0)
+    {
+      for (i = 0; i < n; i++)
+      {
+        sbuf_insert(&sh->sbuf, fds[i]);
+      }
+    }
+    fprintf(stderr, "io_uring accept failed\n");
+    exit(1);
+  }
+  
   while (1) 
   {
     clientlen = sizeof(clientaddr);
-    connfdp = (int *)malloc(sizeof(int));
-    *connfdp = Accept(listenfd, (SA *) &clientaddr, (socklen_t *)&clientlen);
-    Pthread_create(&tid, NULL, (void*)thread, (void*)connfdp);  
+    connfd = Accept(listenfd, (SA *) &clientaddr, (socklen_t *)&clientlen);
+    sbuf_insert(&sh->sbuf, connfd);   /* Insert connfd in buffer */
   }
-  return 0;
 }
 
 
 
-/* Thread routine: to process http requests & react  
- * to the request by
- * 1) checking cache for hit
- * 2) sending response from cache if hit or from server if no hit to client
- * 3) closing file descriptors and exiting threads
+/*
+ * timeout_ms: a timeout option given in seconds, in ms,
+ * 0 if it is not a positive number of seconds that fits
+ */
+unsigned int timeout_ms(char *secs)
+{
+  long n = atol(secs);
+
+  if (n <= 0 || n > UINT_MAX / 1000)
+  {
+    return 0;
+  }
+  return (unsigned int)n * 1000;
+}
+
+
+
+/*
+ * snapshot_name: the snapshot file of shard i, the -d file itself
+ * if there is only one shard, else with the node number after it
+ */
+char *snapshot_name(int i, char *buf, size_t size)
+{
+  if (nshards == 1)
+  {
+    return snapshot_file;
+  }
+  snprintf(buf, size, "%s.node%d", snapshot_file, i);
+  return buf;
+}
+
+
+
+/* Thread routine: worker that serves the connections put
+ * in its shard's sbuf by the node's acceptor, one at a time
+ *
+ * With the io_uring engine each worker sets up its own ring once,
+ * and falls back to rio if that fails. A ring torn down after an
+ * error is set up again between connections. The same goes for its
+ * ring of access log records.
  */
-void thread(void *vargp)
+void *thread(void *vargp)
 {
-  int client_fd = *((int *)vargp);
+  shard *sh = (shard *)vargp;
+
   Pthread_detach(pthread_self());
+  log_register();
+  if (use_numa)
+  {
+    numa_pin_thread(sh->node);
+  }
+  cache = sh->cache;
+  conns = &sh->sbuf;
   
-  Free(vargp);
+  if (use_uring)
+  {
+    ring = (uring *)Malloc(sizeof(uring));
+    if (uring_init(ring, URING_ENTRIES, URING_BUFS) < 0)
+    {
+      Free(ring);
+      ring = NULL;
+    }
+  }
   
+  while (1)
+  {
+    serve(sbuf_remove(&sh->sbuf));
+    if (ring != NULL && ring->fd < 0 &&
+        uring_init(ring, URING_ENTRIES, URING_BUFS) < 0)
+    {
+      Free(ring);
+      ring = NULL;
+    }
+  }
+  return NULL;
+}
+
+
+
+/* serve: to process http requests & react  
+ * to the request by
+ * 1) checking cache for hit
+ * 2) sending response from cache if hit or from server if no hit to client
+ * 3) closing file descriptors
+ * 4) logging the request
+ *
+ * The connection timer watches client_fd from the start and the
+ * server's fd once it is connected, and is cancelled before the fds
+ * are closed. It does not cover echo waiting for a turn at the
+ * origin (ORIGIN_WAIT_MS), asking a peer (PEER_TIMEOUT_MS) or
+ * connecting to the server (the kernel's connect timeout)
+ *
+ * A peer's connection is kept open for its next request, parked
+ * with the peer table rather than held by this thread. Every
+ * answer to it is framed with its length (peer.h)
+ */
+void serve(int client_fd)
+{
   /* Variables used */
   char cache_id[MAXLINE];
   unsigned int cache_len;
   char cache_data[MAX_OBJECT_SIZE];
   int variable = 0;    /* Variable for return value of echo */
-  int server_fd= 0;   /* Set file descriptor for server */
+  int server_fd;       /* Set file descriptor for server */
+  conn_timer timer;    /* Header, idle and body deadlines */
+  /* For the access log */
+  long start;
+  unsigned long sent;
+  int status, result;
+  origin *up;          /* Origin whose connection this holds */
+  int from_peer = 0;   /* Set by echo for a peer's request */
+  int answered;
+  
+  /* Bound how much of the response the kernel queues for a slow client */
+  setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, 
+             &client_sndbuf, sizeof(client_sndbuf));
   
-  variable = echo(client_fd, &server_fd, cache_id, &cache_len, cache_data);
+  start = log_now_us();
+  sent = 0;
+  status = 0;
+  result = LOG_ERROR;
+  up = NULL;
+  server_fd = -1;
+  cache_id[0] = '\0';
+  
+  /* Client has header_timeout to send the whole request (slowloris) */
+  init_conn_timer(&timer, client_fd);
+  timer_arm(wheel, &timer, header_timeout);
+  
+  variable = echo(client_fd, &server_fd, cache_id, &cache_len, 
+                  cache_data, &up, &from_peer);
+
+  /* From here on only the idle and body timeouts apply */
+  timer_set_deadline(&timer, body_timeout);
+  timer_touch(wheel, &timer, idle_timeout);
 
   /* Consider the different cases based on variable value */
-  if (variable == -1)      /* Error encountered */
+  if (variable >= 1)       /* Read from cache (or the proxy's answer) */
   {
-    Close(client_fd);
-    Pthread_exit(NULL);
+    if (send_answer(client_fd, cache_data, cache_len, from_peer) == 0)
+    {
+      sent = cache_len;
+      result = (variable == 1) ? LOG_HIT : 
+               (variable == 2) ? LOG_STALE : 
+               (variable == 3) ? LOG_PURGE : LOG_PEER;
+    }
+    status = log_status(cache_data, cache_len);
   }
   
-  else if (variable == 1)  /* Read from cache   */
+  else if (variable == 0 && from_peer)  /* Whole, for a peer */
   {
-    if (Rio_writen(client_fd, (void *)cache_data, (size_t)cache_len) == -1)
+    timer_watch_fd(wheel, &timer, server_fd);
+    answered = answer_peer(client_fd, server_fd, cache_data, 
+                           cache_id, &timer, &sent);
+    peer_serve_end(peers);
+    if (answered == 0)
+    {
+      result = LOG_MISS;
+      status = log_status(cache_data, sent);
+    }
+    else if (answered < 0)
     {
-      Close(client_fd);
-      Pthread_exit(NULL);
-    }  
+      from_peer = 0;   /* Lost the peer */
+    }
   }
   
-  else                     /* Write to cache    */
+  else if (variable == 0)  /* Write to cache    */
   {
-    if (write_to_cache(client_fd, server_fd, cache_data, cache_id) == -1)
+    timer_watch_fd(wheel, &timer, server_fd);
+    if (write_to_cache(client_fd, server_fd, cache_data, 
+                       cache_id, &timer, &sent) == 0)
     {
-      Close(client_fd);
-      Close(server_fd);
-      Pthread_exit(NULL);
-    }  
+      result = LOG_MISS;
+    }
+    /* The first chunk is always kept in cache_data */
+    status = log_status(cache_data, sent < MAX_OBJECT_SIZE ? 
+                                    sent : MAX_OBJECT_SIZE);
   }
+  
+  /* A peer's request that could not be served, it goes to the
+     origin itself */
+  else if (from_peer && 
+           proxy_send(client_fd, PEER_DECLINE, PEER_FRAME_LEN) < 0)
+  {
+    from_peer = 0;
+  }
+  
+  /* Same cleanup for errors, timeouts and normal return */
+  if (timer_cancel(wheel, &timer))
+  {
+    from_peer = 0;     /* Shut down, nothing more can come */
+  }
+  if (server_fd >= 0)
+  {
+    Close(server_fd);
+  }
+  if (up != NULL)
+  {
+    origin_release(origins, up);
+  }
+  log_request(cache_id, status, sent, result, start);
+  
+  /* A peer's connection waits for its next request without a worker */
+  if (from_peer)
+  {
+    peer_park(peers, client_fd, conns);
+    return;
+  }
+  Close(client_fd);
   return;
 }
 
 
 
+/*
+ * signal_thread: waits for the signals blocked in main, SIGUSR2
+ * prints the origin, peer and cache tier metrics, SIGUSR1 dumps
+ * the cache, SIGTERM and SIGINT dump it, write out the access
+ * log and end the proxy
+ */
+void *signal_thread(void *vargp)
+{
+  char name[MAXLINE];
+  int sig, i;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    if (sigwait(&proxy_signals, &sig) != 0)
+    {
+      continue;
+    }
+    if (sig == SIGUSR2)
+    {
+      origin_report(origins, stderr);
+      if (peers != NULL)
+      {
+        peer_report(peers, stderr);
+      }
+      for (i = 0; i < nshards; i++)
+      {
+        if (nshards > 1)
+        {
+          fprintf(stderr, "shard %d:\n", i);
+        }
+        cache_report(shards[i].cache, stderr);
+      }
+      continue;
+    }
+    for (i = 0; snapshot_file != NULL && i < nshards; i++)
+    {
+      if (cache_save_snapshot(shards[i].cache, 
+                              snapshot_name(i, name, sizeof(name))) < 0)
+      {
+        fprintf(stderr, "Cache snapshot to %s failed\n", name);
+      }
+    }
+    if (sig != SIGUSR1)
+    {
+      log_flush_all();
+      exit(0);
+    }
+  }
+  return NULL;
+}
+
+
+
+/*
+ * proxy_send: write all of buf to fd with the worker's engine,
+ * returns -1 on error
+ */
+int proxy_send(int fd, void *buf, size_t len)
+{
+  if (ring != NULL)
+  {
+    return uring_send_all(ring, fd, buf, len);
+  }
+  return Rio_writen(fd, buf, len);
+}
+
+
+
+/*
+ * proxy_recv: read what is there (at most len) from fd with the 
+ * worker's engine, returns 0 on EOF and -1 on error
+ */
+ssize_t proxy_recv(int fd, void *buf, size_t len)
+{
+  ssize_t n;
+
+  if (ring != NULL)
+  {
+    return uring_recv(ring, fd, buf, len);
+  }
+  while ((n = recv(fd, buf, len, 0)) < 0 && errno == EINTR)
+  {
+    ;
+  }
+  return n;
+}
+
+
+
+/*
+ * proxy_sendv: write all of the iovecs to fd with the worker's
+ * engine, returns -1 on error
+ */
+int proxy_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t n;
+
+  if (ring != NULL)
+  {
+    return uring_sendv_all(ring, fd, iov, iovcnt);
+  }
+  while (iovcnt > 0)
+  {
+    if ((n = writev(fd, iov, iovcnt)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    /* Skip what went out, writev can stop anywhere */
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+
+
+/*
+ * proxy_open_server: connect to the server with the worker's engine,
+ * returns a negative value on error like Open_clientfd
+ */
+int proxy_open_server(char *host, char *port)
+{
+  if (ring != NULL)
+  {
+    return uring_open_clientfd(ring, host, port);
+  }
+  return Open_clientfd(host, port);
+}
+
+
+
 /* Echo: send the request to the server,
  * returns: 
  * (-1) on error
  * ( 0) when cache miss (forward to server)
  * ( 1) when cache hit
+ * ( 2) when a stale copy is served instead
+ * ( 3) when the proxy answers itself (PURGE), the answer is 
+ *      left in cache_data like a hit
+ * ( 4) when the peer owning the id sent it, left in cache_data
+ *
+ * On a miss a connection to the origin is taken from its limit
+ * first, *up is left set for serve to give back
+ *
+ * *from_peer is set if the request came from a peer proxy
  */
 int echo(int client_fd, int *server_fd, char *cache_id, 
-          unsigned int *cache_len, char *cache_data) 
+          unsigned int *cache_len, char *cache_data, origin **up,
+          int *from_peer) 
 {
   /* Variables used */
-  rio_t rio_client_fd;
   /* To send request                */
   char request_host[MAXLINE];   
   char request_port[MAXLINE];  
-  /* From file descriptor, to parse */ 
-  char uri[MAXBUF];       
+  /* From file descriptor, the whole request header, parsed
+     where it lies one line at a time */ 
+  char request[MAXBUF];
+  char *uri, *eol, *next, *request_end, saved;
+  /* For the Host header that has to be added */
+  char host_line[MAXLINE];
   /* To send request concatenate    */     
   char request_line[MAXBUF];   
+  size_t request_len = 0;
+  /* Sent after request_line, the headers from the rules */
+  struct iovec iov[2];
+  rewrite_rule *rule;
   /* Outputs form uri to be parsed  */
   char method[MAXLINE];        
   char protocol[MAXLINE];      
@@ -185,33 +811,57 @@ int echo(int client_fd, int *server_fd, char *cache_id,
   char http_version[MAXLINE];
   char url[MAXLINE];
   /* If no cache hit, need these originals */
-  char uri_first_line[MAXLINE];
   char host_header[MAXLINE];
   /* Valid bits set if header does have any of the 6 components */
   int host_bit = 0;
+  /* Set once the empty line ending the request has been read */
+  int end_bit = 0;
   /* To fix host port */
   char temp1[MAXLINE];        
   char temp2[MAXLINE];
   char temp3[MAXLINE];
   char *tmp = NULL;
+  /* Set if this request has to start the refresh of a stale hit */
+  int refresh = 0;
+  int hit;
+  /* To ask the peer owning the id, the request line is swapped for
+     one with the whole url and the mark */
+  size_t line_len;
+  char peer_line[MAXLINE];
+  struct iovec peer_iov[3];
+  peer *owner;
+  int n;
   
-  /* Setting strings */
-  memset(cache_data, 0, MAX_OBJECT_SIZE);
+  *from_peer = 0;
   
-  /* Initialise rio buffer for client file descriptor */
-  Rio_readinitb(&rio_client_fd, client_fd);
-  Rio_readlineb(&rio_client_fd, (void*)uri, (size_t)MAXBUF);
-  
-  /* Keep copy of first line from client_fd */
-  strcpy(uri_first_line, uri);
+  /* All of the request header, usually in one read */
+  if ((n = read_request(client_fd, request, sizeof(request))) < 0)
+  {
+    return -1;      /* Closed, too big, or shut down by the timeout */
+  }
+  request_end = request + n;
   
-  /* Parse the buffer from the client file descriptor */
+  /* Parse the request line, the headers start after it */
+  uri = request;
+  if ((eol = memchr(uri, '\n', request_end - uri)) == NULL)
+  {
+    return -1;
+  }
+  *eol = '\0';
+  next = eol + 1;
   if (parse_uri(uri, method, url, http_version, protocol, 
                 host_name, suffix, request_host, request_port) == -1) 
   {
     return -1;
   }
   
+  /* Admin request, taking nodes out of the cache */
+  if (strcmp(method, "PURGE") == 0)
+  {
+    return purge(client_fd, next, request_host, request_port, suffix,
+                 cache_id, cache_len, cache_data);
+  }
+  
   /* Check if GET method */
   if (strstr(method,"GET") == NULL)
   {
@@ -219,24 +869,52 @@ int echo(int client_fd, int *server_fd, char *cache_id,
   }
   else              /* GET method     */
   {
-    /* Need to concatenate the request line */
-    strcpy(request_line, method);
-    strcat(request_line, space_str);
-    strcat(request_line, suffix);
-    strcat(request_line, space_str);
-    strcat(request_line, http_version_str);
+    /* Need to concatenate the request line, request_len keeps
+       track of the end so nothing is scanned again */
+    if (append_str(request_line, &request_len, method, strlen(method)) < 0 ||
+        append_str(request_line, &request_len, space_str, 1) < 0 ||
+        append_str(request_line, &request_len, suffix, strlen(suffix)) < 0 ||
+        append_str(request_line, &request_len, space_str, 1) < 0 ||
+        append_str(request_line, &request_len, http_version_str, 
+                   strlen(http_version_str)) < 0)
+    {
+      return -1;     /* Request too big */
+    }
+    line_len = request_len;
     
 
-    /* Request Headers, iterate through the client_fd */
-    while (Rio_readlineb(&rio_client_fd, (void*)uri, (size_t)MAXBUF) != 0)
+    /* Request Headers, iterate through the buffer. Each line is
+       made a string (with its \r\n) by putting a '\0' after it
+       for as long as it is looked at */
+    for (uri = next; *uri != '\0'; uri = next)
     {
       /* Check end of file */
-      if (strcmp(uri, "\r\n") == 0)
+      if (strcmp(uri, end_str) == 0)
       {
+        end_bit = 1;
         break;   /* reached end of request by client */
       }
+      if ((eol = memchr(uri, '\n', request_end - uri)) == NULL)
+      {
+        return -1;
+      }
+      next = eol + 1;
+      saved = *next;
+      *next = '\0';
+      
+      /* One hash lookup on the name decides what to do */
+      rule = rewrite_lookup(rules, uri);
+      
+      /* Default for additional requests*/
+      if (rule == NULL)
+      {
+        if (append_str(request_line, &request_len, uri, next - uri) < 0)
+        {
+          return -1;     /* Request too big */
+        }
+      }
       /* Host header */
-      else if (strstr(uri, "Host:") != NULL)
+      else if (rule->action == REWRITE_HOST)
       {
         strcpy(host_header, uri);
         sscanf(uri, "Host: %s", host_header);
@@ -254,84 +932,337 @@ int echo(int client_fd, int *server_fd, char *cache_id,
         }
         strcpy(temp1, host_header);
  
-        sprintf(temp3, "Host: %s:%s\r\n", temp1, temp2);
-        strcat(request_line, temp3);
+        if (snprintf(temp3, sizeof(temp3), "Host: %s:%s\r\n", temp1,
+                     temp2) >= (int)sizeof(temp3) ||
+            append_str(request_line, &request_len, temp3, 
+                       strlen(temp3)) < 0)
+        {
+          return -1;     /* Request too big */
+        }
         
         
         host_bit = 1;
         strcpy(host_header, uri);
       }
-      /* User-Agent header */
-      else if (strstr(uri, "User-Agent:") != NULL)
-      {
-        continue;
-      }
-      /* Accept header */
-      else if (strstr(uri, "Accept:") != NULL)
-      {
-        continue;
-      }
-      /* Accept-Encoding header */
-      else if (strstr(uri, "Accept-Encoding:") != NULL)
+      /* Client's value swapped for the one in the rule */
+      else if (rule->action == REWRITE_REPLACE)
       {
-        continue;
-      }
-      /* Connection header */
-      else if (strstr(uri, "Connection:") != NULL)
-      {
-        continue;
+        if (append_str(request_line, &request_len, rule->line,
+                       rule->line_len) < 0)
+        {
+          return -1;
+        }
       }
-      /* Proxy-Connection header */
-      else if (strstr(uri, "Proxy-Connection:") != NULL)
+      /* Kept, our copy goes out with the rest of the rules */
+      else if (rule->action == REWRITE_ADD)
       {
-        continue;
+        if (append_str(request_line, &request_len, uri, next - uri) < 0)
+        {
+          return -1;
+        }
       }
-      /* Default for additional requests*/
-      else 
+      /* From a peer, never passed on */
+      else if (rule->action == REWRITE_PEER)
       {
-        strcat(request_line, uri);
+        *from_peer = (peers != NULL);
       }
+      /* User-Agent, Accept.. (set) and stripped headers are left out */
+      
+      *next = saved;
+    }
+    
+    /* Client went away or timed out before finishing the request */
+    if (end_bit == 0)
+    {
+      return -1;
     }
     
     /* Adding the 6 (at least 5) components not in uri */
     if (host_bit == 0)
     {
-      sprintf(uri, "Host: %s:%s\r\n", request_host, request_port);
-      strcat(request_line, uri);
+      if (snprintf(host_line, sizeof(host_line), "Host: %s:%s\r\n",
+                   request_host, request_port) >= (int)sizeof(host_line) ||
+          append_str(request_line, &request_len, host_line,
+                     strlen(host_line)) < 0)
+      {
+        return -1;     /* Request too big */
+      }
     }
 
-    strcat(request_line, user_agent_hdr);
-    strcat(request_line, accept_hdr);
-    strcat(request_line, accept_encoding_hdr);
-    strcat(request_line, connection_hdr);
-    strcat(request_line, proxy_connection_hdr);
-    /* End the request_line */
-    strcat(request_line, end_str);
+    /* User-Agent, Accept.. and the end of the request are the same
+       every time, prebuilt by rewrite_compile */
+    iov[0].iov_base = request_line;
+    iov[0].iov_len = request_len;
+    iov[1] = rules->suffix;
     
-    /* Make a cache id for this request & check cache for hit*/
-    strcpy(cache_id, uri_first_line);
-    if (proxy_read_from_cache(cache, cache_id, cache_data, cache_len)==0)
+    /* Make a cache id for this request & check cache for hit,
+     * same form as the prefetcher uses: http://host:port/suffix */
+    if (snprintf(cache_id, MAXLINE, "http://%s:%s%s", request_host,
+                 request_port, suffix) >= MAXLINE)
     {
-      return 1;      
+      return -1;     /* Url too long for an id */
+    }
+    if ((hit = proxy_read_from_cache(cache, cache_id, cache_data, cache_len,
+                                     stale_while_revalidate, &refresh)) >= 0)
+    {
+      /* Stale hit, client gets it now and one refresh runs behind */
+      if (refresh)
+      {
+        prefetch_refresh(cache, cache_id);
+      }
+      return 1 + hit;      
     }
     
-    /* Cache miss, open client_fd to connect to server */
-    *server_fd = Open_clientfd(request_host, request_port);
-    if (*server_fd < 0)
+    /* Miss on an id another proxy owns, ask it before the origin.
+       A peer's request is never passed on, the owner fetches it */
+    if (peers != NULL && !*from_peer && 
+        (owner = peer_owner(peers, cache_id)) != NULL)
     {
-      return -1;
+      snprintf(peer_line, sizeof(peer_line), 
+               "GET %s HTTP/1.0\r\n%s: %s\r\n", cache_id, PEER_MARK, 
+               peers->self->name);
+      peer_iov[0].iov_base = peer_line;
+      peer_iov[0].iov_len = strlen(peer_line);
+      peer_iov[1].iov_base = request_line + line_len;
+      peer_iov[1].iov_len = request_len - line_len;
+      peer_iov[2] = rules->suffix;
+      if ((n = peer_fetch(peers, owner, peer_iov, 3, cache_data, 
+                          MAX_OBJECT_SIZE)) >= 0)
+      {
+        *cache_len = n;
+        return 4;
+      }
     }
     
+    /* A peer's miss is only fetched if there is a serve slot and
+       an origin connection right away, else it is declined long
+       before the peer gives up (PEER_TIMEOUT_MS) */
+    if (*from_peer && peer_serve_begin(peers) < 0)
+    {
+      return -1;
+    }
     
-    if (Rio_writen(*server_fd, (void*)request_line, 
-        (size_t)strlen(request_line)) == -1)
+    /* Cache miss, wait for a turn at the origin, then open 
+       client_fd to connect to server */
+    *up = origin_acquire(origins, request_host, request_port, 
+                         *from_peer ? 0 : ORIGIN_WAIT_MS);
+    if (*up != NULL)
     {
+      *server_fd = proxy_open_server(request_host, request_port);
+    }
+    if ((*up == NULL) || (*server_fd < 0) || 
+        (proxy_sendv(*server_fd, iov, 2) == -1))
+    {
+      if (*from_peer)
+      {
+        peer_serve_end(peers);
+      }
+      /* Server is down or too busy, an older copy is better than nothing */
+      if (proxy_read_from_cache(cache, cache_id, cache_data, cache_len,
+                                stale_if_error, NULL) >= 0)
+      {
+        return 2;
+      }
       return -1;
     }
     return 0;
   }
 }
 
+/* purge: handles PURGE, from this machine only
+ * 1) PURGE http://host/path          takes out that url
+ * 2) PURGE http://host/path*         every url starting with it
+ * 3) with Surrogate-Key: tag1 tag2   every url whose response
+ *                                    was tagged with one of them
+ *
+ * headers are the request's header lines, already read in. The
+ * url is given as host, port and path, it is made into cache_id
+ * (MAXLINE bytes) only once the client is known to be local
+ *
+ * The response (200 with the count, 404 if nothing matched, 403
+ * from elsewhere) is put in cache_data
+ *
+ * returns -1 on error (an url too long for an id), 3 otherwise
+ */
+int purge(int client_fd, char *headers, char *host, char *port,
+          char *path, char *cache_id, unsigned int *cache_len,
+          char *cache_data)
+{
+  char tags[MAXBUF], list[MAXBUF], body[MAXLINE];
+  char *line, *eol, *tag, *save = NULL;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  int n = 0, local, len, prefix = 0, i;
+
+  /* Loopback only, anyone else could empty the cache */
+  local = (getpeername(client_fd, (SA *)&addr, &addrlen) == 0) &&
+          ((addr.ss_family == AF_INET && 
+            ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24 == 127) ||
+           (addr.ss_family == AF_INET6 && 
+            IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)&addr)->sin6_addr)));
+  if (!local)
+  {
+    *cache_len = sprintf(cache_data, "HTTP/1.0 403 Forbidden\r\n"
+                         "Content-Length: 0\r\n\r\n");
+    return 3;
+  }
+  if (snprintf(cache_id, MAXLINE, "http://%s:%s%s", host, port, 
+               path) >= MAXLINE)
+  {
+    return -1;
+  }
+
+  /* headers are the lines after the request line, up to the end */
+  tags[0] = '\0';
+  for (line = headers; (eol = index(line, '\n')) != NULL; line = eol + 1)
+  {
+    if (strncasecmp(line, "Surrogate-Key:", 14) == 0)
+    {
+      memcpy(tags, line + 14, eol - line - 14);
+      tags[eol - line - 14] = '\0';
+    }
+  }
+
+  if ((len = strlen(cache_id)) > 0 && cache_id[len - 1] == '*')
+  {
+    cache_id[len - 1] = '\0';
+    prefix = 1;
+  }
+  /* Every shard may have a copy */
+  for (i = 0; i < nshards; i++)
+  {
+    if (tags[0] != '\0')
+    {
+      strcpy(list, tags);     /* strtok_r cuts it up */
+      for (tag = strtok_r(list, " \t\r\n", &save); tag != NULL; 
+           tag = strtok_r(NULL, " \t\r\n", &save))
+      {
+        n += proxy_purge_tag(shards[i].cache, tag);
+      }
+    }
+    else if (prefix)
+    {
+      n += proxy_purge_prefix(shards[i].cache, cache_id);
+    }
+    else
+    {
+      n += proxy_purge(shards[i].cache, cache_id);
+    }
+  }
+
+  len = sprintf(body, "Purged %d\n", n);
+  *cache_len = sprintf(cache_data, "HTTP/1.0 %s\r\nContent-Length: %d\r\n"
+                       "Content-Type: text/plain\r\n\r\n%s", 
+                       n > 0 ? "200 OK" : "404 Not Found", len, body);
+  return 3;
+}
+
+
+
+/* read_request: read from fd into buf (size bytes) until it holds
+ * the whole request header, the empty line included. Each read
+ * takes whatever has arrived, only the new bytes are searched.
+ *
+ * buf is ended with a '\0' after the empty line, anything the
+ * client sent after it is dropped (HTTP/1.0, no body for GET)
+ *
+ * returns -1 on error, EOF, a header too big for buf or with a
+ * '\0' in it (the lines are parsed as strings), else the length
+ * of the header
+ */
+int read_request(int fd, char *buf, size_t size)
+{
+  size_t len = 0;
+  ssize_t n;
+  char *end;
+
+  while (len < size - 1)
+  {
+    if ((n = proxy_recv(fd, buf + len, size - 1 - len)) <= 0)
+    {
+      return -1;
+    }
+    /* The end can start up to 3 bytes back in the old data */
+    end = find_header_end(buf, len > 3 ? len - 3 : 0, len + n);
+    len += n;
+    if (end != NULL)
+    {
+      if (memchr(buf, '\0', end - buf) != NULL)
+      {
+        return -1;
+      }
+      *end = '\0';
+      return end - buf;
+    }
+  }
+  return -1;
+}
+
+
+
+/* find_header_end: look for "\r\n\r\n" in buf[from, len), 
+ * 16 positions at a time with SSE2
+ *
+ * returns the pointer just past it, NULL if it is not there
+ */
+char *find_header_end(char *buf, size_t from, size_t len)
+{
+  size_t i = from;
+#ifdef __SSE2__
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  __m128i m;
+  int mask;
+
+  /* Byte j of m is set if "\r\n\r\n" starts at i + j */
+  while (i + 19 <= len)
+  {
+    m = _mm_and_si128(
+          _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + i)), cr),
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + i + 1)), lf)),
+          _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + i + 2)), cr),
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + i + 3)), lf)));
+    if ((mask = _mm_movemask_epi8(m)) != 0)
+    {
+      return buf + i + __builtin_ctz(mask) + 4;
+    }
+    i += 16;
+  }
+#endif
+  /* What is left, or all of it without SSE2 */
+  for (; i + 4 <= len; i++)
+  {
+    if (memcmp(buf + i, "\r\n\r\n", 4) == 0)
+    {
+      return buf + i + 4;
+    }
+  }
+  return NULL;
+}
+
+
+
+/* append_str: copy n bytes of str to the end (*len) of buf,
+ * which holds MAXBUF, and move the end along
+ *
+ * returns -1 if it does not fit, 0 otherwise
+ */
+int append_str(char *buf, size_t *len, const char *str, size_t n)
+{
+  if (*len + n >= MAXBUF)
+  {
+    return -1;
+  }
+  memcpy(buf + *len, str, n);
+  *len += n;
+  buf[*len] = '\0';
+  return 0;
+}
+
+
+
 /* parse_uri: takes the request in form of a buffer
  * and parses into 3 ways:
  * 1) The uri       into  method, url and http_version
@@ -379,6 +1310,12 @@ int parse_uri(char *uri, char *method, char *url, char *http_version,
     strcpy(request_port, default_port_str);
   }
   strcpy(request_host, host_name);
+  
+  /* Host names are not case sensitive, ids of the same url match */
+  for (tmp = request_host; *tmp != '\0'; tmp++)
+  {
+    *tmp = tolower((unsigned char)*tmp);
+  }
 
   return 0;
 }
@@ -390,49 +1327,63 @@ int parse_uri(char *uri, char *method, char *url, char *http_version,
  *
  * also adds to cache if size is appropriate
  *
+ * Nothing more is read from the server until the last chunk has
+ * been written to the client, so a slow client pushes back on the
+ * server through TCP instead of piling up in the proxy.
+ * Every chunk pushes the idle timer back.
+ *
+ * The bytes relayed are left in *sent, even on error
+ *
  * returns -1 on error and 0 on normal success
  *
  */
-int write_to_cache(int client_fd, int server_fd, 
-                    void *cache_data, char *cache_id)
+int write_to_cache(int client_fd, int server_fd, void *cache_data, 
+                   char *cache_id, conn_timer *timer, unsigned long *sent)
 {
   /* Variables used */
   rio_t rio_server_fd;
-  /* For caching purposes */
-  unsigned int cache_len = 0;
+  /* For caching purposes, and the timer to push back */
+  relay_state state = { cache_data, 0, 1, timer, 0 };
   /* For server_fd */
   char server_fd_line[MAXLINE];
-  /* To check size acceptability */
-  ssize_t size_valid_bit = 1;
   ssize_t size=0;
 
-   
-  /*Initialize server_fd */
-  Rio_readinitb(&rio_server_fd, server_fd);
-  /* Reading from server_fd */
-  while ((size = Rio_readnb(&rio_server_fd, 
-         (void*)server_fd_line, (size_t)MAXBUF)) >0)
+  if (ring != NULL)   /* io_uring relays it all in one go */
   {
-    /* Preparing to cache it */
-    if (size_valid_bit)
-    {
-      size_valid_bit=add_data(cache_data, &cache_len, 
-      (unsigned int)size, server_fd_line, size_valid_bit);
-    }
-    /* Writing to server */
-    if (Rio_writen(client_fd, (void*)server_fd_line, (size_t)size) == -1)
+    size = uring_relay(ring, server_fd, client_fd, relay_chunk, &state);
+    state.sent = (size > 0) ? size : 0;
+  }
+  else
+  {
+    /*Initialize server_fd */
+    Rio_readinitb(&rio_server_fd, server_fd);
+    /* Reading from server_fd */
+    while ((size = Rio_readnb(&rio_server_fd, 
+           (void*)server_fd_line, (size_t)MAXBUF)) >0)
     {
-      return -1;
+      relay_chunk(&state, server_fd_line, (unsigned int)size);
+      /* Writing to server */
+      if (Rio_writen(client_fd, (void*)server_fd_line, (size_t)size) == -1)
+      {
+        size = -1;
+        break;
+      }
+      state.sent += size;
     }
   }
-  if (size == -1)
+  *sent = state.sent;
+  /* A timeout shows up as a short read, never cache that */
+  if ((size == -1) || timer_cancel(wheel, timer))
   {
     return -1;
   }
   /* Can be added to cache */
-  if (size_valid_bit)
+  if (state.size_valid_bit)
    {
-     if (proxy_write_to_cache(cache, cache_id, cache_data, cache_len) == -1)
+     /* Queue up the images, scripts.. of html pages */
+     prefetch_scan(cache, cache_id, cache_data, state.cache_len);
+     if (proxy_write_to_cache(cache, cache_id, cache_data, 
+                              state.cache_len) == -1)
      {
        return -1;
      }
@@ -443,12 +1394,36 @@ int write_to_cache(int client_fd, int server_fd,
 
 
 
+/*
+ * relay_chunk: called on every chunk from the server before
+ * it goes to the client, keeps a copy for the cache (while it
+ * still fits) and pushes the idle timer back
+ */
+int relay_chunk(void *vargp, char *buf, unsigned int len)
+{
+  relay_state *state = (relay_state *)vargp;
+
+  /* Preparing to cache it */
+  if (state->size_valid_bit)
+  {
+    state->size_valid_bit = add_data(state->cache_data, &state->cache_len, 
+                                     len, buf, state->size_valid_bit);
+  }
+  timer_touch(wheel, state->timer, idle_timeout);
+  return 0;
+}
+
+
+
 /*
  * add_data: updates the cache by copying server_fd_line 
  * to cache_data 
  * 
  *It also updates the total cache_len and sets valid bit to add to buffer
  *
+ * Nothing is copied once the object outgrows MAX_OBJECT_SIZE,
+ * cache_data is only that big
+ *
  */
 int add_data(char *cache_data, unsigned int *cache_len, 
          unsigned int len, char *server_fd_line, int valid)
@@ -461,7 +1436,7 @@ int add_data(char *cache_data, unsigned int *cache_len,
   }
   else 
   {
-    valid = 0;
+    return 0;
   }
   /* Done in terms of pointer addressing since local variable in 
      write_to_cache has to be updated as well */
@@ -470,3 +1445,80 @@ int add_data(char *cache_data, unsigned int *cache_len,
   *cache_len = *cache_len + len;
   return valid;
 }
+
+
+
+/*
+ * send_answer: send a response that is all in data, a peer gets
+ * it framed with its length
+ *
+ * returns -1 on error, 0 otherwise
+ */
+int send_answer(int fd, char *data, unsigned int len, int framed)
+{
+  char frame[PEER_FRAME_LEN + 1];
+  struct iovec iov[2];
+
+  if (!framed)
+  {
+    return proxy_send(fd, data, len);
+  }
+  sprintf(frame, PEER_FRAME, len);
+  iov[0].iov_base = frame;
+  iov[0].iov_len = PEER_FRAME_LEN;
+  iov[1].iov_base = data;
+  iov[1].iov_len = len;
+  return proxy_sendv(fd, iov, 2);
+}
+
+
+
+/*
+ * answer_peer: a peer's miss, read all of the response from the
+ * server, cache it and send it to the peer in one frame
+ *
+ * One that is too big for the cache (or cut short) is declined,
+ * the peer fetches it itself, so it is never stored twice.
+ *
+ * The bytes sent are left in *sent
+ *
+ * returns -1 if the peer could not be answered, 1 if declined, 
+ * 0 otherwise
+ */
+int answer_peer(int peer_fd, int server_fd, char *cache_data, 
+                char *cache_id, conn_timer *timer, unsigned long *sent)
+{
+  unsigned int len = 0;
+  ssize_t n = 0;
+  char extra;
+
+  *sent = 0;
+  while (len < MAX_OBJECT_SIZE && 
+         (n = proxy_recv(server_fd, cache_data + len, 
+                         MAX_OBJECT_SIZE - len)) > 0)
+  {
+    len += n;
+    timer_touch(wheel, timer, idle_timeout);
+  }
+  /* Full, but that may have been all of it */
+  if (len == MAX_OBJECT_SIZE)
+  {
+    n = proxy_recv(server_fd, &extra, 1);
+    n = (n == 0) ? 0 : -1;
+  }
+  /* A timeout shows up as a short read, never cache that */
+  if (n < 0 || timer_cancel(wheel, timer))
+  {
+    return proxy_send(peer_fd, PEER_DECLINE, PEER_FRAME_LEN) < 0 ? -1 : 1;
+  }
+  timer_arm(wheel, timer, idle_timeout);
+
+  prefetch_scan(cache, cache_id, cache_data, len);
+  proxy_write_to_cache(cache, cache_id, cache_data, len);
+  if (send_answer(peer_fd, cache_data, len, 1) < 0)
+  {
+    return -1;
+  }
+  *sent = len;
+  return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * radix.c: Radix tree from string keys to pointers
+ *
+ * Each edge holds a run of bytes, a node with one child and no
+ * value is merged with that child, so a key costs at most one
+ * node per place it differs from the others. Not thread safe,
+ * the caller locks.
+ *
+ */
+
+#include "radix.h"
+
+static radix_node *new_node(const char *label, int len, void *value);
+static radix_node *find_child(radix_node *node, char c);
+static void *remove_at(radix_node *parent, radix_node *node,
+                       const char *key);
+static int visit(radix_node *node, radix_fn fn, void *arg);
+
+
+
+/*
+ * init_radix: empty tree, and return the pointer to its root
+ */
+radix_node *init_radix()
+{
+  return new_node("", 0, NULL);
+}
+
+
+
+/*
+ * radix_insert: key now maps to value, replacing what it mapped to
+ */
+void radix_insert(radix_node *root, const char *key, void *value)
+{
+  radix_node *node = root, *c, *mid, **pp;
+  char *label;
+  int common;
+
+  while (*key != '\0')
+  {
+    if ((c = find_child(node, *key)) == NULL)
+    {
+      /* Nothing starts with this byte, new leaf */
+      c = new_node(key, strlen(key), value);
+      c->sibling = node->child;
+      node->child = c;
+      return;
+    }
+    for (common = 0; common < c->len && key[common] == c->label[common];
+         common++)
+    {
+      ;
+    }
+    if (common < c->len)
+    {
+      /* Key leaves the edge halfway, split it at that point */
+      mid = new_node(c->label, common, NULL);
+      for (pp = &node->child; *pp != c; pp = &(*pp)->sibling)
+      {
+        ;
+      }
+      mid->sibling = c->sibling;
+      *pp = mid;
+      label = (char *)Malloc(c->len - common + 1);
+      strcpy(label, c->label + common);
+      Free(c->label);
+      c->label = label;
+      c->len -= common;
+      c->sibling = NULL;
+      mid->child = c;
+      c = mid;
+    }
+    node = c;
+    key += common;
+  }
+  node->value = value;
+}
+
+
+
+/*
+ * radix_lookup: value for key, NULL if there is none
+ */
+void *radix_lookup(radix_node *root, const char *key)
+{
+  radix_node *node = root;
+
+  while (*key != '\0')
+  {
+    if ((node = find_child(node, *key)) == NULL ||
+        strncmp(key, node->label, node->len) != 0)
+    {
+      return NULL;
+    }
+    key += node->len;
+  }
+  return node->value;
+}
+
+
+
+/*
+ * radix_remove: take key out of the tree,
+ * returns the value it had or NULL
+ */
+void *radix_remove(radix_node *root, const char *key)
+{
+  return remove_at(NULL, root, key);
+}
+
+
+
+/*
+ * radix_collect: call fn on the value of every key that starts
+ * with prefix, returns how many there were
+ */
+int radix_collect(radix_node *root, const char *prefix,
+                  radix_fn fn, void *arg)
+{
+  radix_node *node = root;
+  int n;
+
+  while (*prefix != '\0')
+  {
+    if ((node = find_child(node, *prefix)) == NULL)
+    {
+      return 0;
+    }
+    n = strlen(prefix);
+    if (n <= node->len)
+    {
+      /* Prefix ends on this edge, all below it match */
+      return (strncmp(prefix, node->label, n) == 0) ?
+             visit(node, fn, arg) : 0;
+    }
+    if (strncmp(prefix, node->label, node->len) != 0)
+    {
+      return 0;
+    }
+    prefix += node->len;
+  }
+  return visit(node, fn, arg);
+}
+
+
+
+/*
+ * remove_at: remove key (the rest of it) from under node, then
+ * tidy node up: free it if it is left empty, merge it with its
+ * child if it is left with just one
+ */
+static void *remove_at(radix_node *parent, radix_node *node,
+                       const char *key)
+{
+  radix_node *c, **pp;
+  void *value;
+  char *label;
+
+  if (*key == '\0')
+  {
+    value = node->value;
+    node->value = NULL;
+  }
+  else
+  {
+    if ((c = find_child(node, *key)) == NULL ||
+        strncmp(key, c->label, c->len) != 0)
+    {
+      return NULL;
+    }
+    value = remove_at(node, c, key + c->len);
+  }
+
+  if (parent == NULL || node->value != NULL)
+  {
+    return value;         /* Root, or still a key of its own */
+  }
+  if (node->child == NULL)
+  {
+    for (pp = &parent->child; *pp != node; pp = &(*pp)->sibling)
+    {
+      ;
+    }
+    *pp = node->sibling;
+    Free(node->label);
+    Free(node);
+  }
+  else if (node->child->sibling == NULL)
+  {
+    c = node->child;
+    label = (char *)Malloc(node->len + c->len + 1);
+    memcpy(label, node->label, node->len);
+    strcpy(label + node->len, c->label);
+    Free(node->label);
+    node->label = label;
+    node->len += c->len;
+    node->value = c->value;
+    node->child = c->child;
+    Free(c->label);
+    Free(c);
+  }
+  return value;
+}
+
+
+
+/*
+ * new_node: node for the first len bytes of label
+ */
+static radix_node *new_node(const char *label, int len, void *value)
+{
+  radix_node *node = (radix_node *)Malloc(sizeof(radix_node));
+
+  node->label = (char *)Malloc(len + 1);
+  memcpy(node->label, label, len);
+  node->label[len] = '\0';
+  node->len = len;
+  node->value = value;
+  node->child = NULL;
+  node->sibling = NULL;
+  return node;
+}
+
+
+
+/*
+ * find_child: child of node whose edge starts with c
+ */
+static radix_node *find_child(radix_node *node, char c)
+{
+  radix_node *child;
+
+  for (child = node->child; child != NULL; child = child->sibling)
+  {
+    if (child->label[0] == c)
+    {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+
+
+/*
+ * visit: call fn on every value at or below node
+ */
+static int visit(radix_node *node, radix_fn fn, void *arg)
+{
+  radix_node *child;
+  int n = 0;
+
+  if (node->value != NULL)
+  {
+    fn(arg, node->value);
+    n++;
+  }
+  for (child = node->child; child != NULL; child = child->sibling)
+  {
+    n += visit(child, fn, arg);
+  }
+  return n;
+}
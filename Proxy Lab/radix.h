@@ -0,0 +1,36 @@
+/*
+ * radix.h: header file for radix.c
+ *
+ * Radix tree (compressed trie) from string keys to pointers,
+ * the cache uses it to find ids by exact key and by prefix.
+ *
+ */
+
+#ifndef __RADIX_H__
+#define __RADIX_H__
+
+#include "csapp.h"
+
+/* Children of a node start with different bytes */
+typedef struct radix_node
+{
+  char *label;               /* Bytes on the edge into this node */
+  int len;
+  void *value;               /* NULL if no key ends here */
+  struct radix_node *child;  /* First child */
+  struct radix_node *sibling;
+} radix_node;
+
+/* Called for every value found under a prefix */
+typedef void (*radix_fn)(void *arg, void *value);
+
+
+/* Function prototypes */
+radix_node *init_radix();
+void radix_insert(radix_node *root, const char *key, void *value);
+void *radix_lookup(radix_node *root, const char *key);
+void *radix_remove(radix_node *root, const char *key);
+int radix_collect(radix_node *root, const char *prefix,
+                  radix_fn fn, void *arg);
+
+#endif /* __RADIX_H__ */
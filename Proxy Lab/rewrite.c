@@ -0,0 +1,290 @@
+/*
+ * rewrite.c: Request header rewriting for the proxy
+ *
+ * Rules say what happens to a header by name (set, add, strip,
+ * replace), they come from the defaults in proxy.c and optionally
+ * a rules file. Once all the rules are in, rewrite_compile
+ * 1) searches for a hash seed under which no two rule names
+ *    collide, so looking up a client header is one hash and one
+ *    compare instead of trying every name in turn
+ * 2) lays out all the headers the proxy always sends, plus the
+ *    empty line ending the request, in one block that is sent
+ *    as is after the per-request part.
+ *
+ * Rules file, one rule per line, '#' starts a comment:
+ *   set Name: value       drop the client's header, always send this
+ *   add Name: value       keep the client's header, also send this
+ *   replace Name: value   send this instead, only if the client sent it
+ *   strip Name            drop the client's header
+ *   keep Name             undo an earlier (or default) rule
+ *
+ */
+
+#include "rewrite.h"
+
+static unsigned int hash_name(const char *name, int len, unsigned int seed);
+static int name_length(const char *line);
+
+
+
+/*
+ * init_rewrite_table: empty table, and return the pointer to it
+ */
+rewrite_table *init_rewrite_table()
+{
+  rewrite_table *table = (rewrite_table *)Calloc(1, sizeof(rewrite_table));
+  table->nrules = 0;
+  return table;
+}
+
+
+
+/*
+ * rewrite_add_rule: add a rule for header ("Name: value\r\n", or
+ * just "Name" for strip, host and keep). A later rule for the same
+ * name takes the place of the earlier one, action 0 (keep) removes it.
+ *
+ * Returns -1 on error, 0 on success
+ */
+int rewrite_add_rule(rewrite_table *table, int action, const char *header)
+{
+  int len = name_length(header);
+  int i;
+  rewrite_rule *rule;
+
+  if (len <= 0 || len >= REWRITE_NAME_LEN)
+  {
+    return -1;
+  }
+  if ((action == REWRITE_SET || action == REWRITE_ADD ||
+       action == REWRITE_REPLACE) && index(header, ':') == NULL)
+  {
+    return -1;   /* Needs a value */
+  }
+
+  /* Same name as an earlier rule */
+  for (i = 0; i < table->nrules; i++)
+  {
+    if (table->rules[i].name_len == len &&
+        strncasecmp(table->rules[i].name, header, len) == 0)
+    {
+      break;
+    }
+  }
+  if (i == table->nrules)
+  {
+    if (action == 0)
+    {
+      return 0;
+    }
+    if (table->nrules == REWRITE_MAX_RULES)
+    {
+      return -1;
+    }
+    table->nrules++;
+  }
+  rule = &table->rules[i];
+  if (rule->line != NULL)
+  {
+    Free(rule->line);
+    rule->line = NULL;
+  }
+  if (action == 0)
+  {
+    /* Keep: move the last rule into the hole */
+    *rule = table->rules[--table->nrules];
+    memset(&table->rules[table->nrules], 0, sizeof(rewrite_rule));
+    return 0;
+  }
+
+  rule->action = action;
+  memcpy(rule->name, header, len);
+  rule->name[len] = '\0';
+  rule->name_len = len;
+  rule->line_len = 0;
+  if (action == REWRITE_SET || action == REWRITE_ADD ||
+      action == REWRITE_REPLACE)
+  {
+    rule->line_len = strlen(header);
+    rule->line = (char *)Malloc(rule->line_len + 1);
+    strcpy(rule->line, header);
+  }
+  return 0;
+}
+
+
+
+/*
+ * rewrite_load_rules: add the rules in filename on top of the
+ * ones already in the table
+ *
+ * Returns -1 on error (the line is reported), 0 on success
+ */
+int rewrite_load_rules(rewrite_table *table, char *filename)
+{
+  FILE *fp;
+  char line[MAXLINE], word[MAXLINE], header[MAXLINE];
+  char *p;
+  int lineno = 0, action, n;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+  {
+    fprintf(stderr, "rewrite: cannot open %s\n", filename);
+    return -1;
+  }
+  while (fgets(line, sizeof(line) - 2, fp) != NULL)
+  {
+    lineno++;
+    if ((p = index(line, '#')) != NULL)
+    {
+      *p = '\0';
+    }
+    if (sscanf(line, "%s %n", word, &n) != 1)
+    {
+      continue;      /* Blank line */
+    }
+
+    /* The header is the rest of the line, sent with \r\n */
+    strcpy(header, line + n);
+    p = header + strlen(header);
+    while (p > header && isspace((unsigned char)p[-1]))
+    {
+      p--;
+    }
+    strcpy(p, "\r\n");
+
+    if (strcasecmp(word, "set") == 0)           action = REWRITE_SET;
+    else if (strcasecmp(word, "add") == 0)      action = REWRITE_ADD;
+    else if (strcasecmp(word, "strip") == 0)    action = REWRITE_STRIP;
+    else if (strcasecmp(word, "replace") == 0)  action = REWRITE_REPLACE;
+    else if (strcasecmp(word, "keep") == 0)     action = 0;
+    else                                        action = -1;
+
+    if (action < 0 || rewrite_add_rule(table, action, header) < 0)
+    {
+      fprintf(stderr, "rewrite: %s:%d: bad rule\n", filename, lineno);
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+
+/*
+ * rewrite_compile: find a collision free seed for the rule names
+ * and build the block of headers sent with every request
+ *
+ * Returns -1 on error (block too big), 0 on success
+ */
+int rewrite_compile(rewrite_table *table)
+{
+  int i, len = 0;
+  unsigned int h;
+  rewrite_rule *rule;
+
+  /* Seed search, with 4x more slots than rules it ends quickly */
+  for (table->seed = 1; ; table->seed++)
+  {
+    memset(table->slots, -1, sizeof(table->slots));
+    for (i = 0; i < table->nrules; i++)
+    {
+      rule = &table->rules[i];
+      h = hash_name(rule->name, rule->name_len, table->seed);
+      if (table->slots[h] != -1)
+      {
+        break;
+      }
+      table->slots[h] = i;
+    }
+    if (i == table->nrules)
+    {
+      break;
+    }
+  }
+
+  /* The constant part of every request */
+  for (i = 0; i < table->nrules; i++)
+  {
+    rule = &table->rules[i];
+    if (rule->action != REWRITE_SET && rule->action != REWRITE_ADD)
+    {
+      continue;
+    }
+    if (len + rule->line_len + 3 > (int)sizeof(table->block))
+    {
+      return -1;
+    }
+    memcpy(table->block + len, rule->line, rule->line_len);
+    len += rule->line_len;
+  }
+  memcpy(table->block + len, "\r\n", 3);
+  table->suffix.iov_base = table->block;
+  table->suffix.iov_len = len + 2;
+  return 0;
+}
+
+
+
+/*
+ * rewrite_lookup: rule for the header on line ("Name: value\r\n"),
+ * or NULL if it goes through untouched
+ */
+rewrite_rule *rewrite_lookup(rewrite_table *table, char *line)
+{
+  int len = name_length(line);
+  int i;
+
+  if (len <= 0 || len >= REWRITE_NAME_LEN || line[len] != ':')
+  {
+    return NULL;
+  }
+  i = table->slots[hash_name(line, len, table->seed)];
+  if (i < 0 || table->rules[i].name_len != len ||
+      strncasecmp(table->rules[i].name, line, len) != 0)
+  {
+    return NULL;
+  }
+  return &table->rules[i];
+}
+
+
+
+/*
+ * hash_name: FNV-1a of the lowercased name, mixed with the seed,
+ * reduced to a slot
+ */
+static unsigned int hash_name(const char *name, int len, unsigned int seed)
+{
+  unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)tolower((unsigned char)name[i]);
+    h *= 16777619u;
+  }
+  h ^= h >> 15;
+  return h & (REWRITE_SLOTS - 1);
+}
+
+
+
+/*
+ * name_length: length of the header name at the start of line,
+ * up to the ':' (or the end of a bare name)
+ */
+static int name_length(const char *line)
+{
+  int len = 0;
+
+  while (line[len] != '\0' && line[len] != ':' &&
+         line[len] != '\r' && line[len] != '\n' &&
+         !isspace((unsigned char)line[len]))
+  {
+    len++;
+  }
+  return len;
+}
@@ -0,0 +1,57 @@
+/*
+ * rewrite.h: header file for rewrite.c
+ *
+ * Table of request header rewrite rules, compiled once at
+ * startup into a perfect hash on the header name and a
+ * prebuilt block of the headers the proxy always sends.
+ *
+ */
+
+#ifndef __REWRITE_H__
+#define __REWRITE_H__
+
+#include "csapp.h"
+#include <sys/uio.h>
+
+#define REWRITE_MAX_RULES 32
+#define REWRITE_SLOTS 128      /* Power of 2, a few times the rules   */
+#define REWRITE_NAME_LEN 64    /* Longest header name a rule can have */
+
+/* What to do with a header */
+#define REWRITE_SET     1      /* Drop the client's, always send ours */
+#define REWRITE_ADD     2      /* Keep the client's, also send ours   */
+#define REWRITE_STRIP   3      /* Drop the client's                   */
+#define REWRITE_REPLACE 4      /* Swap the value if the client sent it */
+#define REWRITE_HOST    5      /* Host, rebuilt by the proxy           */
+#define REWRITE_PEER    6      /* Marks a peer's request, not forwarded */
+
+typedef struct rewrite_rule
+{
+  int action;
+  char name[REWRITE_NAME_LEN];
+  int name_len;
+  char *line;          /* "Name: value\r\n", NULL for strip/host/peer */
+  int line_len;
+} rewrite_rule;
+
+typedef struct rewrite_table
+{
+  rewrite_rule rules[REWRITE_MAX_RULES];
+  int nrules;
+  /* Perfect hash: slots[hash(name, seed)] is the rule index or -1 */
+  unsigned int seed;
+  signed char slots[REWRITE_SLOTS];
+  /* Headers sent with every request, ending with the empty line */
+  char block[MAXBUF];
+  struct iovec suffix;
+} rewrite_table;
+
+
+/* Function prototypes */
+rewrite_table *init_rewrite_table();
+int rewrite_add_rule(rewrite_table *table, int action, const char *header);
+int rewrite_load_rules(rewrite_table *table, char *filename);
+int rewrite_compile(rewrite_table *table);
+rewrite_rule *rewrite_lookup(rewrite_table *table, char *line);
+
+#endif /* __REWRITE_H__ */
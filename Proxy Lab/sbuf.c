@@ -0,0 +1,64 @@
+/*
+ * sbuf.c: Bounded buffer used to hand connections from
+ * the accepting thread to the worker threads
+ *
+ * Same as the textbook version (page 1040)
+ *
+ */
+
+#include "sbuf.h"
+
+
+
+/*
+ * sbuf_init: Create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;                       /* Buffer holds max of n items */
+  sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+  Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+  Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+  Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+}
+
+
+
+/*
+ * sbuf_deinit: Clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp)
+{
+  Free(sp->buf);
+}
+
+
+
+/*
+ * sbuf_insert: Insert item onto the rear of shared buffer sp
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+  P(&sp->slots);                           /* Wait for available slot */
+  P(&sp->mutex);                           /* Lock the buffer */
+  sp->buf[(++sp->rear) % (sp->n)] = item;  /* Insert the item */
+  V(&sp->mutex);                           /* Unlock the buffer */
+  V(&sp->items);                           /* Announce available item */
+}
+
+
+
+/*
+ * sbuf_remove: Remove and return the first item from buffer sp
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+  int item;
+  P(&sp->items);                           /* Wait for available item */
+  P(&sp->mutex);                           /* Lock the buffer */
+  item = sp->buf[(++sp->front) % (sp->n)]; /* Remove the item */
+  V(&sp->mutex);                           /* Unlock the buffer */
+  V(&sp->slots);                           /* Announce available slot */
+  return item;
+}
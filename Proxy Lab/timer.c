@@ -0,0 +1,246 @@
+/*
+ * timer.c: A timer wheel for the proxy
+ *
+ * Every connection thread arms a conn_timer before it blocks
+ * on a socket. A single wheel thread advances one slot every
+ * WHEEL_TICK_MS, and when a timer in that slot runs out it
+ * shuts down the sockets of the connection.
+ *
+ * The shutdown wakes up the thread blocked in read/write, which
+ * then sees EOF or EPIPE and cleans up as on any other error.
+ *
+ * Timers are re-armed whenever the connection makes progress,
+ * so an idle timeout is just a timer that keeps getting pushed back.
+ *
+ */
+
+#include "timer.h"
+
+static void *timer_thread(void *vargp);
+static void unlink_timer(timer_wheel *wheel, conn_timer *timer);
+
+
+
+/*
+ * init_timer_wheel: initialize the wheel, start the thread
+ * that drives it and return the pointer to the wheel
+ */
+timer_wheel *init_timer_wheel()
+{
+  pthread_t tid;
+  int i;
+  timer_wheel *wheel = (timer_wheel *)Malloc(sizeof(timer_wheel));
+
+  for (i = 0; i < WHEEL_SLOTS; i++)
+  {
+    wheel->slots[i] = NULL;
+  }
+  wheel->current = 0;
+  Sem_init(&wheel->mutex, 0, 1);
+
+  Pthread_create(&tid, NULL, timer_thread, (void *)wheel);
+  return wheel;
+}
+
+
+
+/*
+ * timer_now_ms: monotonic clock in milliseconds
+ */
+long timer_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+/*
+ * init_conn_timer: set up a timer for a new client connection,
+ * it is not in the wheel until timer_arm is called
+ */
+void init_conn_timer(conn_timer *timer, int client_fd)
+{
+  timer->client_fd = client_fd;
+  timer->server_fd = -1;
+  timer->slot = -1;
+  timer->rounds = 0;
+  timer->fired = 0;
+  timer->deadline = 0;
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+
+
+/*
+ * timer_watch_fd: also shut down the server socket when
+ * the timer fires
+ */
+void timer_watch_fd(timer_wheel *wheel, conn_timer *timer, int server_fd)
+{
+  P(&wheel->mutex);
+  timer->server_fd = server_fd;
+  V(&wheel->mutex);
+}
+
+
+
+/*
+ * timer_set_deadline: put an absolute limit ms from now, which
+ * timer_touch will never push the timer beyond
+ */
+void timer_set_deadline(conn_timer *timer, unsigned int ms)
+{
+  timer->deadline = timer_now_ms() + ms;
+}
+
+
+
+/*
+ * timer_arm: (re)insert the timer so it fires ms from now.
+ *
+ * A timer that has already fired stays fired, the thread
+ * will find out from its next read/write
+ */
+void timer_arm(timer_wheel *wheel, conn_timer *timer, unsigned int ms)
+{
+  unsigned int ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+  if (ticks == 0)
+  {
+    ticks = 1;
+  }
+
+  P(&wheel->mutex);
+  if (timer->fired)
+  {
+    V(&wheel->mutex);
+    return;
+  }
+  if (timer->slot >= 0)
+  {
+    unlink_timer(wheel, timer);
+  }
+
+  /* Slot is visited every WHEEL_SLOTS ticks, so count whole rounds */
+  timer->slot = (wheel->current + ticks) % WHEEL_SLOTS;
+  timer->rounds = (ticks - 1) / WHEEL_SLOTS;
+  timer->prev = NULL;
+  timer->next = wheel->slots[timer->slot];
+  if (timer->next != NULL)
+  {
+    timer->next->prev = timer;
+  }
+  wheel->slots[timer->slot] = timer;
+  V(&wheel->mutex);
+}
+
+
+
+/*
+ * timer_touch: the connection made progress, push the timer
+ * back by idle_ms but never past its deadline
+ */
+void timer_touch(timer_wheel *wheel, conn_timer *timer, unsigned int idle_ms)
+{
+  long left;
+
+  if (timer->deadline != 0)
+  {
+    left = timer->deadline - timer_now_ms();
+    if (left < (long)idle_ms)
+    {
+      idle_ms = (left > 0) ? (unsigned int)left : 1;
+    }
+  }
+  timer_arm(wheel, timer, idle_ms);
+}
+
+
+
+/*
+ * timer_cancel: take the timer out of the wheel.
+ *
+ * Must be called before the fds are closed, otherwise the wheel
+ * could shut down an fd number that has been reused.
+ *
+ * Returns 1 if the timer had already fired, else 0
+ */
+int timer_cancel(timer_wheel *wheel, conn_timer *timer)
+{
+  int fired;
+
+  P(&wheel->mutex);
+  if (timer->slot >= 0)
+  {
+    unlink_timer(wheel, timer);
+  }
+  fired = timer->fired;
+  V(&wheel->mutex);
+  return fired;
+}
+
+
+
+/*
+ * unlink_timer: remove the timer from its slot, wheel->mutex held
+ */
+static void unlink_timer(timer_wheel *wheel, conn_timer *timer)
+{
+  if (timer->prev != NULL)
+  {
+    timer->prev->next = timer->next;
+  }
+  else
+  {
+    wheel->slots[timer->slot] = timer->next;
+  }
+  if (timer->next != NULL)
+  {
+    timer->next->prev = timer->prev;
+  }
+  timer->prev = timer->next = NULL;
+  timer->slot = -1;
+}
+
+
+
+/*
+ * timer_thread: advance the wheel one slot per tick and fire
+ * the timers whose rounds have run out
+ */
+static void *timer_thread(void *vargp)
+{
+  timer_wheel *wheel = (timer_wheel *)vargp;
+  conn_timer *timer, *next;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    usleep(WHEEL_TICK_MS * 1000);
+
+    P(&wheel->mutex);
+    wheel->current = (wheel->current + 1) % WHEEL_SLOTS;
+    for (timer = wheel->slots[wheel->current]; timer != NULL; timer = next)
+    {
+      next = timer->next;
+      if (timer->rounds > 0)
+      {
+        timer->rounds--;
+        continue;
+      }
+      /* Expired, wake up the thread blocked on these sockets */
+      unlink_timer(wheel, timer);
+      timer->fired = 1;
+      shutdown(timer->client_fd, SHUT_RDWR);
+      if (timer->server_fd >= 0)
+      {
+        shutdown(timer->server_fd, SHUT_RDWR);
+      }
+    }
+    V(&wheel->mutex);
+  }
+  return NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * timer.h: header file for timer.c
+ *
+ * A hashed timer wheel that puts deadlines on the
+ * connections handled by the proxy threads.
+ *
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "csapp.h"
+
+/* One revolution of the wheel is WHEEL_SLOTS * WHEEL_TICK_MS */
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_MS 250
+
+/* A timer lives on the stack of the thread serving the connection */
+typedef struct conn_timer
+{
+  int client_fd;
+  int server_fd;            /* -1 until the server is connected */
+  int slot;                 /* -1 when not in the wheel */
+  unsigned int rounds;      /* Revolutions left before it fires */
+  int fired;                /* Set once the fds have been shut down */
+  long deadline;            /* Absolute limit in ms, 0 if none */
+  struct conn_timer *prev;
+  struct conn_timer *next;
+} conn_timer;
+
+typedef struct timer_wheel
+{
+  conn_timer *slots[WHEEL_SLOTS];
+  int current;
+  sem_t mutex;
+} timer_wheel;
+
+
+/* Function prototypes */
+
+/* Dealing with the wheel */
+timer_wheel *init_timer_wheel();
+long timer_now_ms();
+
+/* Dealing with individual timers */
+void init_conn_timer(conn_timer *timer, int client_fd);
+void timer_watch_fd(timer_wheel *wheel, conn_timer *timer, int server_fd);
+void timer_set_deadline(conn_timer *timer, unsigned int ms);
+void timer_arm(timer_wheel *wheel, conn_timer *timer, unsigned int ms);
+void timer_touch(timer_wheel *wheel, conn_timer *timer, unsigned int idle_ms);
+int timer_cancel(timer_wheel *wheel, conn_timer *timer);
+
+#endif /* __TIMER_H__ */
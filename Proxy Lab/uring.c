@@ -0,0 +1,621 @@
+/*
+ * uring.c: io_uring I/O engine for the proxy
+ *
+ * Every worker thread owns a ring with a small pool of registered
+ * buffers, and the main thread owns one for accepting.
+ *
+ * The calls look blocking to the proxy code (submit, then wait for
+ * the completion), the gain is in batching:
+ * - uring_relay submits the send of one chunk to the client and the
+ *   read of the next chunk from the server in a single io_uring_enter,
+ *   both on registered buffers, so they overlap and the kernel does
+ *   not have to look up and pin the buffer pages on every call.
+ * - the main thread keeps URING_ACCEPTS accepts in flight and picks
+ *   up every connection that arrived with one io_uring_enter.
+ *
+ * The timer wheel still works, a shutdown on the socket completes
+ * the pending operation like it wakes up a blocked read.
+ *
+ * A ring whose io_uring_enter fails is torn down (uring_free), since
+ * an operation still in flight would complete into the next wait.
+ * Every call on it fails from then on, until it is set up again.
+ *
+ */
+
+#include "uring.h"
+#include <sys/syscall.h>
+
+/* user_data of the operations in flight */
+#define OP_RECV    1
+#define OP_SEND    2
+#define OP_ACCEPT  3
+#define OP_CONNECT 4
+
+static struct io_uring_sqe *uring_get_sqe(uring *ring);
+static unsigned uring_sq_room(uring *ring);
+static int uring_enter(uring *ring, unsigned wait_nr);
+static int uring_reap(uring *ring, struct io_uring_cqe *out, int max);
+static int uring_wait(uring *ring, struct io_uring_cqe *out, int want);
+static int uring_send_fixed(uring *ring, int fd, int index,
+                            char *buf, size_t len);
+
+
+
+/*
+ * uring_init: set up a ring with entries slots and bufs registered
+ * buffers, return -1 on error (no io_uring in this kernel...)
+ */
+int uring_init(uring *ring, unsigned entries, int bufs)
+{
+  struct io_uring_params p;
+  struct iovec iov[URING_BUFS];
+  int i;
+
+  memset(ring, 0, sizeof(uring));
+  memset(&p, 0, sizeof(p));
+  if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+  {
+    return -1;
+  }
+
+  /* Map the two queues, they can share one mapping on newer kernels */
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_len > ring->sq_len)
+    {
+      ring->sq_len = ring->cq_len;
+    }
+    ring->cq_len = ring->sq_len;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+  {
+    close(ring->fd);
+    return -1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    ring->cq_ptr = ring->sq_ptr;
+  }
+  else
+  {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    uring_free(ring);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+  /* The buffer pool, registered once so the kernel keeps it mapped */
+  if (bufs > 0)
+  {
+    ring->bufs = mmap(NULL, (size_t)bufs * URING_BUF_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED)
+    {
+      ring->bufs = NULL;
+      uring_free(ring);
+      return -1;
+    }
+    for (i = 0; i < bufs; i++)
+    {
+      iov[i].iov_base = ring->bufs + (size_t)i * URING_BUF_SIZE;
+      iov[i].iov_len = URING_BUF_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd,
+                IORING_REGISTER_BUFFERS, iov, bufs) < 0)
+    {
+      uring_free(ring);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+/*
+ * uring_free: tear down the ring and its buffers
+ */
+void uring_free(uring *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+  {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED &&
+      ring->cq_ptr != ring->sq_ptr)
+  {
+    munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+  {
+    munmap(ring->sq_ptr, ring->sq_len);
+  }
+  if (ring->bufs != NULL)
+  {
+    munmap(ring->bufs, (size_t)URING_BUFS * URING_BUF_SIZE);
+  }
+  close(ring->fd);
+  memset(ring, 0, sizeof(uring));
+  ring->fd = -1;
+}
+
+
+
+/*
+ * uring_recv: receive up to len bytes, like read(2)
+ */
+ssize_t uring_recv(uring *ring, int fd, void *buf, size_t len)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+  {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->user_data = OP_RECV;
+  if (uring_wait(ring, &cqe, 1) < 0)
+  {
+    return -1;
+  }
+  if (cqe.res < 0)
+  {
+    errno = -cqe.res;
+    return -1;
+  }
+  return cqe.res;
+}
+
+
+
+/*
+ * uring_send_all: send all len bytes, returns -1 on error
+ * (EPIPE is not raised as a signal, same as the modified rio)
+ */
+int uring_send_all(uring *ring, int fd, void *buf, size_t len)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+  char *bufp = (char *)buf;
+
+  while (len > 0)
+  {
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)bufp;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = OP_SEND;
+    if (uring_wait(ring, &cqe, 1) < 0)
+    {
+      return -1;
+    }
+    if (cqe.res <= 0)
+    {
+      errno = (cqe.res < 0) ? -cqe.res : EPIPE;
+      return -1;
+    }
+    bufp += cqe.res;
+    len -= cqe.res;
+  }
+  return 0;
+}
+
+
+
+/*
+ * uring_sendv_all: send all of the iovecs with one sendmsg,
+ * more only if it comes up short. iov is updated as it goes.
+ */
+int uring_sendv_all(uring *ring, int fd, struct iovec *iov, int iovcnt)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+  struct msghdr msg;
+  size_t n;
+
+  while (iovcnt > 0)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = OP_SEND;
+    if (uring_wait(ring, &cqe, 1) < 0 || cqe.res <= 0)
+    {
+      return -1;
+    }
+    /* Skip what went out */
+    n = cqe.res;
+    while (iovcnt > 0 && n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+
+
+/*
+ * uring_open_clientfd: same as open_clientfd in csapp.c,
+ * with the connect going through the ring
+ */
+int uring_open_clientfd(uring *ring, char *hostname, char *port)
+{
+  int clientfd = -1;
+  struct addrinfo hints, *listp, *p;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(hostname, port, &hints, &listp) != 0)
+  {
+    return -2;
+  }
+
+  /* Walk the list for one that we can successfully connect to */
+  for (p = listp; p; p = p->ai_next)
+  {
+    if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+    {
+      continue;
+    }
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+      close(clientfd);
+      freeaddrinfo(listp);
+      return -1;
+    }
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = clientfd;
+    sqe->addr = (unsigned long)p->ai_addr;
+    sqe->off = p->ai_addrlen;
+    sqe->user_data = OP_CONNECT;
+    if (uring_wait(ring, &cqe, 1) == 1 && cqe.res == 0)
+    {
+      break;
+    }
+    close(clientfd);
+  }
+  freeaddrinfo(listp);
+  return (p == NULL) ? -1 : clientfd;
+}
+
+
+
+/*
+ * uring_relay: copy everything from fd from to fd to until EOF.
+ *
+ * Two registered buffers take turns: while one chunk is being sent
+ * the next one is read, and both are submitted together.
+ * fn sees every chunk before it is sent, a -1 from it stops the relay.
+ *
+ * Returns the bytes relayed or -1 on error
+ */
+ssize_t uring_relay(uring *ring, int from, int to, relay_fn fn, void *arg)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe[2];
+  char *buf[2];
+  ssize_t total = 0;
+  int n, len, sent, i, cur = 0;
+
+  buf[0] = ring->bufs;
+  buf[1] = ring->bufs + URING_BUF_SIZE;
+
+  /* First chunk on its own */
+  if ((sqe = uring_get_sqe(ring)) == NULL)
+  {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = from;
+  sqe->addr = (unsigned long)buf[0];
+  sqe->len = URING_BUF_SIZE;
+  sqe->buf_index = 0;
+  sqe->user_data = OP_RECV;
+  if (uring_wait(ring, cqe, 1) < 0)
+  {
+    return -1;
+  }
+  n = cqe[0].res;
+
+  while (n > 0)
+  {
+    if (fn != NULL && fn(arg, buf[cur], (unsigned int)n) < 0)
+    {
+      return -1;
+    }
+
+    /* Send this chunk and read the next one in the same enter,
+       both or neither are queued */
+    if (uring_sq_room(ring) < 2)
+    {
+      return -1;
+    }
+    len = n;
+    sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = to;
+    sqe->addr = (unsigned long)buf[cur];
+    sqe->len = len;
+    sqe->buf_index = cur;
+    sqe->user_data = OP_SEND;
+    sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = from;
+    sqe->addr = (unsigned long)buf[!cur];
+    sqe->len = URING_BUF_SIZE;
+    sqe->buf_index = !cur;
+    sqe->user_data = OP_RECV;
+    if (uring_wait(ring, cqe, 2) < 0)
+    {
+      return -1;
+    }
+
+    sent = 0;
+    for (i = 0; i < 2; i++)
+    {
+      if (cqe[i].user_data == OP_SEND)
+      {
+        sent = cqe[i].res;
+      }
+      else
+      {
+        n = cqe[i].res;
+      }
+    }
+    if (sent <= 0)
+    {
+      return -1;    /* Client is gone */
+    }
+    /* Short send, finish it before the buffer is reused */
+    if (uring_send_fixed(ring, to, cur, buf[cur] + sent, len - sent) < 0)
+    {
+      return -1;
+    }
+    total += len;
+    cur = !cur;
+  }
+  return (n < 0) ? -1 : total;
+}
+
+
+
+/*
+ * uring_post_accepts: queue n accepts on listenfd, they are
+ * submitted with the next uring_accept_batch
+ */
+void uring_post_accepts(uring *ring, int listenfd, int n)
+{
+  struct io_uring_sqe *sqe;
+
+  while (n-- > 0 && (sqe = uring_get_sqe(ring)) != NULL)
+  {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->user_data = OP_ACCEPT;
+  }
+}
+
+
+
+/*
+ * uring_accept_batch: wait for at least one connection, return all
+ * that are ready in fds (at most max) and put the accepts back.
+ */
+int uring_accept_batch(uring *ring, int listenfd, int *fds, int max)
+{
+  struct io_uring_cqe cqe[URING_ACCEPTS];
+  int n, i, count = 0;
+
+  if (max > URING_ACCEPTS)
+  {
+    max = URING_ACCEPTS;
+  }
+  if (uring_wait(ring, cqe, 1) < 0)
+  {
+    return -1;
+  }
+  n = 1 + uring_reap(ring, cqe + 1, max - 1);
+  for (i = 0; i < n; i++)
+  {
+    if (cqe[i].res >= 0)
+    {
+      fds[count++] = cqe[i].res;
+    }
+  }
+  uring_post_accepts(ring, listenfd, n);
+  return count;
+}
+
+
+
+/*
+ * uring_send_fixed: send the rest of a registered buffer
+ */
+static int uring_send_fixed(uring *ring, int fd, int index,
+                            char *buf, size_t len)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+
+  while (len > 0)
+  {
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->buf_index = index;
+    sqe->user_data = OP_SEND;
+    if (uring_wait(ring, &cqe, 1) < 0 || cqe.res <= 0)
+    {
+      return -1;
+    }
+    buf += cqe.res;
+    len -= cqe.res;
+  }
+  return 0;
+}
+
+
+
+/*
+ * uring_get_sqe: next free submission entry, cleared,
+ * or NULL if the queue is full or the ring was torn down
+ */
+static struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  if (uring_sq_room(ring) == 0)
+  {
+    return NULL;
+  }
+  index = ring->sqe_tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  ring->sqe_tail++;
+  ring->pending++;
+  return sqe;
+}
+
+
+
+/*
+ * uring_sq_room: submission entries uring_get_sqe can still give,
+ * 0 for a ring that was torn down
+ */
+static unsigned uring_sq_room(uring *ring)
+{
+  if (ring->fd < 0)
+  {
+    return 0;
+  }
+  return ring->sq_entries -
+         (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+
+
+/*
+ * uring_enter: submit everything queued and wait for wait_nr
+ * completions (or fewer, if a signal comes in)
+ */
+static int uring_enter(uring *ring, unsigned wait_nr)
+{
+  unsigned head;
+  int ret;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  ret = syscall(__NR_io_uring_enter, ring->fd, ring->sqe_tail - head,
+                wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret < 0 && errno != EINTR)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/*
+ * uring_reap: copy out up to max completions that are ready
+ */
+static int uring_reap(uring *ring, struct io_uring_cqe *out, int max)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  while (head != tail && n < max)
+  {
+    out[n++] = ring->cqes[head & *ring->cq_mask];
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  ring->pending -= n;
+  return n;
+}
+
+
+
+/*
+ * uring_wait: submit and wait until want completions are in out.
+ *
+ * On error the ring is torn down if anything is still pending:
+ * closing it cancels the operations, whose completions would
+ * otherwise be taken for those of the next wait.
+ */
+static int uring_wait(uring *ring, struct io_uring_cqe *out, int want)
+{
+  int got = 0;
+
+  while (got < want)
+  {
+    got += uring_reap(ring, out + got, want - got);
+    if (got < want && uring_enter(ring, 1) < 0)
+    {
+      if (ring->pending > 0)
+      {
+        uring_free(ring);
+      }
+      return -1;
+    }
+  }
+  return got;
+}
@@ -0,0 +1,61 @@
+/*
+ * uring.h: header file for uring.c
+ *
+ * io_uring I/O engine for the proxy, an alternative to the
+ * blocking rio calls. Talks to the kernel with the raw syscalls,
+ * no liburing needed.
+ *
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64         /* Submission queue size            */
+#define URING_BUFS 2             /* Registered buffers per ring      */
+#define URING_BUF_SIZE 16384     /* Size of each registered buffer   */
+#define URING_ACCEPTS 16         /* Accepts kept in flight by main   */
+
+typedef struct uring
+{
+  int fd;
+  /* Submission queue, shared with the kernel */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_entries;
+  unsigned sqe_tail;       /* Our tail, published on submit  */
+  unsigned pending;        /* Operations queued or in flight, not reaped */
+  /* Completion queue, shared with the kernel */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Mappings to undo in uring_free */
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  /* Pool of registered buffers, URING_BUFS of URING_BUF_SIZE */
+  char *bufs;
+} uring;
+
+/* Called on every chunk relayed, before it is sent on */
+typedef int (*relay_fn)(void *arg, char *buf, unsigned int len);
+
+
+/* Function prototypes */
+
+/* Dealing with the ring */
+int uring_init(uring *ring, unsigned entries, int bufs);
+void uring_free(uring *ring);
+
+/* Blocking style operations for a worker thread */
+ssize_t uring_recv(uring *ring, int fd, void *buf, size_t len);
+int uring_send_all(uring *ring, int fd, void *buf, size_t len);
+int uring_sendv_all(uring *ring, int fd, struct iovec *iov, int iovcnt);
+int uring_open_clientfd(uring *ring, char *hostname, char *port);
+ssize_t uring_relay(uring *ring, int from, int to, relay_fn fn, void *arg);
+
+/* Accepting in batches for the main thread */
+void uring_post_accepts(uring *ring, int listenfd, int n);
+int uring_accept_batch(uring *ring, int listenfd, int *fds, int max);
+
+#endif /* __URING_H__ */